@@ -9,12 +9,30 @@
 #include <unordered_map>
 
 #include "camera.h"
+#include "camera_path.h"
+#include "bezier_bench.h"
+#include "entity_bench.h"
+#include "bezier_gpu.h"
+#include "bezier_surface.h"
 #include "error.h"
 #include "file.h"
 #include "shader.h"
 #include "obj_parser.h"
 #include "model.h"
 #include "shadow.h"
+#include "occlusion.h"
+#include "pass_timer.h"
+#include "oit.h"
+#include "clustered.h"
+#include "gbuffer.h"
+#include "entities.h"
+#include "instancing.h"
+#include "static_batch.h"
+#include "vbuffer.h"
+#include "profiler.h"
+#include "frame_stats.h"
+#include "memory_stats.h"
+#include "options.h"
 
 #define STB_IMAGE_IMPLEMENTATION
 #include "texture.h"
@@ -26,30 +44,62 @@ glm::vec3 lightPos = glm::vec3(2.f, 6.f, 7.f);
 
 SCamera Camera;
 
-#define WIDTH 1920
-#define HEIGHT 1080
+// A loaded flythrough drives the camera in place of input while this is set
+CameraPath cameraPath;
+bool scriptedCamera = false;
+CameraRecording cameraRecording;
+
+// Render options, toggled at runtime
+bool occlusionCulling = true;
+bool positionOnlyDepth = true;
+bool depthPrepass = true;
+// Non-moving models drawn from merged world space buffers, one draw per material
+bool staticBatching = true;
+
+enum TransparencyMode {
+	SORTED_TRANSPARENCY,
+	WEIGHTED_OIT
+};
+TransparencyMode transparencyMode = WEIGHTED_OIT;
+
+// Deferred shades opaque pixels once from the G-buffer, the visibility buffer fills that G-buffer from triangle IDs
+// Transparent parts are always forward
+enum ShadingPath {
+	FORWARD_SHADING,
+	DEFERRED_SHADING,
+	VISIBILITY_BUFFER
+};
+ShadingPath shadingPath = FORWARD_SHADING;
+
+// Compiled into the lighting shader as permutation defines
+LightType lightType = DIRECTIONAL_LIGHT;
+ShadowFilter shadowFilter = PCF_SHADOWS;
+bool clusteredLighting = true;
+
+// Grass curves and a flag of surface patches, evaluated by tessellation shaders
+bool bezierGeometry = true;
+float animationTime = 0.f;
+
+// Resolution, sample count and headless benchmark settings from the command line
+RunOptions runOptions;
+
+// Seconds of animation this frame, fixed in headless runs so every run renders the same frames
+float frameDelta = 1.f / 60.f;
+
 #define SH_MAP_WIDTH 20480
 #define SH_MAP_HEIGHT 20480
-
-std::vector<vertex> loadFloor() {
-	std::vector<vertex> vertices;
-	const float size = 0.5f;
-	vertex v;
-	v.col = glm::vec4(1.f, 1.f, 1.f, 1.0f);
-	v.nor = glm::vec3(0.0f, 1.0f, 0.0f);
-	v.tex = glm::vec2(0.0f, 0.0f);
-
-	// Triangle 1
-	v.pos = glm::vec3(-size, -size, -size); vertices.push_back(v);
-	v.pos = glm::vec3(size, -size, size); vertices.push_back(v);
-	v.pos = glm::vec3(size, -size, -size); vertices.push_back(v);
-
-	// Triangle 2
-	v.pos = glm::vec3(-size, -size, -size); vertices.push_back(v);
-	v.pos = glm::vec3(-size, -size, size); vertices.push_back(v);
-	v.pos = glm::vec3(size, -size, size); vertices.push_back(v);
-
-	return vertices;
+#define SCENE_LIGHTS 256
+#define GRASS_BLADES 4000
+
+#define STATS_REPORT_SECONDS 5.0
+
+// True only on the frame the key goes down, for toggles
+bool keyPressedOnce(GLFWwindow* window, int key) {
+	static bool wasDown[GLFW_KEY_LAST + 1] = {};
+	bool down = glfwGetKey(window, key) == GLFW_PRESS;
+	bool pressed = down && !wasDown[key];
+	wasDown[key] = down;
+	return pressed;
 }
 
 void processKeyboard(GLFWwindow* window) {
@@ -57,12 +107,39 @@ void processKeyboard(GLFWwindow* window) {
 	if (glfwGetKey(window, GLFW_KEY_ESCAPE) == GLFW_PRESS)
 		glfwSetWindowShouldClose(window, true);
 
+	// Render option toggles
+	if (keyPressedOnce(window, GLFW_KEY_O))
+		occlusionCulling = !occlusionCulling;
+	if (keyPressedOnce(window, GLFW_KEY_P))
+		positionOnlyDepth = !positionOnlyDepth;
+	if (keyPressedOnce(window, GLFW_KEY_Z))
+		depthPrepass = !depthPrepass;
+	if (keyPressedOnce(window, GLFW_KEY_K))
+		staticBatching = !staticBatching;
+	if (keyPressedOnce(window, GLFW_KEY_T))
+		transparencyMode = (transparencyMode == WEIGHTED_OIT) ? SORTED_TRANSPARENCY : WEIGHTED_OIT;
+	if (keyPressedOnce(window, GLFW_KEY_L))
+		lightType = (LightType)((lightType + 1) % 3);
+	if (keyPressedOnce(window, GLFW_KEY_H))
+		shadowFilter = (ShadowFilter)((shadowFilter + 1) % 3);
+	if (keyPressedOnce(window, GLFW_KEY_G))
+		clusteredLighting = !clusteredLighting;
+	if (keyPressedOnce(window, GLFW_KEY_R))
+		shadingPath = (ShadingPath)((shadingPath + 1) % 3);
+	if (keyPressedOnce(window, GLFW_KEY_B))
+		bezierGeometry = !bezierGeometry;
+	if (keyPressedOnce(window, GLFW_KEY_V) && !cameraPath.positions.empty())
+		scriptedCamera = !scriptedCamera;
+
 	// Light repositioning
 	if (glfwGetKey(window, GLFW_KEY_F) == GLFW_PRESS) {
 		lightDirection = Camera.Front;
 		lightPos = Camera.Position;
 	}
 
+	if (scriptedCamera)
+		return;
+
 	float z_move = 0.f;
 	float x_move = 0.f;
 	float y_move = 0.f;
@@ -112,8 +189,8 @@ void processKeyboard(GLFWwindow* window) {
 }
 
 void MouseCallback(GLFWwindow* window, double xpos, double ypos) {
-	static double lastX = WIDTH / 2;
-	static double lastY = HEIGHT / 2;
+	static double lastX = runOptions.width / 2;
+	static double lastY = runOptions.height / 2;
 	static bool firstMouse = true;
 
 	if (firstMouse) {
@@ -127,6 +204,8 @@ void MouseCallback(GLFWwindow* window, double xpos, double ypos) {
 	lastX = xpos;
 	lastY = ypos;
 
+	if (scriptedCamera)
+		return;
 	MoveAndOrientCamera(Camera, glm::vec3(0.f, 0.f, 0.f), cam_dist, xoffset, yoffset, 0, 0, 0);
 }
 
@@ -134,92 +213,488 @@ void SizeCallback(GLFWwindow* window, int w, int h) {
 	glViewport(0, 0, w, h);
 }
 
-void generateDepthMap(unsigned int shadowShaderProgram, ShadowStruct shadow,
-	glm::mat4 projectedLightSpaceMatrix, std::unordered_map<std::string, model>* models) {
-	glViewport(0, 0, SH_MAP_WIDTH, SH_MAP_HEIGHT);
+glm::mat4 cameraView() {
+	return glm::lookAt(Camera.Position, Camera.Position + Camera.Front, Camera.Up);
+}
+
+glm::mat4 cameraProjection() {
+	return glm::perspective(glm::radians(45.f), (float)runOptions.width / (float)runOptions.height, .01f, 100.f);
+}
+
+// Depth-only passes fetch the position stream unless it's switched off for comparison
+void drawDepthOnly(model& m, unsigned int shaderProgram) {
+	if (positionOnlyDepth)
+		m.drawDepth(shaderProgram);
+	else
+		m.draw(shaderProgram);
+}
+
+// Same choice of stream for every instance at once
+void drawInstancedDepthOnly(InstancedModel& instanced, unsigned int shaderProgram) {
+	if (positionOnlyDepth)
+		drawInstancedDepth(instanced, shaderProgram);
+	else {
+		MaterialPrograms programs = { shaderProgram, shaderProgram };
+		drawInstancedLayer(instanced, programs, false);
+		drawInstancedLayer(instanced, programs, true);
+	}
+}
+
+void generateDepthMap(unsigned int shadowShaderProgram, unsigned int shadowInstancedProgram, const ShadowStruct& shadow,
+	EntityStore* entities, StaticBatch* statics, InstancedModel* chairs, PassTimer* timer) {
+	beginTimedPass(*timer, "shadow");
+	glViewport(0, 0, shadow.width, shadow.height);
 	glBindFramebuffer(GL_FRAMEBUFFER, shadow.FBO);
 	glClear(GL_DEPTH_BUFFER_BIT);
 	glUseProgram(shadowShaderProgram);
-	glUniformMatrix4fv(glGetUniformLocation(shadowShaderProgram, "projectedLightSpaceMatrix"), 1, GL_FALSE, glm::value_ptr(projectedLightSpaceMatrix));
 
 	// Model drawing
 	glDisable(GL_BLEND);
 
-	// Opaque models
-	(*models).at("floor").draw(shadowShaderProgram);
+	// The light sees more than the camera, so every caster is drawn whatever the frustum cull said
+	if (staticBatching)
+		drawStaticBatchDepth(*statics, shadowShaderProgram);
+	for (Entity entity : entitiesWith(*entities, ENTITY_SHADOW_CASTER)) {
+		if (!(staticBatching && isStaticBatched(*statics, entity)))
+			drawDepthOnly(entityMesh(*entities, entity), shadowShaderProgram);
+	}
 
-	(*models).at("sonic").draw(shadowShaderProgram);
-	(*models).at("sonic").rotate(glm::radians(-0.5f), glm::vec3(0.f, 1.f, 0.f));
+	drawInstancedDepthOnly(*chairs, shadowInstancedProgram);
 
-	(*models).at("desk").draw(shadowShaderProgram);
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	glEnable(GL_BLEND);
+	endTimedPass(*timer, "shadow");
+}
 
-	(*models).at("lamp").draw(shadowShaderProgram);
+// Sorts by view depth of each entity's world bounds centre, nearest first
+std::vector<Entity> sortFrontToBack(EntityStore* entities, const std::vector<Entity>& unsorted, glm::mat4 view) {
+	std::vector<std::pair<float, Entity>> depths;
+	for (Entity entity : unsorted) {
+		glm::vec4 center = view * glm::vec4(entityCenter(*entities, entity), 1.f);
+		depths.push_back(std::make_pair(-center.z, entity));
+	}
+	std::sort(depths.begin(), depths.end());
 
-	(*models).at("chair").draw(shadowShaderProgram);
+	std::vector<Entity> sorted;
+	for (const auto& depth : depths)
+		sorted.push_back(depth.second);
+	return sorted;
+}
 
-	// Models with transparency
-	(*models).at("warhawk").draw(shadowShaderProgram);
+// Every light model, shadow filter, texturing, transparency and clustering combination reachable at runtime
+std::vector<ShaderPermutation> allPhongPermutations() {
+	std::vector<ShaderPermutation> permutations;
+	for (int light = 0; light < 3; light++) {
+		for (int filter = 0; filter < 3; filter++) {
+			for (int variant = 0; variant < 8; variant++) {
+				ShaderPermutation permutation;
+				permutation.light = (LightType)light;
+				permutation.shadow = (ShadowFilter)filter;
+				permutation.textured = (variant & 1) != 0;
+				permutation.weightedOIT = (variant & 2) != 0;
+				permutation.clusteredLights = (variant & 4) != 0;
+				permutations.push_back(permutation);
+
+				// Instanced meshes are opaque, weighted OIT variants are compiled if one ever needs them
+				if (!permutation.weightedOIT) {
+					permutation.instanced = true;
+					permutations.push_back(permutation);
+				}
+			}
+		}
+	}
+
+	// G-buffer writes don't depend on the lighting
+	for (int variant = 0; variant < 4; variant++) {
+		ShaderPermutation permutation;
+		permutation.textured = (variant & 1) != 0;
+		permutation.instanced = (variant & 2) != 0;
+		permutation.gbuffer = true;
+		permutations.push_back(permutation);
+	}
+	return permutations;
+}
+
+// Every deferred lighting pass variant, albedo already includes the texture
+std::vector<ShaderPermutation> allDeferredPermutations() {
+	std::vector<ShaderPermutation> permutations;
+	for (int light = 0; light < 3; light++) {
+		for (int filter = 0; filter < 3; filter++) {
+			for (int clustered = 0; clustered < 2; clustered++) {
+				ShaderPermutation permutation;
+				permutation.light = (LightType)light;
+				permutation.shadow = (ShadowFilter)filter;
+				permutation.textured = false;
+				permutation.clusteredLights = clustered != 0;
+				permutation.deferredLighting = true;
+				permutations.push_back(permutation);
+			}
+		}
+	}
+	return permutations;
+}
+
+// Uniforms that are constant over the frame, set on every variant in use
+void setFrameUniforms(unsigned int renderShaderProgram) {
+	glUseProgram(renderShaderProgram);
+	glUniform1i(glGetUniformLocation(renderShaderProgram, "shadowMap"), 1);
+
+	glUniform3f(glGetUniformLocation(renderShaderProgram, "lightDirection"), lightDirection.x, lightDirection.y, lightDirection.z);
+	glUniform3f(glGetUniformLocation(renderShaderProgram, "lightColour"), 1.f, 1.f, 1.f);
+	glUniform3f(glGetUniformLocation(renderShaderProgram, "lightPos"), lightPos.x, lightPos.y, lightPos.z);
+	glUniform3f(glGetUniformLocation(renderShaderProgram, "camPos"), Camera.Position.x, Camera.Position.y, Camera.Position.z);
+}
+
+// Textured and untextured variants of the current light model and shadow filter
+MaterialPrograms getMaterialPrograms(ShaderCache* phongShaders, ClusteredLights* clustered, bool weightedOIT, bool instanced = false) {
+	ShaderPermutation permutation;
+	permutation.light = lightType;
+	permutation.shadow = shadowFilter;
+	permutation.weightedOIT = weightedOIT;
+	permutation.clusteredLights = clusteredLighting;
+	permutation.instanced = instanced;
+
+	MaterialPrograms programs;
+	permutation.textured = true;
+	programs.textured = GetShaderPermutation(*phongShaders, permutation);
+	permutation.textured = false;
+	programs.untextured = GetShaderPermutation(*phongShaders, permutation);
+
+	setFrameUniforms(programs.textured);
+	setFrameUniforms(programs.untextured);
+
+	if (clusteredLighting) {
+		setClusterUniforms(*clustered, programs.textured, cameraView(), cameraProjection(), runOptions.width, runOptions.height);
+		setClusterUniforms(*clustered, programs.untextured, cameraView(), cameraProjection(), runOptions.width, runOptions.height);
+	}
+	return programs;
+}
+
+// Textured and untextured G-buffer writers
+MaterialPrograms getGBufferPrograms(ShaderCache* phongShaders, bool instanced = false) {
+	ShaderPermutation permutation;
+	permutation.gbuffer = true;
+	permutation.instanced = instanced;
+
+	MaterialPrograms programs;
+	permutation.textured = true;
+	programs.textured = GetShaderPermutation(*phongShaders, permutation);
+	permutation.textured = false;
+	programs.untextured = GetShaderPermutation(*phongShaders, permutation);
+	return programs;
+}
+
+// Full screen lighting from the G-buffer for the current light model and shadow filter
+unsigned int getDeferredLightingProgram(ShaderCache* deferredShaders, ClusteredLights* clustered) {
+	ShaderPermutation permutation;
+	permutation.light = lightType;
+	permutation.shadow = shadowFilter;
+	permutation.textured = false;
+	permutation.clusteredLights = clusteredLighting;
+	permutation.deferredLighting = true;
+
+	unsigned int program = GetShaderPermutation(*deferredShaders, permutation);
+	setFrameUniforms(program);
+	if (clusteredLighting)
+		setClusterUniforms(*clustered, program, cameraView(), cameraProjection(), runOptions.width, runOptions.height);
+
+	glm::mat4 inverseViewProjection = glm::inverse(passMatrices.viewProjection);
+	glUniformMatrix4fv(glGetUniformLocation(program, "inverseViewProjection"), 1, GL_FALSE, glm::value_ptr(inverseViewProjection));
+	glUniformMatrix4fv(glGetUniformLocation(program, "lightSpace"), 1, GL_FALSE, glm::value_ptr(passMatrices.lightSpace));
+	return program;
+}
+
+// Transparent faces of every model, after all opaque geometry
+void renderTransparent(ShaderCache* phongShaders, ClusteredLights* clustered, EntityStore* entities,
+	StaticBatch* statics, InstancedModel* chairs, OcclusionCuller* culler, const SceneStruct& scene, const OITStruct& oit, glm::mat4 view) {
+	std::vector<Entity> transparent;
+	for (Entity entity : entitiesWith(*entities, ENTITY_TRANSPARENT | ENTITY_VISIBLE)) {
+		if (!(staticBatching && isStaticBatched(*statics, entity)))
+			transparent.push_back(entity);
+	}
+	bool instancedTransparency = chairs->mesh->hasTransparency();
+	bool batchedTransparency = staticBatching && staticBatchHasTransparency(*statics);
+	if (transparent.empty() && !instancedTransparency && !batchedTransparency)
+		return;
+
+	MaterialPrograms programs = getMaterialPrograms(phongShaders, clustered, transparencyMode == WEIGHTED_OIT);
+
+	if (transparencyMode == SORTED_TRANSPARENCY) {
+		// Exact per object, back to front
+		transparent = sortFrontToBack(entities, transparent, view);
+		std::reverse(transparent.begin(), transparent.end());
+
+		glEnable(GL_BLEND);
+		glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+		glDepthMask(GL_FALSE);
+	}
+	else {
+		// Weighted blended, any order in one batch
+		beginOIT(oit);
+	}
+
+	// Only gated on tests issued this frame, the visibility path issues none and older results may be stale
+	bool occlusionGated = occlusionCulling && culler->testsIssuedThisFrame;
+	for (Entity entity : transparent) {
+		if (occlusionGated && isOccludee(*culler, entity))
+			drawOccludee(*culler, entity, entityMesh(*entities, entity), programs, Camera.Position, true);
+		else
+			entityMesh(*entities, entity).drawLayer(programs, true);
+	}
+
+	// Neither batched nor instanced faces are sorted among themselves, sorted mode draws them last
+	if (batchedTransparency)
+		drawStaticBatchLayer(*statics, programs, true);
+	if (instancedTransparency)
+		drawInstancedLayer(*chairs, getMaterialPrograms(phongShaders, clustered, transparencyMode == WEIGHTED_OIT, true), true);
+
+	if (transparencyMode == SORTED_TRANSPARENCY) {
+		glDepthMask(GL_TRUE);
+		return;
+	}
+
+	compositeOIT(oit, scene);
+}
+
+// Opaque models and the opaque layer of occludees, lit directly or written to the G-buffer
+void renderOpaque(ShaderCache* phongShaders, unsigned int prepassShaderProgram, unsigned int prepassInstancedProgram,
+	const GBufferStruct& gbuffer, ClusteredLights* clustered, EntityStore* entities, StaticBatch* statics,
+	InstancedModel* chairs, OcclusionCuller* culler, PassTimer* timer, glm::mat4 view, glm::mat4 projection) {
+	// Deferred draws the same opaque passes into the G-buffer, which shares the scene's depth
+	MaterialPrograms programs, instancedPrograms;
+	if (shadingPath == DEFERRED_SHADING) {
+		programs = getGBufferPrograms(phongShaders);
+		instancedPrograms = getGBufferPrograms(phongShaders, true);
+		beginGBuffer(gbuffer);
+	}
+	else {
+		programs = getMaterialPrograms(phongShaders, clustered, false);
+		instancedPrograms = getMaterialPrograms(phongShaders, clustered, false, true);
+	}
+
+	// Opaque models in the frustum, front to back so hidden fragments fail the depth test early
+	// The static batch goes first, its merged ranges have no single depth to sort by
+	// Without occlusion culling the occludees are ordinary opaque models
+	std::vector<Entity> opaque;
+	for (Entity entity : entitiesWith(*entities, ENTITY_VISIBLE)) {
+		bool occluder = hasFlags(*entities, entity, ENTITY_OCCLUDER) && !(staticBatching && isStaticBatched(*statics, entity));
+		if (occluder || (!occlusionCulling && hasFlags(*entities, entity, ENTITY_OCCLUDEE)))
+			opaque.push_back(entity);
+	}
+	opaque = sortFrontToBack(entities, opaque, view);
+
+	if (depthPrepass) {
+		beginTimedPass(*timer, "prepass");
+		glUseProgram(prepassShaderProgram);
+		glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+
+		if (staticBatching)
+			drawStaticBatchDepth(*statics, prepassShaderProgram, true);
+		for (Entity entity : opaque)
+			entityMesh(*entities, entity).drawDepth(prepassShaderProgram, true);
+		drawInstancedDepth(*chairs, prepassInstancedProgram, true);
+
+		glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+		endTimedPass(*timer, "prepass");
+
+		// Only the nearest surface of each pixel gets shaded
+		glDepthFunc(GL_EQUAL);
+		glDepthMask(GL_FALSE);
+	}
+
+	// Opaque draws don't need blending
+	glDisable(GL_BLEND);
+
+	beginTimedPass(*timer, "opaque");
+	beginTimedPass(*timer, "opaque samples", GL_SAMPLES_PASSED);
+	if (staticBatching)
+		drawStaticBatchLayer(*statics, programs, false);
+	for (Entity entity : opaque)
+		entityMesh(*entities, entity).drawLayer(programs, false);
+	drawInstancedLayer(*chairs, instancedPrograms, false);
+	endTimedPass(*timer, "opaque samples");
+	endTimedPass(*timer, "opaque");
+
+	glDepthFunc(GL_LESS);
+	glDepthMask(GL_TRUE);
+
+	beginTimedPass(*timer, "occludees");
+	if (occlusionCulling) {
+		// Expensive models are tested against the occluders above, and drawn based on last frame's test
+		issueOcclusionTests(*culler, entities, projection * view);
+
+		for (Entity entity : entitiesWith(*entities, ENTITY_OCCLUDEE | ENTITY_VISIBLE))
+			drawOccludee(*culler, entity, entityMesh(*entities, entity), programs, Camera.Position);
+	}
+	endTimedPass(*timer, "occludees");
+}
+
+// Opaque, forward shaded after the rest of the opaque scene on every path
+void renderBeziers(TessellatedBeziers* grass, TessellatedBeziers* flag, glm::mat4 viewProjection) {
+	glDisable(GL_BLEND);
+
+	glUseProgram(grass->program);
+	glUniform3f(glGetUniformLocation(grass->program, "rootColour"), .1f, .3f, .05f);
+	glUniform3f(glGetUniformLocation(grass->program, "tipColour"), .5f, .8f, .2f);
+	drawTessellatedBeziers(*grass, viewProjection, runOptions.width, runOptions.height);
+
+	// The flag is seen from both sides
+	glDisable(GL_CULL_FACE);
+	glUseProgram(flag->program);
+	glUniform3f(glGetUniformLocation(flag->program, "lightDirection"), lightDirection.x, lightDirection.y, lightDirection.z);
+	glUniform3f(glGetUniformLocation(flag->program, "lightColour"), 1.f, 1.f, 1.f);
+	glUniform3f(glGetUniformLocation(flag->program, "patchColour"), .8f, .1f, .1f);
+	drawTessellatedBeziers(*flag, viewProjection, runOptions.width, runOptions.height);
+	glEnable(GL_CULL_FACE);
 
-	glBindFramebuffer(GL_FRAMEBUFFER, 0);
 	glEnable(GL_BLEND);
 }
 
-void renderWithShadow(unsigned int renderShaderProgram, ShadowStruct shadow,
-	glm::mat4 projectedLightSpaceMatrix, std::unordered_map<std::string, model>* models) {
-	glViewport(0, 0, WIDTH, HEIGHT);
+void renderWithShadow(ShaderCache* phongShaders, ShaderCache* deferredShaders, unsigned int prepassShaderProgram,
+	unsigned int prepassInstancedProgram, const ShadowStruct& shadow, const SceneStruct& scene, const GBufferStruct& gbuffer,
+	VisibilityBuffer* visibility, const OITStruct& oit, ClusteredLights* clustered, TessellatedBeziers* grass, TessellatedBeziers* flag,
+	EntityStore* entities, StaticBatch* statics, InstancedModel* chairs, OcclusionCuller* culler, PassTimer* timer) {
+	glViewport(0, 0, runOptions.width, runOptions.height);
+	glBindFramebuffer(GL_FRAMEBUFFER, scene.FBO);
 
 	static const GLfloat bgd[] = { .9f, .9f, .9f, 1.f };
 	glClearBufferfv(GL_COLOR, 0, bgd);
 	glClear(GL_DEPTH_BUFFER_BIT);
 	glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
 
-	glUseProgram(renderShaderProgram);
-
 	glActiveTexture(GL_TEXTURE1);
 	glBindTexture(GL_TEXTURE_2D, shadow.Texture);
-	glUniform1i(glGetUniformLocation(renderShaderProgram, "shadowMap"), 1);
 
-	glUniformMatrix4fv(glGetUniformLocation(renderShaderProgram, "projectedLightSpaceMatrix"), 1, GL_FALSE, glm::value_ptr(projectedLightSpaceMatrix));
-	glUniform3f(glGetUniformLocation(renderShaderProgram, "lightDirection"), lightDirection.x, lightDirection.y, lightDirection.z);
-	glUniform3f(glGetUniformLocation(renderShaderProgram, "lightColour"), 1.f, 1.f, 1.f);
-	glUniform3f(glGetUniformLocation(renderShaderProgram, "lightPos"), lightPos.x, lightPos.y, lightPos.z);
-	glUniform3f(glGetUniformLocation(renderShaderProgram, "camPos"), Camera.Position.x, Camera.Position.y, Camera.Position.z);
-
-	glm::mat4 view = glm::mat4(1.f);
-	view = glm::lookAt(Camera.Position, Camera.Position + Camera.Front, Camera.Up);
-	glUniformMatrix4fv(glGetUniformLocation(renderShaderProgram, "view"), 1, GL_FALSE, glm::value_ptr(view));
+	// Model matrices are premultiplied with these on the CPU, see setPassMatrices
+	glm::mat4 view = cameraView();
+	glm::mat4 projection = cameraProjection();
 
-	glm::mat4 projection = glm::mat4(1.f);
-	projection = glm::perspective(glm::radians(45.f), (float)WIDTH / (float)HEIGHT, .01f, 100.f);
-	glUniformMatrix4fv(glGetUniformLocation(renderShaderProgram, "projection"), 1, GL_FALSE, glm::value_ptr(projection));
+	if (clusteredLighting) {
+		beginTimedPass(*timer, "light binning");
+		binLights(*clustered, view, projection, runOptions.width, runOptions.height);
+		endTimedPass(*timer, "light binning");
+	}
 
 	// Model drawing
+	if (shadingPath == VISIBILITY_BUFFER) {
+		// Every opaque triangle is rasterised once into IDs, so there is nothing for a pre-pass or occlusion tests to save
+		beginTimedPass(*timer, "visibility");
+		drawVisibility(*visibility, entities);
+		endTimedPass(*timer, "visibility");
+
+		beginTimedPass(*timer, "visibility resolve");
+		resolveVisibility(*visibility, entities, projection * view);
+		endTimedPass(*timer, "visibility resolve");
+
+		// Instances go straight into the resolved G-buffer, tested against the visibility depth
+		beginTimedPass(*timer, "instances");
+		glBindFramebuffer(GL_FRAMEBUFFER, gbuffer.FBO);
+		drawInstancedLayer(*chairs, getGBufferPrograms(phongShaders, true), false);
+		endTimedPass(*timer, "instances");
+	}
+	else
+		renderOpaque(phongShaders, prepassShaderProgram, prepassInstancedProgram, gbuffer, clustered, entities, statics, chairs,
+			culler, timer, view, projection);
+
+	if (shadingPath != FORWARD_SHADING) {
+		beginTimedPass(*timer, "deferred lighting");
+		deferredLighting(gbuffer, scene, getDeferredLightingProgram(deferredShaders, clustered));
+		endTimedPass(*timer, "deferred lighting");
+	}
 
-	// Opaque models
-	(*models).at("floor").draw(renderShaderProgram);
+	if (bezierGeometry) {
+		beginTimedPass(*timer, "bezier");
+		renderBeziers(grass, flag, projection * view);
+		endTimedPass(*timer, "bezier");
+	}
 
-	(*models).at("sonic").draw(renderShaderProgram);
-	(*models).at("sonic").rotate(glm::radians(-0.5f), glm::vec3(0.f, 1.f, 0.f));
+	beginTimedPass(*timer, "transparent");
+	renderTransparent(phongShaders, clustered, entities, statics, chairs, culler, scene, oit, view);
+	endTimedPass(*timer, "transparent");
 
-	(*models).at("desk").draw(renderShaderProgram);
+	endOcclusionFrame(*culler);
+}
 
-	(*models).at("lamp").draw(renderShaderProgram);
+// Stats overlay, shown in the window title since there is no text rendering
+void updateStatsOverlay(GLFWwindow* window, const OcclusionCuller& culler, const PassTimer& timer) {
+	static double lastUpdate = 0.0;
+	static int frames = 0;
+	frames++;
+
+	double now = glfwGetTime();
+	if (now - lastUpdate < 0.5)
+		return;
+
+	// GL_SAMPLES_PASSED counts every covered MSAA sample, so divide by the sample count as well to get layers per pixel
+	double overdraw = lastPass(timer, "opaque samples") / ((double)runOptions.width * runOptions.height * runOptions.samples);
+
+	// Everything that shades opaque pixels on the current path, for comparing the paths
+	static const char* pathNames[] = { "forward", "deferred", "visibility buffer" };
+	double opaqueShading;
+	if (shadingPath == VISIBILITY_BUFFER)
+		opaqueShading = lastPass(timer, "visibility") + lastPass(timer, "visibility resolve");
+	else
+		opaqueShading = lastPass(timer, "opaque") + lastPass(timer, "occludees") + (depthPrepass ? lastPass(timer, "prepass") : 0.0);
+	if (shadingPath != FORWARD_SHADING)
+		opaqueShading += lastPass(timer, "deferred lighting");
+
+	char title[512];
+	snprintf(title, sizeof(title), "Assessment 2 | %.1f fps | occlusion %s: %u queries, %u skipped, %u false positives"
+		" | prepass %s: %.2f ms, opaque %.2f ms, %.2fx overdraw | %s opaque shading %.2f ms",
+		frames / (now - lastUpdate), occlusionCulling ? "on" : "off",
+		culler.lastFrame.queriesIssued, culler.lastFrame.objectsSkipped, culler.lastFrame.falsePositives,
+		depthPrepass ? "on" : "off", depthPrepass ? lastPass(timer, "prepass") : 0.0,
+		lastPass(timer, "opaque"), overdraw, pathNames[shadingPath], opaqueShading);
+	glfwSetWindowTitle(window, title);
+
+	lastUpdate = now;
+	frames = 0;
+}
 
-	(*models).at("chair").draw(renderShaderProgram);
+// Outlives every GL handle in main, deletes what they and the profiler queued while the context is still current
+struct ContextScope {
+	RenderContext& context;
 
-	// Models with transparency
-	(*models).at("warhawk").draw(renderShaderProgram);
-}
+	~ContextScope() {
+		releaseProfilerQueries();
+		flushGpuDeletions();
+		printGpuResourceStats(stdout);
+		destroyRenderContext(context);
+	}
+};
 
 int main(int argc, char** argv) {
-	glfwInit();
-
-	glfwWindowHint(GLFW_SAMPLES, 8);
-	GLFWwindow* window = glfwCreateWindow(WIDTH, HEIGHT, "Assessment 2", NULL, NULL);
-	glfwMakeContextCurrent(window);
-	glfwSetWindowSizeCallback(window, SizeCallback);
+	runOptions = parse_run_options(argc, argv);
+	bool headless = runOptions.headless;
+	memoryTracker.gpuBudget = (size_t)(runOptions.gpuBudgetMB * 1048576.0);
+	memoryTracker.cpuBudget = (size_t)(runOptions.cpuBudgetMB * 1048576.0);
+
+	if (runOptions.benchBezier) {
+		runBezierBenchmark(stdout);
+		return 0;
+	}
+	if (runOptions.benchEntities > 0) {
+		runEntityBenchmark(stdout, (size_t)runOptions.benchEntities);
+		return 0;
+	}
 
-	gl3wInit();
+	RenderContext renderContext;
+	if (!createRenderContext(renderContext, runOptions.width, runOptions.height, "Assessment 2", headless))
+		return 1;
+	makeRenderContextCurrent(renderContext);
+	if (!loadGlFunctions(renderContext)) {
+		fprintf(stderr, "Could not load the OpenGL functions\n");
+		destroyRenderContext(renderContext);
+		return 1;
+	}
+	// NULL in Linux headless runs, which have no window
+	GLFWwindow* window = renderContext.window;
+	if (window != NULL)
+		glfwSetWindowSizeCallback(window, SizeCallback);
+	// Every GL handle below is declared after this, so they all queue their names before it deletes them
+	ContextScope context = { renderContext };
+	printf("OpenGL %s on %s\n", glGetString(GL_VERSION), glGetString(GL_RENDERER));
+	initProfilerGpu();
 
 	glEnable(GL_DEBUG_OUTPUT);
 	glDebugMessageCallback(DebugCallback, 0);
@@ -233,64 +708,280 @@ int main(int argc, char** argv) {
 	glCullFace(GL_BACK);
 
 	ShadowStruct shadow = setup_shadowmap(SH_MAP_WIDTH, SH_MAP_HEIGHT);
+	SceneStruct scene = setup_scene(runOptions.width, runOptions.height, runOptions.samples);
+	// Stands in for the window's framebuffer when there is nothing to show
+	OffscreenTarget offscreen;
+	if (headless)
+		offscreen = setup_offscreen_target(runOptions.width, runOptions.height);
+	unsigned int presentFBO = offscreen.FBO;
+
+	InitProgramCache();
+	double shaderStart = profilerNow();
+
+	GpuProgram shadow_program(CompileShader("shadow.vert", "shadow.frag"));
+	GpuProgram occlusion_program(CompileShader("occlusion.vert", "shadow.frag"));
+	GpuProgram prepass_program(CompileShader("prepass.vert", "shadow.frag"));
+	GpuProgram shadow_instanced_program(CompileShader("shadow.vert", "shadow.frag", "#define INSTANCED\n"));
+	GpuProgram prepass_instanced_program(CompileShader("prepass.vert", "shadow.frag", "#define INSTANCED\n"));
+	GpuProgram oit_program(CompileShader("fullscreen.vert", "oit_composite.frag"));
+	GpuProgram cluster_program(CompileComputeShader("cluster.comp"));
+	GpuProgram visibility_program(CompileShader("prepass.vert", "vbuffer.frag"));
+	GpuProgram classify_program(CompileShader("fullscreen.vert", "vbuffer_classify.frag"));
+	GpuProgram resolve_program(CompileShader("vbuffer_material.vert", "vbuffer_resolve.frag"));
+	GpuProgram curve_program(CompileTessellationShader("bezier.vert", "bezier_curve.tesc", "bezier_curve.tese", "bezier_curve.frag"));
+	GpuProgram patch_program(CompileTessellationShader("bezier.vert", "bezier_patch.tesc", "bezier_patch.tese", "bezier_patch.frag"));
+
+	// Variants needed for the first frame are built now, every other one in the background
+	ShaderCache phong_shaders = setup_shader_cache("phong.vert", "phong.frag");
+	std::vector<ShaderPermutation> permutations = allPhongPermutations();
+	for (const auto& permutation : permutations) {
+		if (permutation.light == lightType && permutation.shadow == shadowFilter && permutation.clusteredLights == clusteredLighting)
+			GetShaderPermutation(phong_shaders, permutation);
+	}
+	PrewarmShaderCache(phong_shaders, renderContext, permutations);
+
+	ShaderCache deferred_shaders = setup_shader_cache("fullscreen.vert", "phong.frag");
+	PrewarmShaderCache(deferred_shaders, renderContext, allDeferredPermutations());
+
+	printf("Shader startup took %.1f ms\n", profilerNow() - shaderStart);
+	printProgramCacheStats(stdout);
 
-	GLuint program = CompileShader("phong.vert", "phong.frag");
-	GLuint shadow_program = CompileShader("shadow.vert", "shadow.frag");
+	OITStruct oit = setup_oit(scene, oit_program);
+	GBufferStruct gbuffer = setup_gbuffer(scene);
+
+	// Near and far match cameraProjection
+	ClusteredLights clustered = setup_clustered_lights(cluster_program, makeSceneLights(SCENE_LIGHTS), .01f, 100.f);
+	printf("Clustered lighting: %d lights, binned on the %s\n", SCENE_LIGHTS, clustered.gpuBinning ? "GPU" : "CPU");
+
+	// Only control points are uploaded, animating them is one buffer update each per frame
+	TessellatedBeziers grass = setup_tessellated_beziers(curve_program,
+		makeGrassCurves(GRASS_BLADES, glm::vec3(2.f, -1.25f, -5.f), 2.5f, 1), 4);
+	glm::vec3 flagPole = glm::vec3(-3.f, 1.2f, -7.f);
+	TessellatedBeziers flag = setup_tessellated_beziers(patch_program, makeFlagPatches(4, 3, flagPole, 2.f, 1.2f), 16);
+	printf("Bezier geometry: %d grass curves, %zu flag patches\n", GRASS_BLADES, flag.controls.size() / 16);
+
+	OcclusionCuller culler = setup_occlusion(occlusion_program);
+
+	PassTimer timer;
+	FrameStats frameStats = setup_frame_stats(runOptions.hitchThresholdMs, STATS_REPORT_SECONDS);
 
 	InitCamera(Camera);
-	glfwSetCursorPosCallback(window, MouseCallback);
-	glfwSetInputMode(window, GLFW_CURSOR, GLFW_CURSOR_DISABLED);
-
-	// Models
-	std::unordered_map<std::string, model> models;
-
-	model warhawk("objs/warhawk/p40.obj", "objs/warhawk/");
-	warhawk.scale(0.2f);
-	warhawk.translate(vec3(3.f, -2.2f, -11.f));
-	warhawk.rotate(glm::radians(-13.f), vec3(0.f, 0.f, 1.f));
-	models.emplace("warhawk", warhawk);
-
-	model sonic("objs/sonic/Sonic.obj", "objs/sonic/");
-	sonic.scale(0.2f);
-	sonic.translate(vec3(3.f, -2.5f, -9.f));
-	models.emplace("sonic", sonic);
-
-	model desk("objs/desk/desk.obj", "objs/desk/");
-	desk.translate(vec3(0.f, -0.5f, -2.f));
-	models.emplace("desk", desk);
-
-	model lamp("objs/lamp/desk-lamp.obj", "objs/lamp/");
-	lamp.scale(0.5f);
-	lamp.translate(vec3(-1.5f, -0.99f, -4.6f));
-	models.emplace("lamp", lamp);
-
-	model chair("objs/chair/office-chair.obj", "objs/chair/");
-	chair.rotate(glm::radians(180.f), glm::vec3(0.f, 1.f, 0.f));
-	chair.translate(glm::vec3(0.3f, -1.3f, 1.f));
-	models.emplace("chair", chair);
-
-	std::vector<vertex> floor_verts = loadFloor();
-	model floor(floor_verts);
-	floor.translate(glm::vec3(0.f, -1.2f, 0.f));
-	floor.scale(glm::vec3(100.f, 0.1f, 100.f));
-	models.emplace("floor", floor);
-
-	while (!glfwWindowShouldClose(window)) {
+	if (!headless) {
+		glfwSetCursorPosCallback(window, MouseCallback);
+		glfwSetInputMode(window, GLFW_CURSOR, GLFW_CURSOR_DISABLED);
+	}
+	if (runOptions.shadingPath >= 0)
+		shadingPath = (ShadingPath)runOptions.shadingPath;
+
+	if (runOptions.cameraPath != NULL) {
+		if (!load_camera_path(runOptions.cameraPath, cameraPath)) {
+			if (headless)
+				return 1;
+		}
+		else {
+			scriptedCamera = true;
+			applyCameraPath(cameraPath, Camera);
+
+			// Headless runs fly the path once, so every run covers the same viewpoints
+			if (headless) {
+				cameraPath.loop = false;
+				if (runOptions.frames == 0)
+					runOptions.frames = (unsigned int)ceil(cameraPath.totalLength / runOptions.cameraSpeed / runOptions.timestep) + 1;
+			}
+		}
+	}
+
+	// Models, each built in place in the store and placed by its entity
+	EntityStore entities;
+	const uint32_t occluderFlags = ENTITY_SHADOW_CASTER | ENTITY_OCCLUDER | ENTITY_STATIC;
+	const uint32_t occludeeFlags = ENTITY_SHADOW_CASTER | ENTITY_OCCLUDEE;
+
+	// Transforms were scale, translate, rotate on the model matrix, the uniform scale carries over to the translation
+	Entity warhawk = createEntity(entities, "warhawk", emplaceMesh(entities, "objs/warhawk/p40.obj", "objs/warhawk/"), occludeeFlags);
+	setEntityTransform(entities, warhawk, 0.2f * vec3(3.f, -2.2f, -11.f), glm::angleAxis(glm::radians(-13.f), vec3(0.f, 0.f, 1.f)),
+		vec3(0.2f));
+
+	Entity sonic = createEntity(entities, "sonic", emplaceMesh(entities, "objs/sonic/Sonic.obj", "objs/sonic/"), occludeeFlags);
+	setEntityTransform(entities, sonic, 0.2f * vec3(3.f, -2.5f, -9.f), glm::quat(1.f, 0.f, 0.f, 0.f), vec3(0.2f));
+
+	Entity desk = createEntity(entities, "desk", emplaceMesh(entities, "objs/desk/desk.obj", "objs/desk/"), occluderFlags);
+	setEntityTransform(entities, desk, vec3(0.f, -0.5f, -2.f), glm::quat(1.f, 0.f, 0.f, 0.f), vec3(1.f));
+
+	Entity lamp = createEntity(entities, "lamp", emplaceMesh(entities, "objs/lamp/desk-lamp.obj", "objs/lamp/"), occluderFlags);
+	setEntityTransform(entities, lamp, 0.5f * vec3(-1.5f, -0.99f, -4.6f), glm::quat(1.f, 0.f, 0.f, 0.f), vec3(0.5f));
+
+	// Turned round first, so its offset is turned with it
+	Entity chair = createEntity(entities, "chair", emplaceMesh(entities, "objs/chair/office-chair.obj", "objs/chair/"), occluderFlags);
+	setEntityTransform(entities, chair, vec3(-0.3f, -1.3f, -1.f), glm::angleAxis(glm::radians(180.f), vec3(0.f, 1.f, 0.f)), vec3(1.f));
+
+	// Rows of chairs behind the scene, all sharing the chair's buffers and drawn with one call per material
+	std::vector<glm::mat4> chairTransforms = makeInstanceGrid(runOptions.instances, glm::vec3(0.f, -1.3f, -14.f), 1.2f, 1.4f, glm::radians(180.f));
+	std::vector<glm::vec4> chairTints;
+	srand(2);
+	for (size_t i = 0; i < chairTransforms.size(); i++)
+		chairTints.push_back(glm::vec4(randomRange(.6f, 1.f), randomRange(.6f, 1.f), randomRange(.6f, 1.f), 1.f));
+	InstancedModel chairs = setup_instanced_model(&entities.meshes[entities.mesh[chair]], chairTransforms, chairTints);
+
+	// Floor is a 10 x 10 grid of bicubic patches, tessellated once for the starting camera
+	std::vector<BezierSurfacePatch> floorPatches = makeFlatPatches(glm::vec3(-50.f, -1.25f, 50.f), glm::vec2(100.f, 100.f), 10, 10, 1.f);
+	SurfaceLod floorLod = surfaceLodForCamera(Camera.Position, glm::radians(45.f), runOptions.height, 32.f, 16);
+	std::vector<vertex> floor_verts = tessellateBezierSurface(floorPatches, floorLod, glm::vec4(1.f), std::thread::hardware_concurrency());
+	printf("Floor: %zu patches, %zu vertices\n", floorPatches.size(), floor_verts.size());
+	createEntity(entities, "floor", emplaceMesh(entities, floor_verts), occluderFlags);
+
+	updateWorldTransforms(entities);
+	size_t depthPositions = 0, uploadedVertices = 0;
+	for (const model& mesh : entities.meshes) {
+		depthPositions += mesh.getDepthPositionCount();
+		uploadedVertices += mesh.getVertexCount();
+	}
+	printf("Scene: %zu entities, %zu meshes, depth stream %zu unique positions for %zu vertices\n",
+		entityCount(entities), entities.meshes.size(), depthPositions, uploadedVertices);
+	printTextureRegistryStats(stdout);
+
+	for (Entity entity : entitiesWith(entities, ENTITY_OCCLUDEE))
+		registerOccludee(culler, entity);
+
+	// Everything that never moves, Sonic turns and stays separate
+	StaticBatch statics = setup_static_batch(&entities, entitiesWith(entities, ENTITY_STATIC));
+
+	// The visibility buffer already draws one position stream per entity, it keeps the models unbatched
+	VisibilityBuffer visibility = setup_visibility_buffer(scene, gbuffer, visibility_program, classify_program,
+		resolve_program, &entities, entitiesWith(entities, 0));
+
+	// Nothing reads the parsed geometry after this, drawing uses the uploaded buffers and draw ranges
+	releaseSceneGeometry(entities, runOptions.keepGeometry);
+	printMemoryStats(stdout);
+
+	if (headless) {
+		// Every permutation is ready before the first frame, so background compiles don't show up in the timings
+		FinishShaderPrewarm(phong_shaders);
+		FinishShaderPrewarm(deferred_shaders);
+		printf("Headless run: %u frames at %dx%d, %d samples, %.4f s timestep\n", runOptions.frames,
+			runOptions.width, runOptions.height, runOptions.samples, runOptions.timestep);
+	}
+
+	unsigned int frame = 0;
+	double lastFrameTime = headless ? 0.0 : glfwGetTime();
+	while (!renderContextShouldClose(renderContext) && (runOptions.frames == 0 || frame < runOptions.frames)) {
+		beginProfilerFrame();
+
+		if (headless)
+			frameDelta = (float)runOptions.timestep;
+		else {
+			double now = glfwGetTime();
+			frameDelta = (float)(now - lastFrameTime);
+			lastFrameTime = now;
+		}
+
+		if (scriptedCamera) {
+			PROFILE_SCOPE("camera path");
+			if (frame > 0)
+				advanceCameraPath(cameraPath, runOptions.cameraSpeed * frameDelta);
+			applyCameraPath(cameraPath, Camera);
+		}
+
 		float near_plane = 1.0f, far_plane = 70.5f;
 		glm::mat4 lightProjection = glm::ortho(-10.0f, 10.0f, -10.0f, 10.0f, near_plane, far_plane);
 		glm::mat4 lightView = glm::lookAt(lightPos, lightPos + lightDirection, glm::vec3(0.0f, 1.0f, 0.0f));
 		glm::mat4 projectedLightSpaceMatrix = lightProjection * lightView;
 
-		generateDepthMap(shadow_program, shadow, projectedLightSpaceMatrix, &models);
-		renderWithShadow(program, shadow, projectedLightSpaceMatrix, &models);
-
-		glfwSwapBuffers(window);
-		glfwPollEvents();
-		processKeyboard(window);
+		setPassMatrices(cameraProjection() * cameraView(), projectedLightSpaceMatrix);
+
+		{
+			PROFILE_SCOPE("scene update");
+			// The shadow and colour passes each turned Sonic by half a degree, 60 degrees a second at 60 fps
+			rotateEntity(entities, sonic, glm::radians(-60.f) * frameDelta, glm::vec3(0.f, 1.f, 0.f));
+			updateWorldTransforms(entities);
+			cullEntities(entities, passMatrices.viewProjection);
+		}
+
+		animationTime += frameDelta;
+		if (bezierGeometry) {
+			PROFILE_SCOPE("bezier animation");
+			swayGrass(grass, animationTime);
+			waveFlag(flag, flagPole, 2.f, animationTime);
+			uploadTessellatedBeziers(grass);
+			uploadTessellatedBeziers(flag);
+		}
+
+		{
+			PROFILE_SCOPE("shadow map");
+			PROFILE_GPU_SCOPE("shadow map");
+			generateDepthMap(shadow_program, shadow_instanced_program, shadow, &entities, &statics, &chairs, &timer);
+		}
+		{
+			PROFILE_SCOPE("scene");
+			PROFILE_GPU_SCOPE("scene");
+			renderWithShadow(&phong_shaders, &deferred_shaders, prepass_program, prepass_instanced_program, shadow, scene, gbuffer,
+				&visibility, oit, &clustered, &grass, &flag, &entities, &statics, &chairs, &culler, &timer);
+		}
+		{
+			PROFILE_SCOPE("present");
+			PROFILE_GPU_SCOPE("present");
+			presentScene(scene, presentFBO);
+		}
+		endPassTimerFrame(timer);
+		endGpuResourceFrame();
+
+		if (headless) {
+			// Nothing to swap, flushing submits the frame the way a swap would
+			PROFILE_SCOPE("flush");
+			glFlush();
+		}
+		else {
+			updateStatsOverlay(window, culler, timer);
+			{
+				PROFILE_SCOPE("swap buffers");
+				glfwSwapBuffers(window);
+			}
+		}
+		recordPresent(frameStats);
+		if (!headless) {
+			{
+				PROFILE_SCOPE("poll events");
+				glfwPollEvents();
+			}
+			{
+				PROFILE_SCOPE("input");
+				processKeyboard(window);
+			}
+			if (runOptions.recordPath != NULL && !scriptedCamera)
+				recordCamera(cameraRecording, Camera, frameDelta);
+		}
+
+		endProfilerFrame();
+		recordFrameStats(frameStats, stdout);
+		frame++;
 	}
 
-	glfwDestroyWindow(window);
-	glfwTerminate();
-
+	printOcclusionStats(culler, stdout);
+	printf("GPU pass times:\n");
+	printPassTimes(timer, stdout);
+	printMemoryStats(stdout);
+
+	FinishShaderPrewarm(phong_shaders);
+	FinishShaderPrewarm(deferred_shaders);
+	printProgramCacheStats(stdout);
+	printf("Shader compiles on the main thread: %u, %.1f ms total\n",
+		phong_shaders.mainThreadCompiles + deferred_shaders.mainThreadCompiles,
+		phong_shaders.mainThreadCompileMs + deferred_shaders.mainThreadCompileMs);
+	printf("Shader binary loads on the main thread: %u, %.1f ms total\n",
+		phong_shaders.mainThreadBinaryLoads + deferred_shaders.mainThreadBinaryLoads,
+		phong_shaders.mainThreadBinaryLoadMs + deferred_shaders.mainThreadBinaryLoadMs);
+
+	finishProfiler();
+	printProfilerSummary(stdout);
+	exportChromeTrace("profile_trace.json");
+	exportFrameCsv("profile_frames.csv");
+	dumpFrameStats(frameStats, "frame_stats.txt");
+	if (runOptions.recordPath != NULL)
+		save_camera_path(cameraRecording, runOptions.recordPath);
+
+	// Lets a scripted headless run fail on a memory regression, even one that was freed again before the end
+	if (memoryTracker.gpuOverBudget || memoryTracker.cpuOverBudget) {
+		fprintf(stderr, "Memory budget exceeded during the run\n");
+		return headless ? 1 : 0;
+	}
 	return 0;
 }
\ No newline at end of file
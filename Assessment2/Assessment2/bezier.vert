@@ -0,0 +1,11 @@
+#version 450 core
+
+// Control points in world space, the tessellation stages evaluate the curves and patches
+layout(location = 0) in vec3 vPos;
+
+out vec3 controlPos;
+
+void main()
+{
+	controlPos = vPos;
+}
@@ -0,0 +1,13 @@
+#version 450 core
+
+layout (location = 0) out vec4 fColour;
+
+in float along;
+
+uniform vec3 rootColour;
+uniform vec3 tipColour;
+
+void main()
+{
+	fColour = vec4(mix(rootColour, tipColour, along), 1.f);
+}
@@ -0,0 +1,18 @@
+#version 450 core
+
+layout (location = 0) out vec4 fColour;
+
+in vec3 FragPosWorldSpace;
+in vec3 nor;
+
+uniform vec3 lightDirection;
+uniform vec3 lightColour;
+uniform vec3 patchColour;
+
+void main()
+{
+	// Patches are seen from both sides
+	vec3 n = normalize(gl_FrontFacing ? nor : -nor);
+	float diffuse = max(dot(n, normalize(-lightDirection)), 0.f);
+	fColour = vec4(patchColour * lightColour * (.2f + .8f * diffuse), 1.f);
+}
@@ -0,0 +1,21 @@
+#version 450 core
+
+layout (location = 0) out vec4 fColour;
+
+uniform sampler2DMS accumTexture;
+uniform sampler2DMS revealTexture;
+
+void main() {
+	// Reading gl_SampleID runs this per sample, keeping the MSAA edges of transparent parts
+	ivec2 coord = ivec2(gl_FragCoord.xy);
+	float reveal = texelFetch(revealTexture, coord, gl_SampleID).r;
+
+	// Nothing transparent covers this sample
+	if (reveal >= 1.f)
+		discard;
+
+	vec4 accum = texelFetch(accumTexture, coord, gl_SampleID);
+	vec3 average = accum.rgb / max(accum.a, 1e-5);
+
+	fColour = vec4(average, 1.f - reveal);
+}
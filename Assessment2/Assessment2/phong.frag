@@ -1,12 +1,40 @@
 #version 450 core
 
+#ifdef GBUFFER
+// Deferred geometry pass, see gbuffer.h for the formats
+layout (location = 0) out vec4 gAlbedoAlpha;
+layout (location = 1) out vec2 gNormal;
+layout (location = 2) out float gMaterial;
+#else
 layout (location = 0) out vec4 fColour;
+// Only written into the weighted blended OIT targets
+layout (location = 1) out float fReveal;
+#endif
 
+#ifdef DEFERRED_LIGHTING
+// Read back from the G-buffer at the start of main, so the lighting functions below are shared with forward
+vec4 col;
+vec3 nor;
+vec3 FragPosWorldSpace;
+vec2 tex;
+vec4 FragPosProjectedLightSpace;
+
+uniform sampler2DMS albedoAlphaTexture;
+uniform sampler2DMS normalTexture;
+uniform sampler2DMS materialTexture;
+uniform sampler2DMS depthTexture;
+uniform mat4 inverseViewProjection;
+uniform mat4 lightSpace;
+#else
 in vec4 col;
 in vec3 nor;
 in vec3 FragPosWorldSpace;
 in vec2 tex;
 in vec4 FragPosProjectedLightSpace;
+#endif
+
+// Specular exponent, stored per pixel in the G-buffer
+float shininess = 128.f;
 
 uniform sampler2D shadowMap;
 
@@ -17,6 +45,9 @@ uniform vec3 camPos;
 uniform sampler2D Texture;
 
 float shadowOnFragment(vec4 FragPosProjectedLightSpace) {
+#ifdef SHADOW_NONE
+	return 0.f;
+#else
 	vec3 ndc = FragPosProjectedLightSpace.xyz / FragPosProjectedLightSpace.w;
 	vec3 ss = (ndc + 1) * 0.5;
 
@@ -28,6 +59,10 @@ float shadowOnFragment(vec4 FragPosProjectedLightSpace) {
 	vec3 Ntolight = normalize(-lightDirection);
 	float bias = max(0.0005 * (1.0 - dot(Nnor, Ntolight)), 0.00005);
 
+#ifdef SHADOW_HARD
+	float litDepth = texture(shadowMap, ss.xy).r;
+	return (fragDepth - bias) > litDepth ? 1.0 : 0.0;
+#else
     float currentDepth = ss.z;
     float shadow = 0.0;
     vec2 texelSize = 1.0 / textureSize(shadowMap, 0);
@@ -40,8 +75,11 @@ float shadowOnFragment(vec4 FragPosProjectedLightSpace) {
     shadow /= 9.0;
 
 	return shadow;
+#endif
+#endif
 }
 
+#if !defined(LIGHT_POSITIONAL) && !defined(LIGHT_SPOT)
 float CalculateDirectionalIllumination() {
 	// ambient
 	float ambient = 0.1f;
@@ -57,7 +95,7 @@ float CalculateDirectionalIllumination() {
 	vec3 camDirection = camPos - FragPosWorldSpace;
 	vec3 NcamDirection = normalize(camDirection);
 	float brightness = max(dot(NcamDirection, NrefLight), 0.f);
-	float specular = pow(brightness, 128);
+	float specular = pow(brightness, shininess);
 
 	// combined calculation
 	float shadow = shadowOnFragment(FragPosProjectedLightSpace);
@@ -65,7 +103,9 @@ float CalculateDirectionalIllumination() {
 
 	return phong;
 }
+#endif
 
+#ifdef LIGHT_POSITIONAL
 float CalculatePositionalIllumination() {
 	// ambient
 	float ambient = 0.1f;
@@ -80,7 +120,7 @@ float CalculatePositionalIllumination() {
 	vec3 NrefLight = reflect(Nfrom_light, Nnor);
 	vec3 camDirection = camPos - FragPosWorldSpace;
 	vec3 NcamDirection = normalize(camDirection);
-	float specular = pow(max(dot(NcamDirection, NrefLight), 0.f), 128);
+	float specular = pow(max(dot(NcamDirection, NrefLight), 0.f), shininess);
 
 	// attenuation calculation
 	float d = length(FragPosWorldSpace) - length(lightPos);
@@ -91,7 +131,9 @@ float CalculatePositionalIllumination() {
 
 
 }
+#endif
 
+#ifdef LIGHT_SPOT
 float CalculateSpotIllumination() {
 	// ambient
 	float ambient = 0.1f;
@@ -106,7 +148,7 @@ float CalculateSpotIllumination() {
 	vec3 NrefLight = reflect(Nfrom_light, Nnor);
 	vec3 camDirection = camPos - FragPosWorldSpace;
 	vec3 NcamDirection = normalize(camDirection);
-	float specular = pow(max(dot(NcamDirection, NrefLight), 0.f), 128);
+	float specular = pow(max(dot(NcamDirection, NrefLight), 0.f), shininess);
 
 	// attenuation calculation
 	float d = length(FragPosWorldSpace) - length(lightPos);
@@ -122,17 +164,199 @@ float CalculateSpotIllumination() {
 	if(theta > phi)
 		return (ambient + diffuse + specular) * attenuation;
 	else
-		ambient * attenuation;
+		return ambient * attenuation;
 }
+#endif
 
-void main()
+#ifdef CLUSTERED_LIGHTS
+// Many small point and spot lights, binned per cluster by cluster.comp
+struct ClusterLight {
+	vec4 positionRadius;
+	vec4 colour;
+	vec4 spotDirectionCutoff;
+};
+
+layout (std430, binding = 3) readonly buffer Lights { ClusterLight lights[]; };
+layout (std430, binding = 4) readonly buffer ClusterCounts { uint clusterCounts[]; };
+layout (std430, binding = 5) readonly buffer ClusterIndices { uint clusterIndices[]; };
+
+uniform mat4 view;
+uniform uvec3 clusterGrid;
+uniform float clusterNear;
+uniform float clusterFar;
+uniform uint maxLightsPerCluster;
+uniform vec2 screenSize;
+
+vec3 CalculateClusteredIllumination() {
+	// Find this fragment's cluster from its screen tile and depth slice
+	float viewDepth = -(view * vec4(FragPosWorldSpace, 1.f)).z;
+	uint slice = uint(max(log(viewDepth / clusterNear) / log(clusterFar / clusterNear) * clusterGrid.z, 0.f));
+	uvec2 tile = uvec2(gl_FragCoord.xy / screenSize * vec2(clusterGrid.xy));
+	uvec3 id = min(uvec3(tile, slice), clusterGrid - 1);
+	uint cluster = id.x + clusterGrid.x * (id.y + clusterGrid.y * id.z);
+
+	vec3 Nnor = normalize(nor);
+	vec3 NcamDirection = normalize(camPos - FragPosWorldSpace);
+
+	vec3 result = vec3(0.f);
+	uint count = clusterCounts[cluster];
+	for(uint i = 0; i < count; i++) {
+		ClusterLight light = lights[clusterIndices[cluster * maxLightsPerCluster + i]];
+
+		vec3 to_light = light.positionRadius.xyz - FragPosWorldSpace;
+		float d = length(to_light);
+		float radius = light.positionRadius.w;
+		if(d >= radius)
+			continue;
+
+		vec3 Nto_light = to_light / d;
+
+		// spot cone, point lights have a cutoff below -1
+		if(dot(-Nto_light, light.spotDirectionCutoff.xyz) < light.spotDirectionCutoff.w)
+			continue;
+
+		float diffuse = max(dot(Nnor, Nto_light), 0.f);
+		float specular = pow(max(dot(NcamDirection, reflect(-Nto_light, Nnor)), 0.f), shininess);
+
+		// windowed so the light reaches exactly zero at its radius
+		float window = clamp(1.f - pow(d / radius, 4), 0.f, 1.f);
+		float attenuation = window * window / (1.f + d * d);
+
+		result += light.colour.rgb * (diffuse + specular) * attenuation;
+	}
+
+	return result;
+}
+#endif
+
+// Octahedral mapping of a unit normal onto [-1, 1]^2
+vec2 octWrap(vec2 v) {
+	return (1.f - abs(v.yx)) * vec2(v.x >= 0.f ? 1.f : -1.f, v.y >= 0.f ? 1.f : -1.f);
+}
+
+vec2 octEncode(vec3 n) {
+	n /= abs(n.x) + abs(n.y) + abs(n.z);
+	return n.z >= 0.f ? n.xy : octWrap(n.xy);
+}
+
+vec3 octDecode(vec2 e) {
+	vec3 n = vec3(e, 1.f - abs(e.x) - abs(e.y));
+	if(n.z < 0.f)
+		n.xy = octWrap(n.xy);
+	return normalize(n);
+}
+
+#ifndef GBUFFER
+// Lit colour of the fragment the globals describe, before any OIT weighting
+vec4 shadeFragment()
 {
-	// Directional Illumination
+	// Light model is picked by the permutation's defines
+#if defined(LIGHT_POSITIONAL)
+	float phong = CalculatePositionalIllumination();
+#elif defined(LIGHT_SPOT)
+	float phong = CalculateSpotIllumination();
+#else
 	float phong = CalculateDirectionalIllumination();
-//	float phong = CalculatePositionalIllumination();
-//	float phong = CalculateSpotIllumination();
-	
+#endif
+
+#ifdef TEXTURED
 	vec4 texColour = texture(Texture, tex);
+#else
+	vec4 texColour = vec4(1.f);
+#endif
+
+#ifdef CLUSTERED_LIGHTS
+	vec3 lighting = phong * lightColour + CalculateClusteredIllumination();
+#else
+	vec3 lighting = phong * lightColour;
+#endif
+
+	return vec4(col.rgb * texColour.rgb * lighting, texColour.a * col.a);
+}
+#endif
+
+#ifdef DEFERRED_LIGHTING
+// Fills the globals from one sample of the G-buffer, false where that sample is background
+bool loadGBufferSample(ivec2 coord, int s)
+{
+	float depth = texelFetch(depthTexture, coord, s).r;
+	if(depth >= 1.f)
+		return false;
+
+	vec2 ndc = gl_FragCoord.xy / vec2(textureSize(depthTexture)) * 2.f - 1.f;
+	vec4 world = inverseViewProjection * vec4(ndc, depth * 2.f - 1.f, 1.f);
+	FragPosWorldSpace = world.xyz / world.w;
+	FragPosProjectedLightSpace = lightSpace * vec4(FragPosWorldSpace, 1.f);
+
+	col = texelFetch(albedoAlphaTexture, coord, s);
+	nor = octDecode(texelFetch(normalTexture, coord, s).xy);
+	shininess = texelFetch(materialTexture, coord, s).r * 255.f;
+	return true;
+}
+
+// A triangle writes the same G-buffer values to every sample it covers, so any difference marks a geometry edge
+bool isEdgePixel(ivec2 coord, int samples)
+{
+	bool background = texelFetch(depthTexture, coord, 0).r >= 1.f;
+	vec4 albedo = texelFetch(albedoAlphaTexture, coord, 0);
+	vec2 normal = texelFetch(normalTexture, coord, 0).xy;
+	for(int s = 1; s < samples; s++) {
+		if((texelFetch(depthTexture, coord, s).r >= 1.f) != background ||
+			texelFetch(albedoAlphaTexture, coord, s) != albedo || texelFetch(normalTexture, coord, s).xy != normal)
+			return true;
+	}
+	return false;
+}
+#endif
+
+void main()
+{
+#ifdef DEFERRED_LIGHTING
+	// Interior pixels are shaded once, edge pixels once per covered sample so they keep their anti-aliasing
+	// Alpha is the covered fraction, blended over the background the scene was cleared to
+	ivec2 coord = ivec2(gl_FragCoord.xy);
+	int samples = textureSamples(depthTexture);
+	if(!isEdgePixel(coord, samples)) {
+		if(!loadGBufferSample(coord, 0))
+			discard;
+		fColour = vec4(shadeFragment().rgb, 1.f);
+		return;
+	}
+
+	vec3 sum = vec3(0.f);
+	int covered = 0;
+	for(int s = 0; s < samples; s++) {
+		if(loadGBufferSample(coord, s)) {
+			sum += shadeFragment().rgb;
+			covered++;
+		}
+	}
+	if(covered == 0)
+		discard;
+	fColour = vec4(sum / float(covered), float(covered) / float(samples));
+#else
+#ifdef GBUFFER
+#ifdef TEXTURED
+	vec4 texColour = texture(Texture, tex);
+#else
+	vec4 texColour = vec4(1.f);
+#endif
+
+	gAlbedoAlpha = vec4(col.rgb * texColour.rgb, texColour.a * col.a);
+	gNormal = octEncode(normalize(nor));
+	gMaterial = shininess / 255.f;
+#else
+	vec4 colour = shadeFragment();
 
-	fColour = vec4(col.rgb * texColour.rgb * phong * lightColour, texColour.a * col.a);
+#ifdef WEIGHTED_OIT
+	// Weighted blended OIT, nearer and more opaque fragments weigh more
+	float a = colour.a;
+	float weight = clamp(pow(min(1.f, a * 10.f) + 0.01f, 3.f) * 1e8 * pow(1.f - gl_FragCoord.z * 0.9f, 3.f), 1e-2, 3e3);
+	fColour = vec4(colour.rgb * a, a) * weight;
+	fReveal = a;
+#else
+	fColour = colour;
+#endif
+#endif
+#endif
 }
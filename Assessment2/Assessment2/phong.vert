@@ -4,11 +4,29 @@ layout(location = 0) in vec4 vPos;
 layout(location = 1) in vec4 vCol;
 layout(location = 2) in vec3 vNor;
 layout(location = 3) in vec2 vTex;
+// Rigid transform of a repeated part within its model, identity for everything else
+layout(location = 4) in mat4 vPart;
 
+#ifdef INSTANCED
+// Per-instance transforms, must match InstanceData in instancing.h
+struct Instance {
+	mat4 model;
+	mat4 normalMatrix;
+	vec4 tint;
+};
+layout (std430, binding = 9) readonly buffer Instances { Instance instances[]; };
+// Repeated parts multiply the instance count, each part transform spans objectCount instances
+uniform int objectCount;
+
+uniform mat4 viewProjection;
+uniform mat4 lightSpace;
+#else
+// Per-draw matrices, premultiplied on the CPU
 uniform mat4 model;
-uniform mat4 view;
-uniform mat4 projection;
-uniform mat4 projectedLightSpaceMatrix;
+uniform mat3 normalMatrix;
+uniform mat4 mvp;
+uniform mat4 lightMvp;
+#endif
 
 out vec4 col;
 out vec3 nor;
@@ -16,12 +34,26 @@ out vec3 FragPosWorldSpace;
 out vec2 tex;
 out vec4 FragPosProjectedLightSpace;
 
+// Must match prepass.vert exactly for the GL_EQUAL depth test
+invariant gl_Position;
+
 void main()
 {
-	gl_Position = projection * view * model * vPos;
+#ifdef INSTANCED
+	Instance instance = instances[gl_InstanceID % objectCount];
+	vec4 worldPos = instance.model * (vPart * vPos);
+	gl_Position = viewProjection * worldPos;
+	col = vCol * instance.tint;
+	nor = mat3(instance.normalMatrix) * (mat3(vPart) * vNor);
+	FragPosWorldSpace = vec3(worldPos);
+	FragPosProjectedLightSpace = lightSpace * worldPos;
+#else
+	vec4 localPos = vPart * vPos;
+	gl_Position = mvp * localPos;
 	col = vCol;
-	nor = mat3(transpose(inverse(model))) * vNor;
-	FragPosWorldSpace = vec3(model * vPos);
-	FragPosProjectedLightSpace = projectedLightSpaceMatrix * model * vPos;
+	nor = normalMatrix * (mat3(vPart) * vNor);
+	FragPosWorldSpace = vec3(model * localPos);
+	FragPosProjectedLightSpace = lightMvp * localPos;
+#endif
 	tex = vTex;
 }
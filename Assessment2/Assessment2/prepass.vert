@@ -0,0 +1,37 @@
+#version 450 core
+
+layout (location = 0) in vec4 vPos;
+// Rigid transform of a repeated part within its model, identity for everything else
+layout (location = 4) in mat4 vPart;
+
+#ifdef INSTANCED
+// Only the model matrix is read, the layout must match InstanceData in instancing.h
+struct Instance {
+	mat4 model;
+	mat4 normalMatrix;
+	vec4 tint;
+};
+layout (std430, binding = 9) readonly buffer Instances { Instance instances[]; };
+// Repeated parts multiply the instance count, each part transform spans objectCount instances
+uniform int objectCount;
+
+uniform mat4 viewProjection;
+#else
+uniform mat4 mvp;
+#endif
+
+// Must match phong.vert exactly, the colour pass tests depth with GL_EQUAL
+invariant gl_Position;
+
+// Which repeated part this is, visibility buffer IDs count triangles across parts
+flat out uint partInstance;
+
+void main() {
+#ifdef INSTANCED
+	gl_Position = viewProjection * (instances[gl_InstanceID % objectCount].model * (vPart * vPos));
+	partInstance = uint(gl_InstanceID / objectCount);
+#else
+	gl_Position = mvp * (vPart * vPos);
+	partInstance = uint(gl_InstanceID);
+#endif
+}
@@ -1,10 +1,29 @@
 #version 450 core
 
 layout (location = 0) in vec4 vPos;
+// Rigid transform of a repeated part within its model, identity for everything else
+layout (location = 4) in mat4 vPart;
 
-uniform mat4 projectedLightSpaceMatrix;
-uniform mat4 model;
+#ifdef INSTANCED
+// Only the model matrix is read, the layout must match InstanceData in instancing.h
+struct Instance {
+	mat4 model;
+	mat4 normalMatrix;
+	vec4 tint;
+};
+layout (std430, binding = 9) readonly buffer Instances { Instance instances[]; };
+// Repeated parts multiply the instance count, each part transform spans objectCount instances
+uniform int objectCount;
+
+uniform mat4 lightSpace;
+#else
+uniform mat4 lightMvp;
+#endif
 
 void main() {
-	gl_Position = projectedLightSpaceMatrix * model * vPos;
-}
\ No newline at end of file
+#ifdef INSTANCED
+	gl_Position = lightSpace * (instances[gl_InstanceID % objectCount].model * (vPart * vPos));
+#else
+	gl_Position = lightMvp * (vPart * vPos);
+#endif
+}
@@ -0,0 +1,15 @@
+#version 450 core
+
+layout (location = 0) out uint fVisibility;
+
+uniform uint drawID;
+// Repeated parts of a model are separate instanced ranges, see model::drawDepth
+uniform uint firstPrimitive;
+uniform uint partTriangles;
+flat in uint partInstance;
+
+void main()
+{
+	// gl_PrimitiveID counts triangles within one instance of the range, the offsets make it the model's visibility triangle order
+	fVisibility = (drawID << 23u) | (firstPrimitive + partInstance * partTriangles + uint(gl_PrimitiveID));
+}
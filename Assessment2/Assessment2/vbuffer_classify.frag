@@ -0,0 +1,26 @@
+#version 450 core
+
+struct VisibilityDraw {
+	mat4 model;
+	mat4 normalMatrix;
+	uint firstTriangle;
+};
+
+layout (std430, binding = 7) readonly buffer Triangles { uvec2 triangles[]; };
+layout (std430, binding = 8) readonly buffer Draws { VisibilityDraw draws[]; };
+
+uniform usampler2DMS visibilityTexture;
+
+void main()
+{
+	uint id = texelFetch(visibilityTexture, ivec2(gl_FragCoord.xy), 0).r;
+	if(id == 0xFFFFFFFFu)
+		discard;
+
+	uint draw = id >> 23u;
+	uint triangle = id & 0x7FFFFFu;
+	uint material = triangles[draws[draw].firstTriangle + triangle].y;
+
+	// Exactly the depth vbuffer_material.vert places this material's resolve at
+	gl_FragDepth = float(material + 1u) / 1024.f;
+}
@@ -0,0 +1,10 @@
+#version 450 core
+
+uniform uint materialIndex;
+
+// Full screen triangle at the depth vbuffer_classify.frag wrote for this material
+void main() {
+	vec2 pos = vec2((gl_VertexID << 1) & 2, gl_VertexID & 2);
+	float depth = float(materialIndex + 1u) / 1024.f;
+	gl_Position = vec4(pos * 2.f - 1.f, depth * 2.f - 1.f, 1.f);
+}
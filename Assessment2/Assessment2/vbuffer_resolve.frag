@@ -0,0 +1,102 @@
+#version 450 core
+
+// Same targets as the GBUFFER variant of phong.frag
+layout (location = 0) out vec4 gAlbedoAlpha;
+layout (location = 1) out vec2 gNormal;
+layout (location = 2) out float gMaterial;
+
+struct VisibilityDraw {
+	mat4 model;
+	mat4 normalMatrix;
+	uint firstTriangle;
+};
+
+// Interleaved vertex layout of obj_parser.h, 12 floats each
+layout (std430, binding = 6) readonly buffer Vertices { float vertexData[]; };
+layout (std430, binding = 7) readonly buffer Triangles { uvec2 triangles[]; };
+layout (std430, binding = 8) readonly buffer Draws { VisibilityDraw draws[]; };
+
+uniform usampler2DMS visibilityTexture;
+uniform sampler2D Texture;
+uniform mat4 viewProjection;
+
+vec3 pullPosition(uint v) {
+	return vec3(vertexData[v * 12u + 0u], vertexData[v * 12u + 1u], vertexData[v * 12u + 2u]);
+}
+
+vec4 pullColour(uint v) {
+	return vec4(vertexData[v * 12u + 3u], vertexData[v * 12u + 4u], vertexData[v * 12u + 5u], vertexData[v * 12u + 6u]);
+}
+
+vec3 pullNormal(uint v) {
+	return vec3(vertexData[v * 12u + 7u], vertexData[v * 12u + 8u], vertexData[v * 12u + 9u]);
+}
+
+vec2 pullTexCoord(uint v) {
+	return vec2(vertexData[v * 12u + 10u], vertexData[v * 12u + 11u]);
+}
+
+float cross2(vec2 a, vec2 b) {
+	return a.x * b.y - a.y * b.x;
+}
+
+// Perspective correct barycentrics of an NDC point inside the projected triangle
+vec3 barycentrics(vec4 clip0, vec4 clip1, vec4 clip2, vec2 p) {
+	vec3 invW = 1.f / vec3(clip0.w, clip1.w, clip2.w);
+	vec2 s0 = clip0.xy * invW.x;
+	vec2 s1 = clip1.xy * invW.y;
+	vec2 s2 = clip2.xy * invW.z;
+
+	float area = cross2(s1 - s0, s2 - s0);
+	vec3 screen = vec3(cross2(s1 - p, s2 - p), cross2(s2 - p, s0 - p), cross2(s0 - p, s1 - p)) / area;
+
+	vec3 perspective = screen * invW;
+	return perspective / (perspective.x + perspective.y + perspective.z);
+}
+
+// Specular exponent, the same constant the forward path uses
+float shininess = 128.f;
+
+vec2 octWrap(vec2 v) {
+	return (1.f - abs(v.yx)) * vec2(v.x >= 0.f ? 1.f : -1.f, v.y >= 0.f ? 1.f : -1.f);
+}
+
+vec2 octEncode(vec3 n) {
+	n /= abs(n.x) + abs(n.y) + abs(n.z);
+	return n.z >= 0.f ? n.xy : octWrap(n.xy);
+}
+
+void main()
+{
+	uint id = texelFetch(visibilityTexture, ivec2(gl_FragCoord.xy), 0).r;
+	VisibilityDraw draw = draws[id >> 23u];
+	uint first = triangles[draw.firstTriangle + (id & 0x7FFFFFu)].x;
+
+	mat4 mvp = viewProjection * draw.model;
+	vec4 clip0 = mvp * vec4(pullPosition(first), 1.f);
+	vec4 clip1 = mvp * vec4(pullPosition(first + 1u), 1.f);
+	vec4 clip2 = mvp * vec4(pullPosition(first + 2u), 1.f);
+
+	// This pixel and its right and upper neighbours, the differences give texture gradients
+	vec2 pixel = 2.f / vec2(textureSize(visibilityTexture));
+	vec2 ndc = gl_FragCoord.xy * pixel - 1.f;
+	vec3 b = barycentrics(clip0, clip1, clip2, ndc);
+	vec3 bx = barycentrics(clip0, clip1, clip2, ndc + vec2(pixel.x, 0.f));
+	vec3 by = barycentrics(clip0, clip1, clip2, ndc + vec2(0.f, pixel.y));
+
+	vec2 t0 = pullTexCoord(first);
+	vec2 t1 = pullTexCoord(first + 1u);
+	vec2 t2 = pullTexCoord(first + 2u);
+	vec2 tex = b.x * t0 + b.y * t1 + b.z * t2;
+	vec2 texDx = bx.x * t0 + bx.y * t1 + bx.z * t2 - tex;
+	vec2 texDy = by.x * t0 + by.y * t1 + by.z * t2 - tex;
+
+	vec4 col = b.x * pullColour(first) + b.y * pullColour(first + 1u) + b.z * pullColour(first + 2u);
+	vec3 nor = mat3(draw.normalMatrix) * (b.x * pullNormal(first) + b.y * pullNormal(first + 1u) + b.z * pullNormal(first + 2u));
+
+	vec4 texColour = textureGrad(Texture, tex, texDx, texDy);
+
+	gAlbedoAlpha = vec4(col.rgb * texColour.rgb, texColour.a * col.a);
+	gNormal = octEncode(normalize(nor));
+	gMaterial = shininess / 255.f;
+}
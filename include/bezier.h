@@ -0,0 +1,367 @@
+#pragma once
+
+#include <GL/gl3w.h>
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <stddef.h>
+#include <stdio.h>
+#include <thread>
+#include <vector>
+
+// Four samples at a time on any x64 target, scalar elsewhere
+#if defined(_M_X64) || defined(__SSE2__)
+#include <emmintrin.h>
+#define BEZIER_SSE 1
+#endif
+
+// Highest degree the batch functions take, their scratch buffer lives on the stack
+#define BEZIER_MAX_DEGREE 31
+
+// Floats per vertex written for drawing, position then colour like MakeFloatsFromVector
+#define BEZIER_VERTEX_FLOATS 6
+
+constexpr int binomial(int n, int k) {
+	return (k == 0 || k == n) ? 1 : binomial(n - 1, k - 1) + binomial(n - 1, k);
+}
+
+// Bernstein form for a fixed degree, the loops unroll and the coefficients are constants
+template <int Degree>
+glm::vec3 bezierPoint(const glm::vec3* controls, float t) {
+	float tPow[Degree + 1];
+	float sPow[Degree + 1];
+	tPow[0] = 1.f;
+	sPow[0] = 1.f;
+	for (int i = 1; i <= Degree; i++) {
+		tPow[i] = tPow[i - 1] * t;
+		sPow[i] = sPow[i - 1] * (1.f - t);
+	}
+
+	glm::vec3 result(0.f);
+	for (int i = 0; i <= Degree; i++)
+		result += ((float)binomial(Degree, i) * tPow[i] * sPow[Degree - i]) * controls[i];
+	return result;
+}
+
+template <>
+inline glm::vec3 bezierPoint<3>(const glm::vec3* controls, float t) {
+	float s = 1.f - t;
+	float b0 = s * s * s;
+	float b1 = 3.f * s * s * t;
+	float b2 = 3.f * s * t * t;
+	float b3 = t * t * t;
+	return b0 * controls[0] + b1 * controls[1] + b2 * controls[2] + b3 * controls[3];
+}
+
+// Any degree, de Casteljau in place on a copy in scratch, which needs count entries
+glm::vec3 bezierPoint(const glm::vec3* controls, int count, float t, glm::vec3* scratch) {
+	switch (count) {
+	case 1: return controls[0];
+	case 2: return bezierPoint<1>(controls, t);
+	case 3: return bezierPoint<2>(controls, t);
+	case 4: return bezierPoint<3>(controls, t);
+	}
+
+	for (int i = 0; i < count; i++)
+		scratch[i] = controls[i];
+	for (int level = count - 1; level > 0; level--) {
+		for (int i = 0; i < level; i++)
+			scratch[i] = (1.f - t) * scratch[i] + t * scratch[i + 1];
+	}
+	return scratch[0];
+}
+
+bool bezierDegreeSupported(int count) {
+	if (count >= 1 && count <= BEZIER_MAX_DEGREE + 1)
+		return true;
+	fprintf(stderr, "Bezier curves need 1 to %d control points, got %d\n", BEZIER_MAX_DEGREE + 1, count);
+	return false;
+}
+
+#ifdef BEZIER_SSE
+// Cubic at four parameters, positions stored stride floats apart
+void bezierCubic4(const glm::vec3* controls, __m128 t, float* out, size_t stride) {
+	const __m128 one = _mm_set1_ps(1.f);
+	const __m128 three = _mm_set1_ps(3.f);
+	__m128 s = _mm_sub_ps(one, t);
+	__m128 ss = _mm_mul_ps(s, s);
+	__m128 tt = _mm_mul_ps(t, t);
+	__m128 b0 = _mm_mul_ps(ss, s);
+	__m128 b1 = _mm_mul_ps(_mm_mul_ps(three, ss), t);
+	__m128 b2 = _mm_mul_ps(_mm_mul_ps(three, s), tt);
+	__m128 b3 = _mm_mul_ps(tt, t);
+
+	float components[3][4];
+	for (int c = 0; c < 3; c++) {
+		__m128 v = _mm_mul_ps(b0, _mm_set1_ps(controls[0][c]));
+		v = _mm_add_ps(v, _mm_mul_ps(b1, _mm_set1_ps(controls[1][c])));
+		v = _mm_add_ps(v, _mm_mul_ps(b2, _mm_set1_ps(controls[2][c])));
+		v = _mm_add_ps(v, _mm_mul_ps(b3, _mm_set1_ps(controls[3][c])));
+		_mm_storeu_ps(components[c], v);
+	}
+
+	for (int i = 0; i < 4; i++) {
+		out[i * stride] = components[0][i];
+		out[i * stride + 1] = components[1][i];
+		out[i * stride + 2] = components[2][i];
+	}
+}
+#endif
+
+// Evaluates every parameter in ts, point i is written to out + i * stride, no allocation
+void evaluateBezierBatch(const glm::vec3* controls, int count, const float* ts, size_t n, float* out, size_t stride) {
+	if (!bezierDegreeSupported(count))
+		return;
+
+	size_t i = 0;
+#ifdef BEZIER_SSE
+	if (count == 4) {
+		for (; i + 4 <= n; i += 4)
+			bezierCubic4(controls, _mm_loadu_ps(ts + i), out + i * stride, stride);
+	}
+#endif
+
+	glm::vec3 scratch[BEZIER_MAX_DEGREE + 1];
+	for (; i < n; i++) {
+		glm::vec3 p = bezierPoint(controls, count, ts[i], scratch);
+		out[i * stride] = p.x;
+		out[i * stride + 1] = p.y;
+		out[i * stride + 2] = p.z;
+	}
+}
+
+// samples + 1 evenly spaced points from t = 0 to 1, the same points as EvaluateBezierCurve
+// Cubics step with forward differences, three additions per point, accumulated in double so long curves don't drift
+void evaluateBezierUniform(const glm::vec3* controls, int count, int samples, float* out, size_t stride) {
+	if (!bezierDegreeSupported(count) || samples < 1)
+		return;
+
+	if (count == 4) {
+		double h = 1.0 / samples;
+		glm::dvec3 p0(controls[0]), p1(controls[1]), p2(controls[2]), p3(controls[3]);
+		glm::dvec3 a = -p0 + 3.0 * p1 - 3.0 * p2 + p3;
+		glm::dvec3 b = 3.0 * p0 - 6.0 * p1 + 3.0 * p2;
+		glm::dvec3 c = -3.0 * p0 + 3.0 * p1;
+
+		glm::dvec3 p = p0;
+		glm::dvec3 d1 = a * (h * h * h) + b * (h * h) + c * h;
+		glm::dvec3 d2 = 6.0 * a * (h * h * h) + 2.0 * b * (h * h);
+		glm::dvec3 d3 = 6.0 * a * (h * h * h);
+		for (int i = 0; i <= samples; i++) {
+			out[i * stride] = (float)p.x;
+			out[i * stride + 1] = (float)p.y;
+			out[i * stride + 2] = (float)p.z;
+			p += d1;
+			d1 += d2;
+			d2 += d3;
+		}
+		return;
+	}
+
+	glm::vec3 scratch[BEZIER_MAX_DEGREE + 1];
+	for (int i = 0; i <= samples; i++) {
+		glm::vec3 p = bezierPoint(controls, count, (float)i / samples, scratch);
+		out[i * stride] = p.x;
+		out[i * stride + 1] = p.y;
+		out[i * stride + 2] = p.z;
+	}
+}
+
+size_t bezierVertexFloats(int samples) {
+	return (size_t)(samples + 1) * BEZIER_VERTEX_FLOATS;
+}
+
+// Position and colour per point into a caller owned buffer of bezierVertexFloats(samples) floats
+void writeBezierVertices(const glm::vec3* controls, int count, int samples, glm::vec3 colour, float* out) {
+	evaluateBezierUniform(controls, count, samples, out, BEZIER_VERTEX_FLOATS);
+	for (int i = 0; i <= samples; i++) {
+		out[i * BEZIER_VERTEX_FLOATS + 3] = colour.r;
+		out[i * BEZIER_VERTEX_FLOATS + 4] = colour.g;
+		out[i * BEZIER_VERTEX_FLOATS + 5] = colour.b;
+	}
+}
+
+// Writes straight into a vertex buffer with at least bezierVertexFloats(samples) floats of storage, returns the vertex count
+int uploadBezierVertices(unsigned int buffer, const glm::vec3* controls, int count, int samples, glm::vec3 colour) {
+	GLsizeiptr size = bezierVertexFloats(samples) * sizeof(float);
+	float* mapped = (float*)glMapNamedBufferRange(buffer, 0, size, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT);
+	if (mapped == NULL)
+		return 0;
+
+	writeBezierVertices(controls, count, samples, colour, mapped);
+	glUnmapNamedBuffer(buffer);
+	return samples + 1;
+}
+
+// Subdivision stops at this depth whatever the tolerance, at most 2^16 pieces per curve
+#define BEZIER_MAX_SUBDIVISIONS 16
+
+// A curve's control points in a shared array, for batches
+struct BezierCurveRange {
+	unsigned int first;
+	unsigned int count;
+};
+
+// How flat a piece must be before it becomes one line, in world units or in pixels once projected
+struct BezierTolerance {
+	float world = 0.01f;
+	bool screenSpace = false;
+	glm::mat4 viewProjection = glm::mat4(1.f);
+	glm::vec2 viewport = glm::vec2(1920.f, 1080.f);
+	float pixels = 0.5f;
+};
+
+// Polylines of a batch back to back, first and count per curve as glMultiDrawArrays takes them
+struct BezierPolylines {
+	std::vector<glm::vec3> points;
+	std::vector<GLint> first;
+	std::vector<GLsizei> count;
+};
+
+// De Casteljau split at t, left and right each get count control points and may alias controls
+void splitBezier(const glm::vec3* controls, int count, float t, glm::vec3* left, glm::vec3* right) {
+	if (count == 4) {
+		glm::vec3 p01 = glm::mix(controls[0], controls[1], t);
+		glm::vec3 p12 = glm::mix(controls[1], controls[2], t);
+		glm::vec3 p23 = glm::mix(controls[2], controls[3], t);
+		glm::vec3 p012 = glm::mix(p01, p12, t);
+		glm::vec3 p123 = glm::mix(p12, p23, t);
+		glm::vec3 mid = glm::mix(p012, p123, t);
+		glm::vec3 first = controls[0], last = controls[3];
+		left[0] = first; left[1] = p01; left[2] = p012; left[3] = mid;
+		right[0] = mid; right[1] = p123; right[2] = p23; right[3] = last;
+		return;
+	}
+
+	glm::vec3 scratch[BEZIER_MAX_DEGREE + 1];
+	for (int i = 0; i < count; i++)
+		scratch[i] = controls[i];
+
+	left[0] = scratch[0];
+	right[count - 1] = scratch[count - 1];
+	for (int level = count - 1; level > 0; level--) {
+		for (int i = 0; i < level; i++)
+			scratch[i] = (1.f - t) * scratch[i] + t * scratch[i + 1];
+		left[count - level] = scratch[0];
+		right[level - 1] = scratch[level - 1];
+	}
+}
+
+template <typename Vec>
+float distanceSquaredToSegment(Vec p, Vec a, Vec b) {
+	Vec ab = b - a;
+	float lengthSquared = glm::dot(ab, ab);
+	float t = lengthSquared > 0.f ? glm::clamp(glm::dot(p - a, ab) / lengthSquared, 0.f, 1.f) : 0.f;
+	Vec offset = p - (a + t * ab);
+	return glm::dot(offset, offset);
+}
+
+// The curve lies in its control points' hull, so it's flat once every control point is close to the chord
+bool bezierFlat(const glm::vec3* controls, int count, const BezierTolerance& tolerance) {
+	if (tolerance.screenSpace) {
+		glm::vec2 projected[BEZIER_MAX_DEGREE + 1];
+		bool inFront = true;
+		for (int i = 0; i < count && inFront; i++) {
+			glm::vec4 clip = tolerance.viewProjection * glm::vec4(controls[i], 1.f);
+			inFront = clip.w > 1e-4f;
+			projected[i] = (glm::vec2(clip) / clip.w * .5f + .5f) * tolerance.viewport;
+		}
+
+		// Behind the camera the projection means nothing, so those pieces use the world tolerance
+		if (inFront) {
+			for (int i = 1; i < count - 1; i++) {
+				if (distanceSquaredToSegment(projected[i], projected[0], projected[count - 1]) > tolerance.pixels * tolerance.pixels)
+					return false;
+			}
+			return true;
+		}
+	}
+
+	// Cubics have a tighter bound without divisions, the curve is within sqrt(sum max(u^2, v^2)) / 4 of its chord
+	if (count == 4) {
+		glm::vec3 u = 3.f * controls[1] - 2.f * controls[0] - controls[3];
+		glm::vec3 v = 3.f * controls[2] - controls[0] - 2.f * controls[3];
+		u *= u;
+		v *= v;
+		return glm::dot(glm::max(u, v), glm::vec3(1.f)) <= 16.f * tolerance.world * tolerance.world;
+	}
+
+	for (int i = 1; i < count - 1; i++) {
+		if (distanceSquaredToSegment(controls[i], controls[0], controls[count - 1]) > tolerance.world * tolerance.world)
+			return false;
+	}
+	return true;
+}
+
+// Appends the curve as a polyline, halving pieces until each is flat, only the output vector allocates
+// Returns the number of points added, the first control point included
+size_t tessellateBezierAdaptive(const glm::vec3* controls, int count, const BezierTolerance& tolerance,
+	std::vector<glm::vec3>& out) {
+	if (!bezierDegreeSupported(count))
+		return 0;
+
+	size_t start = out.size();
+	out.push_back(controls[0]);
+	if (count == 1)
+		return 1;
+
+	// Depth first, the right halves wait on the stack so points come out in order
+	glm::vec3 stack[BEZIER_MAX_SUBDIVISIONS + 1][BEZIER_MAX_DEGREE + 1];
+	int depth[BEZIER_MAX_SUBDIVISIONS + 1];
+	int top = 0;
+	for (int i = 0; i < count; i++)
+		stack[0][i] = controls[i];
+	depth[0] = 0;
+
+	while (top >= 0) {
+		glm::vec3* piece = stack[top];
+		if (depth[top] >= BEZIER_MAX_SUBDIVISIONS || bezierFlat(piece, count, tolerance)) {
+			out.push_back(piece[count - 1]);
+			top--;
+			continue;
+		}
+
+		// The left half goes one slot up to be handled next, the right half takes this slot and waits
+		splitBezier(piece, count, .5f, stack[top + 1], piece);
+		depth[top]++;
+		depth[top + 1] = depth[top];
+		top++;
+	}
+	return out.size() - start;
+}
+
+// Tessellates every curve, split over threads in contiguous runs that are joined in curve order
+void tessellateBeziers(const std::vector<glm::vec3>& controls, const std::vector<BezierCurveRange>& curves,
+	const BezierTolerance& tolerance, BezierPolylines& polylines, unsigned int threads) {
+	polylines.points.clear();
+	polylines.first.assign(curves.size(), 0);
+	polylines.count.assign(curves.size(), 0);
+	threads = std::max(1u, std::min(threads, (unsigned int)curves.size()));
+
+	std::vector<std::vector<glm::vec3>> points(threads);
+	auto tessellateRun = [&](unsigned int run) {
+		size_t begin = curves.size() * run / threads;
+		size_t end = curves.size() * (run + 1) / threads;
+		for (size_t i = begin; i < end; i++) {
+			polylines.first[i] = (GLint)points[run].size();
+			polylines.count[i] = (GLsizei)tessellateBezierAdaptive(&controls[curves[i].first], curves[i].count, tolerance, points[run]);
+		}
+	};
+
+	std::vector<std::thread> workers;
+	for (unsigned int run = 1; run < threads; run++)
+		workers.push_back(std::thread(tessellateRun, run));
+	tessellateRun(0);
+	for (auto& worker : workers)
+		worker.join();
+
+	// Offsets were local to each run
+	for (unsigned int run = 0; run < threads; run++) {
+		GLint offset = (GLint)polylines.points.size();
+		size_t begin = curves.size() * run / threads;
+		size_t end = curves.size() * (run + 1) / threads;
+		for (size_t i = begin; i < end; i++)
+			polylines.first[i] += offset;
+		polylines.points.insert(polylines.points.end(), points[run].begin(), points[run].end());
+	}
+}
@@ -0,0 +1,187 @@
+#pragma once
+
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <thread>
+#include <vector>
+
+#include "bezier.h"
+#include "casteljau.h"
+#include "point.h"
+
+double benchNow() {
+	return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Largest distance between the engine's points and the list based reference
+float bezierMaxError(const float* engine, size_t stride, const std::vector<point>& reference) {
+	float error = 0.f;
+	for (size_t i = 0; i < reference.size(); i++) {
+		glm::vec3 p(engine[i * stride], engine[i * stride + 1], engine[i * stride + 2]);
+		error = std::max(error, glm::length(p - glm::vec3(reference[i].x, reference[i].y, reference[i].z)));
+	}
+	return error;
+}
+
+void printBezierResult(FILE* out, const char* name, double ms, int repeats, int samples, double baselineMs, float error) {
+	double points = (double)repeats * (samples + 1);
+	fprintf(out, "  %-28s %9.2f ms  %8.1f Mpoints/s  %6.1fx  max error %.2e\n",
+		name, ms, points / (ms * 1000.0), baselineMs / ms, error);
+}
+
+// Times one curve of the given degree, the list implementation against each engine path
+void benchmarkBezierDegree(FILE* out, const std::vector<glm::vec3>& controls, int samples, int repeats) {
+	int count = (int)controls.size();
+	std::vector<point> ctrlPoints;
+	for (const auto& c : controls)
+		ctrlPoints.push_back(point(c.x, c.y, c.z));
+
+	fprintf(out, "Degree %d, %d samples x %d curves\n", count - 1, samples + 1, repeats);
+
+	// Current implementation, curve points and then vertex floats as a caller would draw them
+	std::vector<point> reference;
+	double start = benchNow();
+	for (int r = 0; r < repeats; r++) {
+		reference = EvaluateBezierCurve(ctrlPoints, samples);
+		int numVerts, numFloats;
+		float* vertices = MakeFloatsFromVector(reference, numVerts, numFloats, 1.f, 1.f, 1.f);
+		free(vertices);
+	}
+	double baselineMs = benchNow() - start;
+	printBezierResult(out, "list de Casteljau", baselineMs, repeats, samples, baselineMs, 0.f);
+
+	// Engine paths write into one buffer allocated up front
+	std::vector<float> vertices(bezierVertexFloats(samples));
+	std::vector<float> ts(samples + 1);
+	for (int i = 0; i <= samples; i++)
+		ts[i] = (float)i / samples;
+	glm::vec3 scratch[BEZIER_MAX_DEGREE + 1];
+
+	start = benchNow();
+	for (int r = 0; r < repeats; r++) {
+		for (int i = 0; i <= samples; i++) {
+			glm::vec3 p = bezierPoint(controls.data(), count, ts[i], scratch);
+			vertices[i * BEZIER_VERTEX_FLOATS] = p.x;
+			vertices[i * BEZIER_VERTEX_FLOATS + 1] = p.y;
+			vertices[i * BEZIER_VERTEX_FLOATS + 2] = p.z;
+		}
+	}
+	double ms = benchNow() - start;
+	printBezierResult(out, count == 4 ? "scalar Bernstein" : "scalar de Casteljau", ms, repeats, samples, baselineMs,
+		bezierMaxError(vertices.data(), BEZIER_VERTEX_FLOATS, reference));
+
+	start = benchNow();
+	for (int r = 0; r < repeats; r++)
+		evaluateBezierBatch(controls.data(), count, ts.data(), ts.size(), vertices.data(), BEZIER_VERTEX_FLOATS);
+	ms = benchNow() - start;
+#ifdef BEZIER_SSE
+	const char* batchName = count == 4 ? "batch, SSE 4 wide" : "batch, scalar";
+#else
+	const char* batchName = "batch, scalar";
+#endif
+	printBezierResult(out, batchName, ms, repeats, samples, baselineMs,
+		bezierMaxError(vertices.data(), BEZIER_VERTEX_FLOATS, reference));
+
+	start = benchNow();
+	for (int r = 0; r < repeats; r++)
+		writeBezierVertices(controls.data(), count, samples, glm::vec3(1.f), vertices.data());
+	ms = benchNow() - start;
+	printBezierResult(out, count == 4 ? "uniform, forward differences" : "uniform", ms, repeats, samples, baselineMs,
+		bezierMaxError(vertices.data(), BEZIER_VERTEX_FLOATS, reference));
+}
+
+// Furthest any point of the true curve is from the polyline, checked at 256 samples per curve
+float polylineMaxError(const std::vector<glm::vec3>& controls, const std::vector<BezierCurveRange>& curves,
+	const BezierPolylines& polylines, size_t curvesToCheck) {
+	float error = 0.f;
+	glm::vec3 scratch[BEZIER_MAX_DEGREE + 1];
+	for (size_t c = 0; c < curves.size() && c < curvesToCheck; c++) {
+		const glm::vec3* line = &polylines.points[polylines.first[c]];
+		for (int i = 0; i <= 256; i++) {
+			glm::vec3 p = bezierPoint(&controls[curves[c].first], curves[c].count, i / 256.f, scratch);
+			float nearest = 1e30f;
+			for (GLsizei j = 0; j + 1 < polylines.count[c]; j++)
+				nearest = std::min(nearest, distanceSquaredToSegment(p, line[j], line[j + 1]));
+			error = std::max(error, sqrtf(nearest));
+		}
+	}
+	return error;
+}
+
+// Mostly straight curves with a few tight bends, uniform sampling against flatness subdivision
+void benchmarkBezierAdaptive(FILE* out, int curveCount, int uniformSamples, float tolerance) {
+	std::vector<glm::vec3> controls;
+	std::vector<BezierCurveRange> curves;
+	for (int c = 0; c < curveCount; c++) {
+		glm::vec3 start(rand() % 200 - 100, rand() % 200 - 100, rand() % 200 - 100);
+		glm::vec3 direction = glm::normalize(glm::vec3(rand() % 200 - 100, rand() % 200 - 100, rand() % 200 - 100) + glm::vec3(.1f));
+		// One in eight bends sharply, the rest stay within a hundredth of a straight line
+		float bend = (c % 8 == 0) ? 5.f : .01f;
+		BezierCurveRange range = { (unsigned int)controls.size(), 4 };
+		curves.push_back(range);
+		for (int i = 0; i < 4; i++) {
+			glm::vec3 offset(rand() % 200 - 100, rand() % 200 - 100, rand() % 200 - 100);
+			controls.push_back(start + direction * (i * 3.f) + offset / 100.f * (i == 0 || i == 3 ? 0.f : bend));
+		}
+	}
+
+	fprintf(out, "Adaptive subdivision, %d cubics, tolerance %.3f against %d uniform samples each\n",
+		curveCount, tolerance, uniformSamples);
+
+	std::vector<float> vertices(bezierVertexFloats(uniformSamples) * curveCount);
+	double start = benchNow();
+	for (int c = 0; c < curveCount; c++) {
+		evaluateBezierUniform(&controls[curves[c].first], curves[c].count, uniformSamples,
+			&vertices[c * bezierVertexFloats(uniformSamples)], BEZIER_VERTEX_FLOATS);
+	}
+	double uniformMs = benchNow() - start;
+
+	// Same error measure for the uniform points
+	BezierPolylines polylines;
+	for (int c = 0; c < curveCount; c++) {
+		polylines.first.push_back((GLint)polylines.points.size());
+		polylines.count.push_back(uniformSamples + 1);
+		for (int i = 0; i <= uniformSamples; i++) {
+			const float* v = &vertices[c * bezierVertexFloats(uniformSamples) + i * BEZIER_VERTEX_FLOATS];
+			polylines.points.push_back(glm::vec3(v[0], v[1], v[2]));
+		}
+	}
+	fprintf(out, "  %-28s %9.2f ms  %9zu vertices  max error %.2e\n", "uniform", uniformMs, polylines.points.size(),
+		polylineMaxError(controls, curves, polylines, 64));
+
+	BezierTolerance flatness;
+	flatness.world = tolerance;
+	unsigned int hardwareThreads = std::max(1u, std::thread::hardware_concurrency());
+	for (unsigned int threads = 1; ; threads = hardwareThreads) {
+		start = benchNow();
+		tessellateBeziers(controls, curves, flatness, polylines, threads);
+		double ms = benchNow() - start;
+
+		char name[64];
+		snprintf(name, sizeof(name), "adaptive, %u thread%s", threads, threads > 1 ? "s" : "");
+		fprintf(out, "  %-28s %9.2f ms  %9zu vertices  max error %.2e\n", name, ms, polylines.points.size(),
+			polylineMaxError(controls, curves, polylines, 64));
+		if (threads == hardwareThreads)
+			break;
+	}
+}
+
+void runBezierBenchmark(FILE* out) {
+	srand(1);
+	std::vector<glm::vec3> cubic;
+	for (int i = 0; i < 4; i++)
+		cubic.push_back(glm::vec3(rand() % 200 - 100, rand() % 200 - 100, rand() % 200 - 100) / 10.f);
+	benchmarkBezierDegree(out, cubic, 10000, 200);
+
+	std::vector<glm::vec3> degree7;
+	for (int i = 0; i < 8; i++)
+		degree7.push_back(glm::vec3(rand() % 200 - 100, rand() % 200 - 100, rand() % 200 - 100) / 10.f);
+	benchmarkBezierDegree(out, degree7, 10000, 50);
+
+	benchmarkBezierAdaptive(out, 20000, 64, .001f);
+}
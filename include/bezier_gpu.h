@@ -0,0 +1,143 @@
+#pragma once
+
+#include <GL/gl3w.h>
+#include <glm/glm.hpp>
+#include <glm/gtc/type_ptr.hpp>
+
+#include <math.h>
+#include <stdlib.h>
+#include <vector>
+
+#include "gpu_resource.h"
+#include "memory_stats.h"
+
+// Pixels each tessellated line segment covers at most, before the hardware's limit of 64
+#define BEZIER_PIXELS_PER_SEGMENT 8.f
+
+// Only control points live on the GPU, the tessellation stages evaluate them every frame
+// Cubic curves are patches of 4 points, bicubic surfaces patches of 16
+struct TessellatedBeziers {
+	GpuVertexArray VAO;
+	GpuBuffer controlBuffer;
+	unsigned int program;
+	int controlsPerPatch;
+
+	// Current and animation rest positions, uploaded whole once per frame
+	std::vector<glm::vec3> controls;
+	std::vector<glm::vec3> rest;
+};
+
+TessellatedBeziers setup_tessellated_beziers(unsigned int program, const std::vector<glm::vec3>& controls, int controlsPerPatch)
+{
+	TessellatedBeziers beziers;
+	beziers.program = program;
+	beziers.controlsPerPatch = controlsPerPatch;
+	beziers.controls = controls;
+	beziers.rest = controls;
+
+	beziers.controlBuffer = createBuffer();
+	trackedBufferStorage(beziers.controlBuffer, controls.size() * sizeof(glm::vec3), controls.data(), GL_DYNAMIC_STORAGE_BIT,
+		MEMORY_SCENE_BUFFERS, "bezier controls");
+
+	beziers.VAO = createNamedVertexArray();
+	glVertexArrayVertexBuffer(beziers.VAO, 0, beziers.controlBuffer, 0, sizeof(glm::vec3));
+	glEnableVertexArrayAttrib(beziers.VAO, 0);
+	glVertexArrayAttribFormat(beziers.VAO, 0, 3, GL_FLOAT, GL_FALSE, 0);
+	glVertexArrayAttribBinding(beziers.VAO, 0, 0);
+
+	return beziers;
+}
+
+// The one buffer update a frame of animation costs
+void uploadTessellatedBeziers(TessellatedBeziers& beziers)
+{
+	glNamedBufferSubData(beziers.controlBuffer, 0, beziers.controls.size() * sizeof(glm::vec3), beziers.controls.data());
+}
+
+// Set any other uniforms, such as colours, on the program first
+void drawTessellatedBeziers(const TessellatedBeziers& beziers, glm::mat4 viewProjection, int width, int height)
+{
+	glUseProgram(beziers.program);
+	glUniformMatrix4fv(glGetUniformLocation(beziers.program, "viewProjection"), 1, GL_FALSE, glm::value_ptr(viewProjection));
+	glUniform2f(glGetUniformLocation(beziers.program, "viewport"), (float)width, (float)height);
+	glUniform1f(glGetUniformLocation(beziers.program, "pixelsPerSegment"), BEZIER_PIXELS_PER_SEGMENT);
+
+	glPatchParameteri(GL_PATCH_VERTICES, beziers.controlsPerPatch);
+	glBindVertexArray(beziers.VAO);
+	glDrawArrays(GL_PATCHES, 0, (GLsizei)beziers.controls.size());
+	glBindVertexArray(0);
+}
+
+float randomRange(float low, float high)
+{
+	return low + (high - low) * (rand() / (float)RAND_MAX);
+}
+
+// Blades of grass around centre, each a cubic rising from the ground and bending over
+std::vector<glm::vec3> makeGrassCurves(int count, glm::vec3 centre, float radius, unsigned int seed)
+{
+	srand(seed);
+	std::vector<glm::vec3> controls;
+	for (int i = 0; i < count; i++) {
+		float angle = randomRange(0.f, 6.2831853f);
+		float distance = radius * sqrtf(randomRange(0.f, 1.f));
+		glm::vec3 root = centre + glm::vec3(cosf(angle) * distance, 0.f, sinf(angle) * distance);
+
+		float height = randomRange(.15f, .35f);
+		float lean = randomRange(0.f, 6.2831853f);
+		glm::vec3 bend = glm::vec3(cosf(lean), 0.f, sinf(lean)) * height * randomRange(.2f, .6f);
+
+		controls.push_back(root);
+		controls.push_back(root + glm::vec3(0.f, height * .4f, 0.f));
+		controls.push_back(root + glm::vec3(0.f, height * .8f, 0.f) + bend * .4f);
+		controls.push_back(root + glm::vec3(0.f, height, 0.f) + bend);
+	}
+	return controls;
+}
+
+// Wind bends each blade further the higher the control point, roots stay put
+void swayGrass(TessellatedBeziers& grass, float time)
+{
+	for (size_t i = 0; i < grass.rest.size(); i++) {
+		int level = (int)(i % 4);
+		const glm::vec3& root = grass.rest[i - level];
+		float phase = time * 2.f + root.x * 1.7f + root.z * 1.3f;
+		float strength = .03f * level * level;
+		grass.controls[i] = grass.rest[i] + glm::vec3(sinf(phase), 0.f, cosf(phase * .7f) * .5f) * strength;
+	}
+}
+
+// A columns x rows sheet of bicubic patches hanging in the xy plane from its top edge
+// Neighbours share their edge's control points, so the sheet is continuous
+std::vector<glm::vec3> makeFlagPatches(int columns, int rows, glm::vec3 topLeft, float width, float height)
+{
+	int latticeWidth = columns * 3 + 1;
+	int latticeHeight = rows * 3 + 1;
+	std::vector<glm::vec3> lattice;
+	for (int y = 0; y < latticeHeight; y++) {
+		for (int x = 0; x < latticeWidth; x++) {
+			lattice.push_back(topLeft + glm::vec3(width * x / (latticeWidth - 1), -height * y / (latticeHeight - 1), 0.f));
+		}
+	}
+
+	std::vector<glm::vec3> controls;
+	for (int row = 0; row < rows; row++) {
+		for (int column = 0; column < columns; column++) {
+			for (int v = 0; v < 4; v++) {
+				for (int u = 0; u < 4; u++)
+					controls.push_back(lattice[(row * 3 + v) * latticeWidth + column * 3 + u]);
+			}
+		}
+	}
+	return controls;
+}
+
+// Travelling wave along the flag, zero at the pole edge
+void waveFlag(TessellatedBeziers& flag, glm::vec3 pole, float width, float time)
+{
+	for (size_t i = 0; i < flag.rest.size(); i++) {
+		const glm::vec3& p = flag.rest[i];
+		float across = (p.x - pole.x) / width;
+		flag.controls[i] = p + glm::vec3(0.f, 0.f, sinf(across * 7.f - time * 4.f) * .15f * across);
+	}
+}
@@ -0,0 +1,300 @@
+#pragma once
+
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <math.h>
+#include <thread>
+#include <vector>
+
+#include "bezier.h"
+#include "obj_parser.h"
+#include "profiler.h"
+
+// Bicubic tensor product patch, control point (u, v) is at v * 4 + u
+// Texture coordinates run linearly from uvMin at (0, 0) to uvMax at (1, 1)
+struct BezierSurfacePatch {
+	glm::vec3 controls[16];
+	glm::vec2 uvMin;
+	glm::vec2 uvMax;
+};
+
+// Segments per edge come from the edge's size on screen when seen face on from eye, rounded up to a power of two
+// Ignoring the view direction keeps the mesh right for a camera that turns after it's built
+struct SurfaceLod {
+	glm::vec3 eye = glm::vec3(0.f);
+	// Pixels a world unit covers at distance one
+	float pixelsPerUnit = 1000.f;
+	float pixelsPerSegment = 32.f;
+	int maxSegments = 16;
+};
+
+SurfaceLod surfaceLodForCamera(glm::vec3 eye, float fovY, int viewportHeight, float pixelsPerSegment, int maxSegments) {
+	SurfaceLod lod;
+	lod.eye = eye;
+	lod.pixelsPerUnit = viewportHeight / (2.f * tanf(fovY * .5f));
+	lod.pixelsPerSegment = pixelsPerSegment;
+	lod.maxSegments = maxSegments;
+	return lod;
+}
+
+// Edges in the order u = 0, v = 0, u = 1, v = 1, with the interior at the finest of them
+struct PatchSegments {
+	int edges[4];
+	int interior;
+};
+
+void bernsteinCubic(float t, float* b, float* d) {
+	float s = 1.f - t;
+	b[0] = s * s * s;
+	b[1] = 3.f * s * s * t;
+	b[2] = 3.f * s * t * t;
+	b[3] = t * t * t;
+	d[0] = -3.f * s * s;
+	d[1] = 3.f * s * s - 6.f * s * t;
+	d[2] = 6.f * s * t - 3.f * t * t;
+	d[3] = 3.f * t * t;
+}
+
+// Sums along u first and then v, neighbours evaluating a shared edge add the same points in the same order
+// and get bit identical positions, which keeps the mesh watertight
+void evaluatePatchScalar(const BezierSurfacePatch& patch, float u, float v, glm::vec3& position, glm::vec3& dPdu, glm::vec3& dPdv) {
+	float bu[4], du[4], bv[4], dv[4];
+	bernsteinCubic(u, bu, du);
+	bernsteinCubic(v, bv, dv);
+
+	position = dPdu = dPdv = glm::vec3(0.f);
+	for (int j = 0; j < 4; j++) {
+		glm::vec3 row(0.f), rowDu(0.f);
+		for (int i = 0; i < 4; i++) {
+			row += bu[i] * patch.controls[j * 4 + i];
+			rowDu += du[i] * patch.controls[j * 4 + i];
+		}
+		position += bv[j] * row;
+		dPdu += bv[j] * rowDu;
+		dPdv += dv[j] * row;
+	}
+}
+
+#ifdef BEZIER_SSE
+void bernsteinCubic4(__m128 t, __m128* b, __m128* d) {
+	const __m128 three = _mm_set1_ps(3.f);
+	const __m128 six = _mm_set1_ps(6.f);
+	__m128 s = _mm_sub_ps(_mm_set1_ps(1.f), t);
+	__m128 ss = _mm_mul_ps(s, s);
+	__m128 tt = _mm_mul_ps(t, t);
+	__m128 st = _mm_mul_ps(s, t);
+	b[0] = _mm_mul_ps(ss, s);
+	b[1] = _mm_mul_ps(_mm_mul_ps(three, ss), t);
+	b[2] = _mm_mul_ps(_mm_mul_ps(three, s), tt);
+	b[3] = _mm_mul_ps(tt, t);
+	d[0] = _mm_mul_ps(_mm_set1_ps(-3.f), ss);
+	d[1] = _mm_sub_ps(_mm_mul_ps(three, ss), _mm_mul_ps(six, st));
+	d[2] = _mm_sub_ps(_mm_mul_ps(six, st), _mm_mul_ps(three, tt));
+	d[3] = _mm_mul_ps(three, tt);
+}
+
+// Four (u, v) pairs at once, the same order of operations as the scalar version
+void evaluatePatch4(const BezierSurfacePatch& patch, const float* u, const float* v, glm::vec3* position, glm::vec3* dPdu, glm::vec3* dPdv) {
+	__m128 bu[4], du[4], bv[4], dv[4];
+	bernsteinCubic4(_mm_loadu_ps(u), bu, du);
+	bernsteinCubic4(_mm_loadu_ps(v), bv, dv);
+
+	float out[3][3][4];
+	for (int c = 0; c < 3; c++) {
+		__m128 p = _mm_setzero_ps(), pu = _mm_setzero_ps(), pv = _mm_setzero_ps();
+		for (int j = 0; j < 4; j++) {
+			__m128 row = _mm_setzero_ps(), rowDu = _mm_setzero_ps();
+			for (int i = 0; i < 4; i++) {
+				__m128 control = _mm_set1_ps(patch.controls[j * 4 + i][c]);
+				row = _mm_add_ps(row, _mm_mul_ps(bu[i], control));
+				rowDu = _mm_add_ps(rowDu, _mm_mul_ps(du[i], control));
+			}
+			p = _mm_add_ps(p, _mm_mul_ps(bv[j], row));
+			pu = _mm_add_ps(pu, _mm_mul_ps(bv[j], rowDu));
+			pv = _mm_add_ps(pv, _mm_mul_ps(dv[j], row));
+		}
+		_mm_storeu_ps(out[0][c], p);
+		_mm_storeu_ps(out[1][c], pu);
+		_mm_storeu_ps(out[2][c], pv);
+	}
+
+	for (int k = 0; k < 4; k++) {
+		position[k] = glm::vec3(out[0][0][k], out[0][1][k], out[0][2][k]);
+		dPdu[k] = glm::vec3(out[1][0][k], out[1][1][k], out[1][2][k]);
+		dPdv[k] = glm::vec3(out[2][0][k], out[2][1][k], out[2][2][k]);
+	}
+}
+#endif
+
+int nextPowerOfTwo(int n) {
+	int p = 1;
+	while (p < n)
+		p <<= 1;
+	return p;
+}
+
+// Control polygon length at the distance of its nearest control point, never less than the curve's
+int edgeSegments(const BezierSurfacePatch& patch, int first, int stride, const SurfaceLod& lod) {
+	float length = 0.f;
+	float distance = glm::length(patch.controls[first] - lod.eye);
+	for (int i = 1; i < 4; i++) {
+		const glm::vec3& p = patch.controls[first + i * stride];
+		length += glm::length(p - patch.controls[first + (i - 1) * stride]);
+		distance = std::min(distance, glm::length(p - lod.eye));
+	}
+	float pixels = length / std::max(distance, 1e-3f) * lod.pixelsPerUnit;
+	return std::min(nextPowerOfTwo((int)ceilf(pixels / lod.pixelsPerSegment)), lod.maxSegments);
+}
+
+// Each edge only looks at its own control points, so both patches sharing it pick the same count
+PatchSegments patchSegments(const BezierSurfacePatch& patch, const SurfaceLod& lod) {
+	PatchSegments segments;
+	segments.edges[0] = edgeSegments(patch, 0, 4, lod);
+	segments.edges[1] = edgeSegments(patch, 0, 1, lod);
+	segments.edges[2] = edgeSegments(patch, 3, 4, lod);
+	segments.edges[3] = edgeSegments(patch, 12, 1, lod);
+	segments.interior = std::max(std::max(segments.edges[0], segments.edges[1]), std::max(segments.edges[2], segments.edges[3]));
+	return segments;
+}
+
+size_t patchVertexCount(const PatchSegments& segments) {
+	return (size_t)segments.interior * segments.interior * 6;
+}
+
+// Grid index i of n snapped onto an edge with fewer segments, both are powers of two so the edge's vertices are grid vertices
+// Grid vertices in between collapse onto them and leave zero area triangles instead of cracks
+float snapToEdge(int i, int n, int edgeSegments) {
+	int step = n / edgeSegments;
+	return (float)((i + step / 2) / step) / (float)edgeSegments;
+}
+
+// Grid of (n + 1)^2 parameters with the outer rows and columns snapped to their edge's segments
+void patchParameters(const PatchSegments& segments, std::vector<float>& u, std::vector<float>& v) {
+	int n = segments.interior;
+	size_t count = (size_t)(n + 1) * (n + 1);
+	// Padded so the last batch of four reads initialised parameters
+	u.assign(count + 3, 0.f);
+	v.assign(count + 3, 0.f);
+	for (int j = 0; j <= n; j++) {
+		for (int i = 0; i <= n; i++) {
+			float pu = (float)i / n;
+			float pv = (float)j / n;
+			if (i == 0)
+				pv = snapToEdge(j, n, segments.edges[0]);
+			else if (i == n)
+				pv = snapToEdge(j, n, segments.edges[2]);
+			if (j == 0)
+				pu = snapToEdge(i, n, segments.edges[1]);
+			else if (j == n)
+				pu = snapToEdge(i, n, segments.edges[3]);
+			u[j * (n + 1) + i] = pu;
+			v[j * (n + 1) + i] = pv;
+		}
+	}
+}
+
+// Per thread scratch, sized for the finest patch once and reused
+struct PatchScratch {
+	std::vector<float> u, v;
+	std::vector<glm::vec3> position, dPdu, dPdv;
+};
+
+// Writes the patch's triangles, counter-clockwise around cross(dP/du, dP/dv), to out
+void tessellatePatch(const BezierSurfacePatch& patch, const PatchSegments& segments, glm::vec4 colour,
+	PatchScratch& scratch, vertex* out) {
+	int n = segments.interior;
+	patchParameters(segments, scratch.u, scratch.v);
+	size_t count = scratch.u.size();
+	scratch.position.resize(count);
+	scratch.dPdu.resize(count);
+	scratch.dPdv.resize(count);
+
+	size_t k = 0;
+#ifdef BEZIER_SSE
+	for (; k + 4 <= count; k += 4)
+		evaluatePatch4(patch, &scratch.u[k], &scratch.v[k], &scratch.position[k], &scratch.dPdu[k], &scratch.dPdv[k]);
+#endif
+	for (; k < count; k++)
+		evaluatePatchScalar(patch, scratch.u[k], scratch.v[k], scratch.position[k], scratch.dPdu[k], scratch.dPdv[k]);
+
+	// Collapsed edges have no tangent, the corner's control polygon still gives the facing
+	glm::vec3 fallback = glm::cross(patch.controls[1] - patch.controls[0], patch.controls[4] - patch.controls[0]);
+
+	auto makeVertex = [&](int i, int j) {
+		size_t index = (size_t)j * (n + 1) + i;
+		vertex result;
+		result.pos = scratch.position[index];
+		result.col = colour;
+		glm::vec3 normal = glm::cross(scratch.dPdu[index], scratch.dPdv[index]);
+		if (glm::dot(normal, normal) < 1e-12f)
+			normal = fallback;
+		result.nor = glm::normalize(normal);
+		result.tex = glm::mix(patch.uvMin, patch.uvMax, glm::vec2(scratch.u[index], scratch.v[index]));
+		return result;
+	};
+
+	for (int j = 0; j < n; j++) {
+		for (int i = 0; i < n; i++) {
+			vertex a = makeVertex(i, j), b = makeVertex(i + 1, j);
+			vertex c = makeVertex(i + 1, j + 1), d = makeVertex(i, j + 1);
+			*out++ = a; *out++ = b; *out++ = c;
+			*out++ = a; *out++ = c; *out++ = d;
+		}
+	}
+}
+
+// Triangle list for model(const std::vector<vertex>&), patches are split over threads in contiguous runs
+// Every patch's triangle count is known up front, so threads write straight into the shared output
+std::vector<vertex> tessellateBezierSurface(const std::vector<BezierSurfacePatch>& patches, const SurfaceLod& lod,
+	glm::vec4 colour, unsigned int threads) {
+	PROFILE_SCOPE("surface tessellation");
+	std::vector<PatchSegments> segments;
+	std::vector<size_t> offsets;
+	size_t total = 0;
+	for (const auto& patch : patches) {
+		segments.push_back(patchSegments(patch, lod));
+		offsets.push_back(total);
+		total += patchVertexCount(segments.back());
+	}
+
+	std::vector<vertex> vertices(total);
+	threads = std::max(1u, std::min(threads, (unsigned int)patches.size()));
+	auto tessellateRun = [&](unsigned int run) {
+		PatchScratch scratch;
+		size_t begin = patches.size() * run / threads;
+		size_t end = patches.size() * (run + 1) / threads;
+		for (size_t i = begin; i < end; i++)
+			tessellatePatch(patches[i], segments[i], colour, scratch, &vertices[offsets[i]]);
+	};
+
+	std::vector<std::thread> workers;
+	for (unsigned int run = 1; run < threads; run++)
+		workers.push_back(std::thread(tessellateRun, run));
+	tessellateRun(0);
+	for (auto& worker : workers)
+		worker.join();
+
+	return vertices;
+}
+
+// Flat columns x rows grid of patches facing +y, from corner towards +x and -z
+// Texture coordinates repeat once per uvTile world units
+std::vector<BezierSurfacePatch> makeFlatPatches(glm::vec3 corner, glm::vec2 size, int columns, int rows, float uvTile) {
+	std::vector<BezierSurfacePatch> patches;
+	glm::vec2 patchSize = size / glm::vec2((float)columns, (float)rows);
+	for (int row = 0; row < rows; row++) {
+		for (int column = 0; column < columns; column++) {
+			BezierSurfacePatch patch;
+			glm::vec3 origin = corner + glm::vec3(column * patchSize.x, 0.f, -row * patchSize.y);
+			for (int v = 0; v < 4; v++) {
+				for (int u = 0; u < 4; u++)
+					patch.controls[v * 4 + u] = origin + glm::vec3(patchSize.x * u / 3.f, 0.f, -patchSize.y * v / 3.f);
+			}
+			patch.uvMin = glm::vec2(column * patchSize.x, row * patchSize.y) / uvTile;
+			patch.uvMax = patch.uvMin + patchSize / uvTile;
+			patches.push_back(patch);
+		}
+	}
+	return patches;
+}
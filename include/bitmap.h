@@ -2,8 +2,8 @@
 #define BITMAP_H
 
 #include <stdio.h>
-#include <windows.h>
-#include <wingdi.h>
+
+#include "platform.h"
 
 
 GLuint savebitmap(const char* filename, 
@@ -0,0 +1,204 @@
+#pragma once
+
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+#include "bezier.h"
+#include "camera.h"
+#include "platform.h"
+
+// Samples per cubic segment in the arc length table
+#define CAMERA_PATH_LUT_SAMPLES 64
+
+// Piecewise cubic Bezier flythrough, the camera's position and look-at target share the curve parameter
+// Segments share end points, so a path with n segments has 3n + 1 control points
+struct CameraPath {
+	std::vector<glm::vec3> positions;
+	std::vector<glm::vec3> targets;
+
+	// Distance along the path at each evenly spaced parameter, for constant speed playback
+	std::vector<float> arcLength;
+	float totalLength = 0.f;
+
+	float distance = 0.f;
+	bool loop = true;
+};
+
+// Camera samples taken while flying around, written as a path on exit
+struct CameraRecording {
+	std::vector<glm::vec3> positions;
+	std::vector<glm::vec3> targets;
+	double interval = 0.25;
+	double sinceLast = 0.0;
+};
+
+size_t cameraPathSegments(const CameraPath& path) {
+	return path.positions.size() < 4 ? 0 : (path.positions.size() - 1) / 3;
+}
+
+glm::vec3 evaluateSegment(const std::vector<glm::vec3>& controls, size_t segment, float t) {
+	return bezierPoint<3>(&controls[segment * 3], t);
+}
+
+// Global parameter u in [0, segments] to the position and target on the path
+void evaluateCameraPath(const CameraPath& path, float u, glm::vec3& position, glm::vec3& target) {
+	size_t segments = cameraPathSegments(path);
+	size_t segment = std::min((size_t)std::max(u, 0.f), segments - 1);
+	float t = glm::clamp(u - (float)segment, 0.f, 1.f);
+	position = evaluateSegment(path.positions, segment, t);
+	target = evaluateSegment(path.targets, segment, t);
+}
+
+// Length is whichever of the position and target moves further, so turning on the spot still takes time
+void buildArcLengthTable(CameraPath& path) {
+	size_t samples = cameraPathSegments(path) * CAMERA_PATH_LUT_SAMPLES;
+	path.arcLength.assign(1, 0.f);
+
+	glm::vec3 previous, previousTarget;
+	evaluateCameraPath(path, 0.f, previous, previousTarget);
+	for (size_t i = 1; i <= samples; i++) {
+		glm::vec3 position, target;
+		evaluateCameraPath(path, (float)i / CAMERA_PATH_LUT_SAMPLES, position, target);
+		float step = std::max(glm::length(position - previous), glm::length(target - previousTarget));
+		path.arcLength.push_back(path.arcLength.back() + step);
+		previous = position;
+		previousTarget = target;
+	}
+	path.totalLength = path.arcLength.back();
+}
+
+// Inverts the arc length table, linear between samples
+float cameraPathParameter(const CameraPath& path, float distance) {
+	distance = glm::clamp(distance, 0.f, path.totalLength);
+	size_t upper = std::lower_bound(path.arcLength.begin(), path.arcLength.end(), distance) - path.arcLength.begin();
+	if (upper == 0)
+		return 0.f;
+
+	float start = path.arcLength[upper - 1];
+	float span = path.arcLength[upper] - start;
+	float fraction = span > 0.f ? (distance - start) / span : 0.f;
+	return ((float)(upper - 1) + fraction) / CAMERA_PATH_LUT_SAMPLES;
+}
+
+// One control point per line, "px py pz tx ty tz", lines starting with # are comments
+bool load_camera_path(const char* filename, CameraPath& path) {
+	FILE* f;
+	fopen_s(&f, filename, "r");
+	if (f == NULL) {
+		fprintf(stderr, "Could not open camera path %s\n", filename);
+		return false;
+	}
+
+	path = CameraPath();
+	char line[256];
+	while (fgets(line, sizeof(line), f)) {
+		if (line[0] == '#')
+			continue;
+		glm::vec3 position, target;
+		if (sscanf(line, "%f %f %f %f %f %f", &position.x, &position.y, &position.z, &target.x, &target.y, &target.z) == 6) {
+			path.positions.push_back(position);
+			path.targets.push_back(target);
+		}
+	}
+	fclose(f);
+
+	if (path.positions.size() < 4 || (path.positions.size() - 1) % 3 != 0) {
+		fprintf(stderr, "Camera path %s needs 3n + 1 control points, has %zu\n", filename, path.positions.size());
+		return false;
+	}
+
+	buildArcLengthTable(path);
+	printf("Camera path %s: %zu segments, %.2f units long\n", filename, cameraPathSegments(path), path.totalLength);
+	return true;
+}
+
+// Places the camera at the current distance, yaw and pitch follow so mouse control carries on smoothly
+void applyCameraPath(const CameraPath& path, SCamera& camera) {
+	glm::vec3 position, target;
+	evaluateCameraPath(path, cameraPathParameter(path, path.distance), position, target);
+
+	camera.Position = position;
+	if (glm::length(target - position) > 1e-5f)
+		camera.Front = glm::normalize(target - position);
+	camera.Right = glm::normalize(glm::cross(camera.Front, camera.WorldUp));
+	camera.Up = glm::normalize(glm::cross(camera.Right, camera.Front));
+	camera.Pitch = glm::degrees(asinf(glm::clamp(camera.Front.y, -1.f, 1.f)));
+	camera.Yaw = glm::degrees(atan2f(camera.Front.z, camera.Front.x));
+}
+
+// Moves along the path at constant speed, returns false once a non-looping path has ended
+bool advanceCameraPath(CameraPath& path, float distance) {
+	path.distance += distance;
+	if (path.distance <= path.totalLength)
+		return true;
+	if (!path.loop || path.totalLength <= 0.f) {
+		path.distance = path.totalLength;
+		return false;
+	}
+	path.distance = fmodf(path.distance, path.totalLength);
+	return true;
+}
+
+// Samples the camera every interval, the target is a point one unit ahead
+void recordCamera(CameraRecording& recording, const SCamera& camera, double delta) {
+	recording.sinceLast += delta;
+	if (!recording.positions.empty() && recording.sinceLast < recording.interval)
+		return;
+	recording.sinceLast = 0.0;
+
+	// Standing still adds nothing to a path
+	if (!recording.positions.empty() && glm::length(camera.Position - recording.positions.back()) < 1e-4f &&
+		glm::length(camera.Position + camera.Front - recording.targets.back()) < 1e-4f)
+		return;
+
+	recording.positions.push_back(camera.Position);
+	recording.targets.push_back(camera.Position + camera.Front);
+}
+
+// Inner control points of the Catmull-Rom spline through the samples, as a cubic Bezier segment
+void catmullRomControls(const std::vector<glm::vec3>& samples, size_t i, glm::vec3& c1, glm::vec3& c2) {
+	glm::vec3 before = samples[i > 0 ? i - 1 : i];
+	glm::vec3 after = samples[i + 2 < samples.size() ? i + 2 : i + 1];
+	c1 = samples[i] + (samples[i + 1] - before) / 6.f;
+	c2 = samples[i + 1] - (after - samples[i]) / 6.f;
+}
+
+// Writes a path through every sample that load_camera_path reads back
+bool save_camera_path(const CameraRecording& recording, const char* filename) {
+	if (recording.positions.size() < 2) {
+		fprintf(stderr, "Camera recording too short to save\n");
+		return false;
+	}
+
+	FILE* f;
+	fopen_s(&f, filename, "w");
+	if (f == NULL) {
+		fprintf(stderr, "Could not write camera path %s\n", filename);
+		return false;
+	}
+
+	fprintf(f, "# Recorded camera path, px py pz tx ty tz per control point\n");
+	for (size_t i = 0; i + 1 < recording.positions.size(); i++) {
+		glm::vec3 p1, p2, t1, t2;
+		catmullRomControls(recording.positions, i, p1, p2);
+		catmullRomControls(recording.targets, i, t1, t2);
+
+		const glm::vec3& p0 = recording.positions[i];
+		const glm::vec3& t0 = recording.targets[i];
+		fprintf(f, "%f %f %f %f %f %f\n", p0.x, p0.y, p0.z, t0.x, t0.y, t0.z);
+		fprintf(f, "%f %f %f %f %f %f\n", p1.x, p1.y, p1.z, t1.x, t1.y, t1.z);
+		fprintf(f, "%f %f %f %f %f %f\n", p2.x, p2.y, p2.z, t2.x, t2.y, t2.z);
+	}
+	const glm::vec3& last = recording.positions.back();
+	const glm::vec3& lastTarget = recording.targets.back();
+	fprintf(f, "%f %f %f %f %f %f\n", last.x, last.y, last.z, lastTarget.x, lastTarget.y, lastTarget.z);
+	fclose(f);
+
+	printf("Wrote camera path %s, %zu samples\n", filename, recording.positions.size());
+	return true;
+}
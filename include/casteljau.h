@@ -1,3 +1,5 @@
+#pragma once
+
 #include <list>
 #include <vector>
 #include <algorithm>
@@ -0,0 +1,193 @@
+#pragma once
+
+#include <GL/gl3w.h>
+#include <glm/glm.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+#include <glm/gtc/type_ptr.hpp>
+
+#include <math.h>
+#include <random>
+#include <vector>
+
+#include "gpu_resource.h"
+#include "memory_stats.h"
+
+// Froxel grid for clustered forward lighting, depth slices are exponential between the near and far planes
+#define CLUSTER_GRID_X 16
+#define CLUSTER_GRID_Y 9
+#define CLUSTER_GRID_Z 24
+#define CLUSTER_COUNT (CLUSTER_GRID_X * CLUSTER_GRID_Y * CLUSTER_GRID_Z)
+#define MAX_LIGHTS_PER_CLUSTER 128
+
+// Shader storage binding points, must match phong.frag and cluster.comp
+#define LIGHT_BUFFER_BINDING 3
+#define CLUSTER_COUNT_BINDING 4
+#define CLUSTER_INDEX_BINDING 5
+
+// std430 layout, 48 bytes
+struct ClusterLight {
+	glm::vec4 positionRadius;
+	glm::vec4 colour;
+	// xyz spot direction, w cosine of the cutoff, or -2 for a point light
+	glm::vec4 spotDirectionCutoff;
+};
+
+struct ClusteredLights {
+	GpuBuffer lightBuffer, countBuffer, indexBuffer;
+	GLuint computeProgram;
+	std::vector<ClusterLight> lights;
+	bool gpuBinning = true;
+
+	float nearPlane, farPlane;
+
+	// CPU binning output, only used by the fallback
+	std::vector<GLuint> counts;
+	std::vector<GLuint> indices;
+};
+
+ClusteredLights setup_clustered_lights(GLuint computeProgram, const std::vector<ClusterLight>& lights,
+	float nearPlane, float farPlane) {
+	ClusteredLights clustered;
+	clustered.computeProgram = computeProgram;
+	clustered.lights = lights;
+	clustered.nearPlane = nearPlane;
+	clustered.farPlane = farPlane;
+
+	// Binning on the GPU needs compute shaders, otherwise fall back to the CPU
+	GLint major = 0, minor = 0;
+	glGetIntegerv(GL_MAJOR_VERSION, &major);
+	glGetIntegerv(GL_MINOR_VERSION, &minor);
+	clustered.gpuBinning = computeProgram != 0 && (major > 4 || (major == 4 && minor >= 3));
+
+	clustered.lightBuffer = createBuffer();
+	trackedBufferStorage(clustered.lightBuffer, glm::max((size_t)1, lights.size()) * sizeof(ClusterLight),
+		lights.empty() ? NULL : lights.data(), GL_DYNAMIC_STORAGE_BIT, MEMORY_SCENE_BUFFERS, "cluster lights");
+	clustered.countBuffer = createBuffer();
+	trackedBufferStorage(clustered.countBuffer, CLUSTER_COUNT * sizeof(GLuint), NULL, GL_DYNAMIC_STORAGE_BIT, MEMORY_SCENE_BUFFERS, "cluster counts");
+	clustered.indexBuffer = createBuffer();
+	trackedBufferStorage(clustered.indexBuffer, CLUSTER_COUNT * MAX_LIGHTS_PER_CLUSTER * sizeof(GLuint), NULL, GL_DYNAMIC_STORAGE_BIT,
+		MEMORY_SCENE_BUFFERS, "cluster light indices");
+
+	return clustered;
+}
+
+// Deterministic scatter of small point and spot lights over the scene
+std::vector<ClusterLight> makeSceneLights(int count, unsigned int seed = 1234) {
+	std::mt19937 rng(seed);
+	std::uniform_real_distribution<float> x(-10.f, 10.f);
+	std::uniform_real_distribution<float> y(-1.1f, 2.f);
+	std::uniform_real_distribution<float> z(-15.f, 5.f);
+	std::uniform_real_distribution<float> radius(0.5f, 2.f);
+	std::uniform_real_distribution<float> unit(0.f, 1.f);
+
+	std::vector<ClusterLight> lights;
+	for (int i = 0; i < count; i++) {
+		ClusterLight light;
+		light.positionRadius = glm::vec4(x(rng), y(rng), z(rng), radius(rng));
+		light.colour = glm::vec4(unit(rng), unit(rng), unit(rng), 1.f) * 0.5f;
+
+		// Every fourth light is a spot pointing down
+		if (i % 4 == 0)
+			light.spotDirectionCutoff = glm::vec4(0.f, -1.f, 0.f, cos(glm::radians(25.f)));
+		else
+			light.spotDirectionCutoff = glm::vec4(0.f, 0.f, 0.f, -2.f);
+
+		lights.push_back(light);
+	}
+
+	return lights;
+}
+
+// View space bounds of one froxel, the same maths as cluster.comp
+void clusterBounds(const ClusteredLights& clustered, glm::mat4 inverseProjection, int cx, int cy, int cz,
+	glm::vec3& boundsMin, glm::vec3& boundsMax) {
+	float ratio = clustered.farPlane / clustered.nearPlane;
+	float zNear = -clustered.nearPlane * pow(ratio, (float)cz / CLUSTER_GRID_Z);
+	float zFar = -clustered.nearPlane * pow(ratio, (float)(cz + 1) / CLUSTER_GRID_Z);
+
+	glm::vec2 ndcMin = glm::vec2((float)cx / CLUSTER_GRID_X, (float)cy / CLUSTER_GRID_Y) * 2.f - 1.f;
+	glm::vec2 ndcMax = glm::vec2((float)(cx + 1) / CLUSTER_GRID_X, (float)(cy + 1) / CLUSTER_GRID_Y) * 2.f - 1.f;
+
+	boundsMin = glm::vec3(1e30f);
+	boundsMax = glm::vec3(-1e30f);
+	for (int corner = 0; corner < 4; corner++) {
+		glm::vec2 ndc = glm::vec2((corner & 1) ? ndcMax.x : ndcMin.x, (corner & 2) ? ndcMax.y : ndcMin.y);
+		glm::vec4 onNear = inverseProjection * glm::vec4(ndc, -1.f, 1.f);
+		glm::vec3 ray = glm::vec3(onNear) / onNear.w;
+
+		glm::vec3 a = ray * (zNear / ray.z);
+		glm::vec3 b = ray * (zFar / ray.z);
+		boundsMin = glm::min(boundsMin, glm::min(a, b));
+		boundsMax = glm::max(boundsMax, glm::max(a, b));
+	}
+}
+
+// Fallback for drivers without compute shaders
+void binLightsCPU(ClusteredLights& clustered, glm::mat4 view, glm::mat4 projection) {
+	glm::mat4 inverseProjection = glm::inverse(projection);
+	clustered.counts.assign(CLUSTER_COUNT, 0);
+	clustered.indices.resize(CLUSTER_COUNT * MAX_LIGHTS_PER_CLUSTER);
+
+	std::vector<glm::vec4> viewLights;
+	for (const auto& light : clustered.lights) {
+		glm::vec3 p = glm::vec3(view * glm::vec4(glm::vec3(light.positionRadius), 1.f));
+		viewLights.push_back(glm::vec4(p, light.positionRadius.w));
+	}
+
+	for (int cz = 0; cz < CLUSTER_GRID_Z; cz++) {
+		for (int cy = 0; cy < CLUSTER_GRID_Y; cy++) {
+			for (int cx = 0; cx < CLUSTER_GRID_X; cx++) {
+				int cluster = cx + CLUSTER_GRID_X * (cy + CLUSTER_GRID_Y * cz);
+				glm::vec3 boundsMin, boundsMax;
+				clusterBounds(clustered, inverseProjection, cx, cy, cz, boundsMin, boundsMax);
+
+				GLuint count = 0;
+				for (size_t i = 0; i < viewLights.size() && count < MAX_LIGHTS_PER_CLUSTER; i++) {
+					glm::vec3 centre = glm::vec3(viewLights[i]);
+					glm::vec3 closest = glm::clamp(centre, boundsMin, boundsMax);
+					glm::vec3 offset = closest - centre;
+					if (glm::dot(offset, offset) <= viewLights[i].w * viewLights[i].w)
+						clustered.indices[cluster * MAX_LIGHTS_PER_CLUSTER + count++] = (GLuint)i;
+				}
+				clustered.counts[cluster] = count;
+			}
+		}
+	}
+
+	glNamedBufferSubData(clustered.countBuffer, 0, CLUSTER_COUNT * sizeof(GLuint), clustered.counts.data());
+	glNamedBufferSubData(clustered.indexBuffer, 0, clustered.indices.size() * sizeof(GLuint), clustered.indices.data());
+}
+
+// Sets the grid uniforms shared by cluster.comp and phong.frag
+void setClusterUniforms(const ClusteredLights& clustered, GLuint program, glm::mat4 view, glm::mat4 projection,
+	int width, int height) {
+	glUseProgram(program);
+	glUniform3ui(glGetUniformLocation(program, "clusterGrid"), CLUSTER_GRID_X, CLUSTER_GRID_Y, CLUSTER_GRID_Z);
+	glUniform1f(glGetUniformLocation(program, "clusterNear"), clustered.nearPlane);
+	glUniform1f(glGetUniformLocation(program, "clusterFar"), clustered.farPlane);
+	glUniform1ui(glGetUniformLocation(program, "maxLightsPerCluster"), MAX_LIGHTS_PER_CLUSTER);
+	glUniform1ui(glGetUniformLocation(program, "lightCount"), (GLuint)clustered.lights.size());
+	glUniform2f(glGetUniformLocation(program, "screenSize"), (float)width, (float)height);
+	glUniformMatrix4fv(glGetUniformLocation(program, "view"), 1, GL_FALSE, glm::value_ptr(view));
+	glUniformMatrix4fv(glGetUniformLocation(program, "inverseProjection"), 1, GL_FALSE, glm::value_ptr(glm::inverse(projection)));
+}
+
+void bindClusteredLights(const ClusteredLights& clustered) {
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, LIGHT_BUFFER_BINDING, clustered.lightBuffer);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, CLUSTER_COUNT_BINDING, clustered.countBuffer);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, CLUSTER_INDEX_BINDING, clustered.indexBuffer);
+}
+
+// Rebuilds the per-cluster light lists for this frame's camera
+void binLights(ClusteredLights& clustered, glm::mat4 view, glm::mat4 projection, int width, int height) {
+	bindClusteredLights(clustered);
+
+	if (!clustered.gpuBinning) {
+		binLightsCPU(clustered, view, projection);
+		return;
+	}
+
+	setClusterUniforms(clustered, clustered.computeProgram, view, projection, width, height);
+	glDispatchCompute((CLUSTER_COUNT + 63) / 64, 1, 1);
+	glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+}
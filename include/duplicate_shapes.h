@@ -0,0 +1,204 @@
+#pragma once
+
+#include <glm/glm.hpp>
+
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+#include <unordered_map>
+#include <vector>
+
+#include "obj_parser.h"
+
+// Where one obj group's triangles live, in the parsed vertices and once uploaded
+struct ShapeRange {
+	size_t firstVertex;
+	size_t vertexCount;
+	size_t firstFace;
+	// Index of the earlier shape this one repeats, or -1 if its own vertices are uploaded
+	int copyOf;
+	// Start in the uploaded vertices, shared with copies
+	size_t uploadedFirst;
+	// Slot of the first part transform and how many copies draw from this range, including itself
+	unsigned int firstPart;
+	unsigned int parts;
+};
+
+// Shapes of a model with repeated geometry folded into instances of the first occurrence
+struct DuplicateShapes {
+	std::vector<ShapeRange> ranges;
+	// Rigid transforms from the repeated shape to each copy, slot 0 is the identity used by every other draw
+	std::vector<glm::mat4> partTransforms;
+	size_t copies = 0;
+	size_t repeatedShapes = 0;
+};
+
+// Centroid origin and axes from the first triangle with any area, so copies in the same vertex order agree
+bool shapeFrame(const std::vector<vertex>& vertices, const ShapeRange& range, glm::mat4& frame) {
+	glm::vec3 centroid(0.f);
+	for (size_t i = 0; i < range.vertexCount; i++)
+		centroid += vertices[range.firstVertex + i].pos;
+	centroid /= (float)range.vertexCount;
+
+	for (size_t i = 0; i + 2 < range.vertexCount; i += 3) {
+		const glm::vec3& a = vertices[range.firstVertex + i].pos;
+		glm::vec3 edge = vertices[range.firstVertex + i + 1].pos - a;
+		glm::vec3 normal = glm::cross(edge, vertices[range.firstVertex + i + 2].pos - a);
+		if (glm::length(normal) < 1e-12f || glm::length(edge) < 1e-12f)
+			continue;
+
+		glm::vec3 x = glm::normalize(edge);
+		glm::vec3 z = glm::normalize(normal);
+		frame = glm::mat4(glm::vec4(x, 0.f), glm::vec4(glm::cross(z, x), 0.f), glm::vec4(z, 0.f), glm::vec4(centroid, 1.f));
+		return true;
+	}
+	return false;
+}
+
+// Inverse of a frame from shapeFrame, the rotation is orthonormal
+glm::mat4 inverseRigid(const glm::mat4& frame) {
+	glm::mat3 rotation = glm::transpose(glm::mat3(frame));
+	glm::mat4 inverse = glm::mat4(rotation);
+	inverse[3] = glm::vec4(-(rotation * glm::vec3(frame[3])), 1.f);
+	return inverse;
+}
+
+// Vertex count, materials and positions in the shape's own frame, quantised to cell
+// Copies that straddle a cell boundary hash apart and are simply kept, the exact check is in shapesMatch
+size_t shapeSignature(const std::vector<vertex>& vertices, const std::vector<int>& material_id, const ShapeRange& range,
+	const glm::mat4& frame, float cell) {
+	glm::mat4 toLocal = inverseRigid(frame);
+	size_t h = range.vertexCount;
+	for (size_t f = 0; f < range.vertexCount / 3; f++)
+		h = h * 31 + (size_t)(material_id[range.firstFace + f] + 1);
+	for (size_t i = 0; i < range.vertexCount; i++) {
+		glm::vec3 local = glm::vec3(toLocal * glm::vec4(vertices[range.firstVertex + i].pos, 1.f));
+		for (int c = 0; c < 3; c++)
+			h = h * 31 + (size_t)(int64_t)floorf(local[c] / cell);
+	}
+	return h;
+}
+
+// Every vertex of the copy is the transformed original, within tolerance, with the same attributes and materials
+bool shapesMatch(const std::vector<vertex>& vertices, const std::vector<int>& material_id, const ShapeRange& original,
+	const ShapeRange& copy, const glm::mat4& transform, float tolerance) {
+	if (original.vertexCount != copy.vertexCount)
+		return false;
+	for (size_t f = 0; f < original.vertexCount / 3; f++) {
+		if (material_id[original.firstFace + f] != material_id[copy.firstFace + f])
+			return false;
+	}
+
+	glm::mat3 rotation = glm::mat3(transform);
+	for (size_t i = 0; i < original.vertexCount; i++) {
+		const vertex& a = vertices[original.firstVertex + i];
+		const vertex& b = vertices[copy.firstVertex + i];
+		if (glm::length(glm::vec3(transform * glm::vec4(a.pos, 1.f)) - b.pos) > tolerance)
+			return false;
+		if (glm::length(rotation * a.nor - b.nor) > 1e-3f)
+			return false;
+		if (a.tex != b.tex || a.col != b.col)
+			return false;
+	}
+	return true;
+}
+
+// Finds obj groups that repeat an earlier group up to a rotation and translation
+// Tolerance is in model units, mirrored or scaled copies are not detected
+DuplicateShapes findDuplicateShapes(const std::vector<vertex>& vertices, const std::vector<tinyobj::shape_t>& shapes,
+	const std::vector<int>& material_id, float tolerance) {
+	DuplicateShapes duplicates;
+	duplicates.partTransforms.push_back(glm::mat4(1.f));
+
+	size_t firstVertex = 0;
+	size_t firstFace = 0;
+	for (const auto& shape : shapes) {
+		ShapeRange range = {};
+		range.firstVertex = firstVertex;
+		range.firstFace = firstFace;
+		for (int fv : shape.mesh.num_face_vertices)
+			range.vertexCount += fv;
+		range.copyOf = -1;
+		range.parts = 1;
+		duplicates.ranges.push_back(range);
+
+		firstVertex += range.vertexCount;
+		firstFace += shape.mesh.num_face_vertices.size();
+	}
+
+	// Only triangulated groups are compared, which is every group obj_parse produces
+	bool triangles = true;
+	for (const auto& shape : shapes) {
+		for (int fv : shape.mesh.num_face_vertices)
+			triangles = triangles && fv == 3;
+	}
+	if (!triangles)
+		return duplicates;
+
+	// Copies of each original, in shape order
+	std::vector<std::vector<std::pair<int, glm::mat4>>> copies(shapes.size());
+	std::unordered_map<size_t, std::vector<int>> originals;
+	std::vector<glm::mat4> frames(shapes.size());
+	for (size_t s = 0; s < shapes.size(); s++) {
+		ShapeRange& range = duplicates.ranges[s];
+		if (range.vertexCount == 0 || !shapeFrame(vertices, range, frames[s]))
+			continue;
+
+		std::vector<int>& candidates = originals[shapeSignature(vertices, material_id, range, frames[s], tolerance * 64.f)];
+		for (int original : candidates) {
+			glm::mat4 transform = frames[s] * inverseRigid(frames[original]);
+			if (shapesMatch(vertices, material_id, duplicates.ranges[original], range, transform, tolerance)) {
+				range.copyOf = original;
+				copies[original].push_back(std::make_pair((int)s, transform));
+				break;
+			}
+		}
+		if (range.copyOf < 0)
+			candidates.push_back((int)s);
+	}
+
+	// Originals with copies get a run of part transforms, themselves first
+	for (size_t s = 0; s < shapes.size(); s++) {
+		if (copies[s].empty())
+			continue;
+
+		ShapeRange& range = duplicates.ranges[s];
+		range.firstPart = (unsigned int)duplicates.partTransforms.size();
+		range.parts = (unsigned int)copies[s].size() + 1;
+		duplicates.partTransforms.push_back(glm::mat4(1.f));
+		for (const auto& copy : copies[s])
+			duplicates.partTransforms.push_back(copy.second);
+
+		duplicates.copies += copies[s].size();
+		duplicates.repeatedShapes++;
+	}
+	return duplicates;
+}
+
+// Vertices of every shape that isn't a copy, the buffer the GPU actually gets
+std::vector<vertex> uniqueShapeVertices(const std::vector<vertex>& vertices, DuplicateShapes& duplicates) {
+	std::vector<vertex> unique;
+	for (auto& range : duplicates.ranges) {
+		if (range.copyOf >= 0)
+			continue;
+		range.uploadedFirst = unique.size();
+		unique.insert(unique.end(), vertices.begin() + range.firstVertex, vertices.begin() + range.firstVertex + range.vertexCount);
+	}
+	for (auto& range : duplicates.ranges) {
+		if (range.copyOf >= 0)
+			range.uploadedFirst = duplicates.ranges[range.copyOf].uploadedFirst;
+	}
+	return unique;
+}
+
+// Procedural models are one shape with nothing repeated
+DuplicateShapes singleShape(size_t vertexCount) {
+	DuplicateShapes duplicates;
+	duplicates.partTransforms.push_back(glm::mat4(1.f));
+	ShapeRange range = {};
+	range.vertexCount = vertexCount;
+	range.copyOf = -1;
+	range.parts = 1;
+	duplicates.ranges.push_back(range);
+	return duplicates;
+}
@@ -0,0 +1,458 @@
+#pragma once
+
+#include <glm/glm.hpp>
+#include <glm/gtc/quaternion.hpp>
+
+#include <deque>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "model.h"
+
+// Four lanes at a time on any x64 target, scalar elsewhere
+#if defined(_M_X64) || defined(__SSE2__)
+#include <emmintrin.h>
+#define ENTITY_SSE 1
+#endif
+
+typedef uint32_t Entity;
+typedef uint32_t MeshHandle;
+#define NO_ENTITY 0xFFFFFFFFu
+#define NO_MESH 0xFFFFFFFFu
+
+// Local transform changed since the last update
+#define ENTITY_DIRTY (1u << 0)
+// World matrix changed in the last update
+#define ENTITY_MOVED (1u << 1)
+// Bounds touched the camera frustum at the last cull
+#define ENTITY_VISIBLE (1u << 2)
+#define ENTITY_SHADOW_CASTER (1u << 3)
+// Drawn before the occlusion tests, and tested against by the occludees
+#define ENTITY_OCCLUDER (1u << 4)
+#define ENTITY_OCCLUDEE (1u << 5)
+// Never moves after setup, may be merged into the static batch
+#define ENTITY_STATIC (1u << 6)
+#define ENTITY_TRANSPARENT (1u << 7)
+// Keeps its mesh's parsed geometry on the CPU after setup, for picking or physics
+#define ENTITY_KEEP_GEOMETRY (1u << 8)
+
+// Every entity is an index into the same arrays, each pass walks only the arrays it reads
+// Parents are always created before their children, so one pass in order updates the whole hierarchy
+struct EntityStore {
+	// Local transform, relative to the parent
+	std::vector<glm::vec3> position;
+	std::vector<glm::quat> rotation;
+	std::vector<glm::vec3> scale;
+	std::vector<Entity> parent;
+	// Built from the three above when the entity is dirty, kept for when only its parent moves
+	std::vector<glm::mat4> local;
+
+	std::vector<glm::mat4> world;
+	// Scratch list of dirty entities, reused by every update
+	std::vector<Entity> dirty;
+	// Mesh space bounds, and the world space box around them after each update
+	std::vector<glm::vec3> localMin, localMax;
+	std::vector<glm::vec3> worldMin, worldMax;
+
+	std::vector<MeshHandle> mesh;
+	std::vector<uint32_t> flags;
+	// Setup and debugging only, passes never look entities up by name
+	std::vector<std::string> names;
+
+	// A deque never moves its elements as it grows, so meshes keep their address and GL handles
+	std::deque<model> meshes;
+};
+
+// Builds the mesh in place in the store
+template <typename... Args>
+MeshHandle emplaceMesh(EntityStore& store, Args&&... args)
+{
+	store.meshes.emplace_back(std::forward<Args>(args)...);
+	return (MeshHandle)(store.meshes.size() - 1);
+}
+
+Entity createEntity(EntityStore& store, const std::string& name, MeshHandle mesh, uint32_t flags, Entity parent = NO_ENTITY)
+{
+	Entity entity = (Entity)store.names.size();
+	store.position.push_back(glm::vec3(0.f));
+	store.rotation.push_back(glm::quat(1.f, 0.f, 0.f, 0.f));
+	store.scale.push_back(glm::vec3(1.f));
+	store.parent.push_back(parent < entity ? parent : NO_ENTITY);
+	store.local.push_back(glm::mat4(1.f));
+	store.world.push_back(glm::mat4(1.f));
+
+	glm::vec3 boundsMin(0.f), boundsMax(0.f);
+	if (mesh != NO_MESH) {
+		boundsMin = store.meshes[mesh].getBoundsMin();
+		boundsMax = store.meshes[mesh].getBoundsMax();
+		if (store.meshes[mesh].hasTransparency())
+			flags |= ENTITY_TRANSPARENT;
+	}
+	store.localMin.push_back(boundsMin);
+	store.localMax.push_back(boundsMax);
+	store.worldMin.push_back(boundsMin);
+	store.worldMax.push_back(boundsMax);
+
+	store.mesh.push_back(mesh);
+	store.flags.push_back(flags | ENTITY_DIRTY | ENTITY_VISIBLE);
+	store.names.push_back(name);
+
+	if (parent != NO_ENTITY && parent >= entity)
+		fprintf(stderr, "Entity %s: parent %u doesn't exist yet, made it a root\n", name.c_str(), parent);
+	return entity;
+}
+
+Entity findEntity(const EntityStore& store, const std::string& name)
+{
+	for (size_t e = 0; e < store.names.size(); e++) {
+		if (store.names[e] == name)
+			return (Entity)e;
+	}
+	fprintf(stderr, "No entity named %s\n", name.c_str());
+	return NO_ENTITY;
+}
+
+size_t entityCount(const EntityStore& store)
+{
+	return store.flags.size();
+}
+
+bool hasFlags(const EntityStore& store, Entity entity, uint32_t flags)
+{
+	return (store.flags[entity] & flags) == flags;
+}
+
+// Transformations, applied at the next updateWorldTransforms
+void setEntityTransform(EntityStore& store, Entity entity, glm::vec3 position, glm::quat rotation, glm::vec3 scale)
+{
+	store.position[entity] = position;
+	store.rotation[entity] = rotation;
+	store.scale[entity] = scale;
+	store.flags[entity] |= ENTITY_DIRTY;
+}
+
+// About the entity's own axes, like model::rotate
+void rotateEntity(EntityStore& store, Entity entity, float angle_rad, glm::vec3 axis)
+{
+	store.rotation[entity] = glm::normalize(store.rotation[entity] * glm::angleAxis(angle_rad, axis));
+	store.flags[entity] |= ENTITY_DIRTY;
+}
+
+// The entity's mesh with its world matrix, meshes shared between entities are re-pointed before each draw
+model& entityMesh(EntityStore& store, Entity entity)
+{
+	model& m = store.meshes[store.mesh[entity]];
+	m.setModelMatrix(store.world[entity]);
+	return m;
+}
+
+glm::vec3 entityCenter(const EntityStore& store, Entity entity)
+{
+	return (store.worldMin[entity] + store.worldMax[entity]) * 0.5f;
+}
+
+glm::mat4 composeTransform(glm::vec3 position, glm::quat rotation, glm::vec3 scale)
+{
+	glm::mat3 r = glm::mat3_cast(rotation);
+	return glm::mat4(glm::vec4(r[0] * scale.x, 0.f), glm::vec4(r[1] * scale.y, 0.f), glm::vec4(r[2] * scale.z, 0.f),
+		glm::vec4(position, 1.f));
+}
+
+#ifdef ENTITY_SSE
+// Column major a * b, like glm, a column of the result per four lane multiply-add
+void multiplyTransforms(const glm::mat4& a, const glm::mat4& b, glm::mat4& out)
+{
+	__m128 a0 = _mm_loadu_ps(&a[0][0]);
+	__m128 a1 = _mm_loadu_ps(&a[1][0]);
+	__m128 a2 = _mm_loadu_ps(&a[2][0]);
+	__m128 a3 = _mm_loadu_ps(&a[3][0]);
+	for (int c = 0; c < 4; c++) {
+		__m128 r = _mm_mul_ps(a0, _mm_set1_ps(b[c][0]));
+		r = _mm_add_ps(r, _mm_mul_ps(a1, _mm_set1_ps(b[c][1])));
+		r = _mm_add_ps(r, _mm_mul_ps(a2, _mm_set1_ps(b[c][2])));
+		r = _mm_add_ps(r, _mm_mul_ps(a3, _mm_set1_ps(b[c][3])));
+		_mm_storeu_ps(&out[c][0], r);
+	}
+}
+
+// Local matrices of four entities at once, an entity per lane, then transposed into their columns
+// Same arithmetic as mat3_cast, so it matches composeTransform
+void composeTransforms4(EntityStore& store, const Entity* ids)
+{
+	const glm::vec3 p[4] = { store.position[ids[0]], store.position[ids[1]], store.position[ids[2]], store.position[ids[3]] };
+	const glm::quat q[4] = { store.rotation[ids[0]], store.rotation[ids[1]], store.rotation[ids[2]], store.rotation[ids[3]] };
+	const glm::vec3 s[4] = { store.scale[ids[0]], store.scale[ids[1]], store.scale[ids[2]], store.scale[ids[3]] };
+	__m128 qx = _mm_setr_ps(q[0].x, q[1].x, q[2].x, q[3].x);
+	__m128 qy = _mm_setr_ps(q[0].y, q[1].y, q[2].y, q[3].y);
+	__m128 qz = _mm_setr_ps(q[0].z, q[1].z, q[2].z, q[3].z);
+	__m128 qw = _mm_setr_ps(q[0].w, q[1].w, q[2].w, q[3].w);
+	__m128 sx = _mm_setr_ps(s[0].x, s[1].x, s[2].x, s[3].x);
+	__m128 sy = _mm_setr_ps(s[0].y, s[1].y, s[2].y, s[3].y);
+	__m128 sz = _mm_setr_ps(s[0].z, s[1].z, s[2].z, s[3].z);
+
+	const __m128 one = _mm_set1_ps(1.f);
+	const __m128 two = _mm_set1_ps(2.f);
+	__m128 xx = _mm_mul_ps(qx, qx), yy = _mm_mul_ps(qy, qy), zz = _mm_mul_ps(qz, qz);
+	__m128 xy = _mm_mul_ps(qx, qy), xz = _mm_mul_ps(qx, qz), yz = _mm_mul_ps(qy, qz);
+	__m128 wx = _mm_mul_ps(qw, qx), wy = _mm_mul_ps(qw, qy), wz = _mm_mul_ps(qw, qz);
+
+	// Rotation columns scaled by their axis, w lanes are 0 except the translation's
+	__m128 c0x = _mm_mul_ps(_mm_sub_ps(one, _mm_mul_ps(two, _mm_add_ps(yy, zz))), sx);
+	__m128 c0y = _mm_mul_ps(_mm_mul_ps(two, _mm_add_ps(xy, wz)), sx);
+	__m128 c0z = _mm_mul_ps(_mm_mul_ps(two, _mm_sub_ps(xz, wy)), sx);
+	__m128 c0w = _mm_setzero_ps();
+	__m128 c1x = _mm_mul_ps(_mm_mul_ps(two, _mm_sub_ps(xy, wz)), sy);
+	__m128 c1y = _mm_mul_ps(_mm_sub_ps(one, _mm_mul_ps(two, _mm_add_ps(xx, zz))), sy);
+	__m128 c1z = _mm_mul_ps(_mm_mul_ps(two, _mm_add_ps(yz, wx)), sy);
+	__m128 c1w = _mm_setzero_ps();
+	__m128 c2x = _mm_mul_ps(_mm_mul_ps(two, _mm_add_ps(xz, wy)), sz);
+	__m128 c2y = _mm_mul_ps(_mm_mul_ps(two, _mm_sub_ps(yz, wx)), sz);
+	__m128 c2z = _mm_mul_ps(_mm_sub_ps(one, _mm_mul_ps(two, _mm_add_ps(xx, yy))), sz);
+	__m128 c2w = _mm_setzero_ps();
+	__m128 c3x = _mm_setr_ps(p[0].x, p[1].x, p[2].x, p[3].x);
+	__m128 c3y = _mm_setr_ps(p[0].y, p[1].y, p[2].y, p[3].y);
+	__m128 c3z = _mm_setr_ps(p[0].z, p[1].z, p[2].z, p[3].z);
+	__m128 c3w = one;
+
+	// Each transpose turns one column across the four entities into that column of each entity
+	_MM_TRANSPOSE4_PS(c0x, c0y, c0z, c0w);
+	_MM_TRANSPOSE4_PS(c1x, c1y, c1z, c1w);
+	_MM_TRANSPOSE4_PS(c2x, c2y, c2z, c2w);
+	_MM_TRANSPOSE4_PS(c3x, c3y, c3z, c3w);
+	const __m128 columns[4][4] = {
+		{ c0x, c1x, c2x, c3x }, { c0y, c1y, c2y, c3y }, { c0z, c1z, c2z, c3z }, { c0w, c1w, c2w, c3w }
+	};
+	for (int lane = 0; lane < 4; lane++) {
+		glm::mat4& out = store.local[ids[lane]];
+		for (int c = 0; c < 4; c++)
+			_mm_storeu_ps(&out[c][0], columns[lane][c]);
+	}
+}
+
+// Box around the transformed box, from its centre and the absolute matrix times its half extent
+void transformBounds(const glm::mat4& m, glm::vec3 localMin, glm::vec3 localMax, glm::vec3& worldMin, glm::vec3& worldMax)
+{
+	const __m128 signMask = _mm_set1_ps(-0.f);
+	const __m128 half = _mm_set1_ps(.5f);
+	__m128 lo = _mm_setr_ps(localMin.x, localMin.y, localMin.z, 0.f);
+	__m128 hi = _mm_setr_ps(localMax.x, localMax.y, localMax.z, 0.f);
+	__m128 centre = _mm_mul_ps(_mm_add_ps(lo, hi), half);
+	__m128 extent = _mm_mul_ps(_mm_sub_ps(hi, lo), half);
+
+	float c[4], e[4];
+	_mm_storeu_ps(c, centre);
+	_mm_storeu_ps(e, extent);
+
+	__m128 outCentre = _mm_loadu_ps(&m[3][0]);
+	__m128 outExtent = _mm_setzero_ps();
+	for (int k = 0; k < 3; k++) {
+		__m128 column = _mm_loadu_ps(&m[k][0]);
+		outCentre = _mm_add_ps(outCentre, _mm_mul_ps(column, _mm_set1_ps(c[k])));
+		outExtent = _mm_add_ps(outExtent, _mm_mul_ps(_mm_andnot_ps(signMask, column), _mm_set1_ps(e[k])));
+	}
+
+	float lower[4], upper[4];
+	_mm_storeu_ps(lower, _mm_sub_ps(outCentre, outExtent));
+	_mm_storeu_ps(upper, _mm_add_ps(outCentre, outExtent));
+	worldMin = glm::vec3(lower[0], lower[1], lower[2]);
+	worldMax = glm::vec3(upper[0], upper[1], upper[2]);
+}
+#else
+void multiplyTransforms(const glm::mat4& a, const glm::mat4& b, glm::mat4& out)
+{
+	out = a * b;
+}
+
+void transformBounds(const glm::mat4& m, glm::vec3 localMin, glm::vec3 localMax, glm::vec3& worldMin, glm::vec3& worldMax)
+{
+	glm::vec3 centre = glm::vec3(m * glm::vec4((localMin + localMax) * 0.5f, 1.f));
+	glm::vec3 halfExtent = (localMax - localMin) * 0.5f;
+	glm::vec3 extent = glm::abs(glm::vec3(m[0])) * halfExtent.x + glm::abs(glm::vec3(m[1])) * halfExtent.y +
+		glm::abs(glm::vec3(m[2])) * halfExtent.z;
+	worldMin = centre - extent;
+	worldMax = centre + extent;
+}
+#endif
+
+// Recomputes the world matrix and bounds of every entity that moved, or whose parent did
+// Returns how many were recomputed, an unchanged scene costs one pass over the flags
+size_t updateWorldTransforms(EntityStore& store)
+{
+	size_t count = entityCount(store);
+
+	// Local matrices of the dirty entities first, gathered so a few scattered ones still fill the lanes
+	store.dirty.clear();
+	for (size_t e = 0; e < count; e++) {
+		if (store.flags[e] & ENTITY_DIRTY)
+			store.dirty.push_back((Entity)e);
+	}
+	size_t d = 0;
+#ifdef ENTITY_SSE
+	for (; d + 4 <= store.dirty.size(); d += 4)
+		composeTransforms4(store, &store.dirty[d]);
+#endif
+	for (; d < store.dirty.size(); d++) {
+		Entity e = store.dirty[d];
+		store.local[e] = composeTransform(store.position[e], store.rotation[e], store.scale[e]);
+	}
+
+	// Then world matrices in order, parents come first so theirs are already up to date
+	size_t updated = 0;
+	for (size_t e = 0; e < count; e++) {
+		uint32_t flags = store.flags[e] & ~ENTITY_MOVED;
+		Entity parent = store.parent[e];
+		bool parentMoved = parent != NO_ENTITY && (store.flags[parent] & ENTITY_MOVED);
+		if (!(flags & ENTITY_DIRTY) && !parentMoved) {
+			store.flags[e] = flags;
+			continue;
+		}
+
+		if (parent == NO_ENTITY)
+			store.world[e] = store.local[e];
+		else
+			multiplyTransforms(store.world[parent], store.local[e], store.world[e]);
+		transformBounds(store.world[e], store.localMin[e], store.localMax[e], store.worldMin[e], store.worldMax[e]);
+
+		store.flags[e] = (flags & ~ENTITY_DIRTY) | ENTITY_MOVED;
+		updated++;
+	}
+	return updated;
+}
+
+// Frustum planes of a view projection, ax + by + cz + d >= 0 inside
+// Stored plane by plane across lanes, the last two lanes always pass
+struct FrustumPlanes {
+	float x[8], y[8], z[8], d[8];
+};
+
+FrustumPlanes frustumPlanes(const glm::mat4& viewProjection)
+{
+	FrustumPlanes planes;
+	for (int p = 0; p < 8; p++) {
+		glm::vec4 plane(0.f, 0.f, 0.f, 1.f);
+		if (p < 6) {
+			int row = p / 2;
+			float sign = p % 2 == 0 ? 1.f : -1.f;
+			for (int c = 0; c < 4; c++)
+				plane[c] = viewProjection[c][3] + sign * viewProjection[c][row];
+		}
+		planes.x[p] = plane.x;
+		planes.y[p] = plane.y;
+		planes.z[p] = plane.z;
+		planes.d[p] = plane.w;
+	}
+	return planes;
+}
+
+// Sets ENTITY_VISIBLE on every entity whose world bounds touch the frustum, returns how many do
+size_t cullEntities(EntityStore& store, const glm::mat4& viewProjection)
+{
+	FrustumPlanes planes = frustumPlanes(viewProjection);
+	size_t visible = 0;
+	size_t count = entityCount(store);
+
+#ifdef ENTITY_SSE
+	const __m128 signMask = _mm_set1_ps(-0.f);
+	const __m128 half = _mm_set1_ps(.5f);
+	const __m128 zero = _mm_setzero_ps();
+	__m128 px[2], py[2], pz[2], pd[2], ax[2], ay[2], az[2];
+	for (int g = 0; g < 2; g++) {
+		px[g] = _mm_loadu_ps(planes.x + g * 4);
+		py[g] = _mm_loadu_ps(planes.y + g * 4);
+		pz[g] = _mm_loadu_ps(planes.z + g * 4);
+		pd[g] = _mm_loadu_ps(planes.d + g * 4);
+		ax[g] = _mm_andnot_ps(signMask, px[g]);
+		ay[g] = _mm_andnot_ps(signMask, py[g]);
+		az[g] = _mm_andnot_ps(signMask, pz[g]);
+	}
+
+	for (size_t e = 0; e < count; e++) {
+		const glm::vec3& lo = store.worldMin[e];
+		const glm::vec3& hi = store.worldMax[e];
+		__m128 cx = _mm_set1_ps((lo.x + hi.x) * .5f), cy = _mm_set1_ps((lo.y + hi.y) * .5f), cz = _mm_set1_ps((lo.z + hi.z) * .5f);
+		__m128 ex = _mm_mul_ps(_mm_set1_ps(hi.x - lo.x), half);
+		__m128 ey = _mm_mul_ps(_mm_set1_ps(hi.y - lo.y), half);
+		__m128 ez = _mm_mul_ps(_mm_set1_ps(hi.z - lo.z), half);
+
+		// Outside when the box's nearest corner is behind any plane
+		int outside = 0;
+		for (int g = 0; g < 2; g++) {
+			__m128 distance = _mm_add_ps(_mm_add_ps(_mm_mul_ps(px[g], cx), _mm_mul_ps(py[g], cy)), _mm_add_ps(_mm_mul_ps(pz[g], cz), pd[g]));
+			__m128 radius = _mm_add_ps(_mm_add_ps(_mm_mul_ps(ax[g], ex), _mm_mul_ps(ay[g], ey)), _mm_mul_ps(az[g], ez));
+			outside |= _mm_movemask_ps(_mm_cmplt_ps(_mm_add_ps(distance, radius), zero));
+		}
+
+		if (outside)
+			store.flags[e] &= ~ENTITY_VISIBLE;
+		else {
+			store.flags[e] |= ENTITY_VISIBLE;
+			visible++;
+		}
+	}
+#else
+	for (size_t e = 0; e < count; e++) {
+		glm::vec3 centre = (store.worldMin[e] + store.worldMax[e]) * 0.5f;
+		glm::vec3 extent = (store.worldMax[e] - store.worldMin[e]) * 0.5f;
+
+		bool outside = false;
+		for (int p = 0; p < 6; p++) {
+			float distance = planes.x[p] * centre.x + planes.y[p] * centre.y + planes.z[p] * centre.z + planes.d[p];
+			float radius = fabsf(planes.x[p]) * extent.x + fabsf(planes.y[p]) * extent.y + fabsf(planes.z[p]) * extent.z;
+			outside = outside || distance + radius < 0.f;
+		}
+
+		if (outside)
+			store.flags[e] &= ~ENTITY_VISIBLE;
+		else {
+			store.flags[e] |= ENTITY_VISIBLE;
+			visible++;
+		}
+	}
+#endif
+	return visible;
+}
+
+// Frees the parsed geometry of every mesh no entity asked to keep, once the static batch and visibility buffer are built
+void releaseSceneGeometry(EntityStore& store, bool keepAll)
+{
+	std::vector<bool> keep(store.meshes.size(), keepAll);
+	std::vector<std::string> meshNames(store.meshes.size());
+	for (size_t e = 0; e < entityCount(store); e++) {
+		if (store.mesh[e] == NO_MESH)
+			continue;
+		if (store.flags[e] & ENTITY_KEEP_GEOMETRY)
+			keep[store.mesh[e]] = true;
+		if (meshNames[store.mesh[e]].empty())
+			meshNames[store.mesh[e]] = store.names[e];
+	}
+
+	size_t cpuBefore = 0, cpuAfter = 0, gpu = 0;
+	for (size_t m = 0; m < store.meshes.size(); m++) {
+		model& mesh = store.meshes[m];
+		size_t before = mesh.cpuBytes();
+		if (!keep[m])
+			mesh.releaseCpuGeometry();
+		printf("  %-10s CPU %7.2f MB -> %7.2f MB%s, GPU %7.2f MB\n", meshNames[m].c_str(), before / 1048576.0,
+			mesh.cpuBytes() / 1048576.0, keep[m] ? " (kept)" : "", mesh.gpuBytes() / 1048576.0);
+		cpuBefore += before;
+		cpuAfter += mesh.cpuBytes();
+		gpu += mesh.gpuBytes();
+	}
+	printf("Mesh geometry: CPU %.2f MB -> %.2f MB after upload, GPU %.2f MB\n", cpuBefore / 1048576.0, cpuAfter / 1048576.0,
+		gpu / 1048576.0);
+}
+
+// Entities with a mesh and all of the flags, in store order
+std::vector<Entity> entitiesWith(const EntityStore& store, uint32_t flags)
+{
+	std::vector<Entity> entities;
+	for (size_t e = 0; e < entityCount(store); e++) {
+		if ((store.flags[e] & flags) == flags && store.mesh[e] != NO_MESH)
+			entities.push_back((Entity)e);
+	}
+	return entities;
+}
@@ -0,0 +1,74 @@
+#pragma once
+
+#include <glm/glm.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+
+#include "bezier_bench.h"
+#include "entities.h"
+
+// Mesh-less entities in groups of 16, a root and children hanging off random earlier members of the group
+void buildBenchEntities(EntityStore& store, size_t count) {
+	for (size_t e = 0; e < count; e++) {
+		size_t member = e % 16;
+		Entity parent = member == 0 ? NO_ENTITY : (Entity)(e - 1 - rand() % member);
+		Entity entity = createEntity(store, "", NO_MESH, 0, parent);
+		store.localMin[entity] = glm::vec3(-.5f);
+		store.localMax[entity] = glm::vec3(.5f);
+
+		glm::vec3 position = glm::vec3(rand() % 2000 - 1000, rand() % 2000 - 1000, rand() % 2000 - 1000) / (member == 0 ? 10.f : 500.f);
+		glm::vec3 axis = glm::normalize(glm::vec3(rand() % 200 - 100, rand() % 200 - 100, rand() % 200 - 100) + glm::vec3(.01f));
+		setEntityTransform(store, entity, position, glm::angleAxis((rand() % 628) / 100.f, axis), glm::vec3(1.f));
+	}
+}
+
+void printEntityResult(FILE* out, const char* name, double ms, int repeats, size_t count) {
+	fprintf(out, "  %-28s %9.3f ms  %7.2f ns/entity\n", name, ms / repeats, ms * 1e6 / ((double)repeats * count));
+}
+
+// Times one store size, the per entity cost should stay flat as the count grows
+void benchmarkEntityCount(FILE* out, size_t count, int repeats) {
+	EntityStore store;
+	buildBenchEntities(store, count);
+	fprintf(out, "%zu entities, %d repeats\n", count, repeats);
+
+	double start = benchNow();
+	for (int r = 0; r < repeats; r++) {
+		for (size_t e = 0; e < count; e += 16)
+			store.flags[e] |= ENTITY_DIRTY;
+		updateWorldTransforms(store);
+	}
+	printEntityResult(out, "update, every root moved", benchNow() - start, repeats, count);
+
+	start = benchNow();
+	for (int r = 0; r < repeats; r++) {
+		for (size_t e = 0; e < count; e += 16 * 100)
+			rotateEntity(store, (Entity)e, .01f, glm::vec3(0.f, 1.f, 0.f));
+		updateWorldTransforms(store);
+	}
+	printEntityResult(out, "update, 1% of roots moved", benchNow() - start, repeats, count);
+
+	start = benchNow();
+	for (int r = 0; r < repeats; r++)
+		updateWorldTransforms(store);
+	printEntityResult(out, "update, nothing moved", benchNow() - start, repeats, count);
+
+	glm::mat4 viewProjection = glm::perspective(glm::radians(45.f), 16.f / 9.f, .01f, 100.f) *
+		glm::lookAt(glm::vec3(0.f), glm::vec3(0.f, 0.f, -1.f), glm::vec3(0.f, 1.f, 0.f));
+	size_t visible = 0;
+	start = benchNow();
+	for (int r = 0; r < repeats; r++)
+		visible = cullEntities(store, viewProjection);
+	printEntityResult(out, "frustum cull", benchNow() - start, repeats, count);
+	fprintf(out, "  %zu of %zu visible\n", visible, count);
+}
+
+void runEntityBenchmark(FILE* out, size_t count) {
+	srand(1);
+	benchmarkEntityCount(out, count / 4, 20);
+	benchmarkEntityCount(out, count / 2, 20);
+	benchmarkEntityCount(out, count, 20);
+}
@@ -3,6 +3,8 @@
 #include <iostream>
 #include <stdio.h>
 
+#include "platform.h"
+
 char* read_file(const char* filename)
 {
 	FILE* f;
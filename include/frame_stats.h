@@ -0,0 +1,302 @@
+#pragma once
+
+#include <algorithm>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+#include "platform.h"
+#include "profiler.h"
+
+// Log-linear histogram in microseconds, 256 sub-buckets per power of two keeps every value within 1%
+#define HISTOGRAM_SUB_BUCKET_BITS 8
+#define HISTOGRAM_MAX_US (60ull * 1000000ull)
+
+size_t histogramIndex(uint64_t us) {
+	const uint64_t subBuckets = 1ull << HISTOGRAM_SUB_BUCKET_BITS;
+	if (us < subBuckets)
+		return (size_t)us;
+
+	int msb = 0;
+	while ((us >> (msb + 1)) != 0)
+		msb++;
+
+	// Above the first bucket only the upper half of each bucket's sub-buckets is reachable
+	int shift = msb - HISTOGRAM_SUB_BUCKET_BITS + 1;
+	return (size_t)(subBuckets + (shift - 1) * (subBuckets / 2) + ((us >> shift) - subBuckets / 2));
+}
+
+// Largest value that lands in the same bucket
+uint64_t histogramUpperBound(size_t index) {
+	const uint64_t subBuckets = 1ull << HISTOGRAM_SUB_BUCKET_BITS;
+	if (index < subBuckets)
+		return index;
+
+	size_t k = index - (size_t)subBuckets;
+	int shift = (int)(k / (subBuckets / 2)) + 1;
+	uint64_t mantissa = k % (subBuckets / 2) + subBuckets / 2;
+	return ((mantissa + 1) << shift) - 1;
+}
+
+struct HdrHistogram {
+	std::vector<uint32_t> counts;
+	uint64_t total = 0;
+	uint64_t maxValue = 0;
+
+	HdrHistogram() : counts(histogramIndex(HISTOGRAM_MAX_US) + 1, 0) {}
+};
+
+void recordHistogram(HdrHistogram& histogram, double ms) {
+	uint64_t us = (uint64_t)std::max(0.0, ms * 1000.0);
+	us = std::min(us, (uint64_t)HISTOGRAM_MAX_US);
+	histogram.counts[histogramIndex(us)]++;
+	histogram.total++;
+	histogram.maxValue = std::max(histogram.maxValue, us);
+}
+
+void resetHistogram(HdrHistogram& histogram) {
+	std::fill(histogram.counts.begin(), histogram.counts.end(), 0);
+	histogram.total = 0;
+	histogram.maxValue = 0;
+}
+
+// In ms, percentile between 0 and 100
+double histogramPercentile(const HdrHistogram& histogram, double percentile) {
+	if (histogram.total == 0)
+		return 0.0;
+
+	uint64_t target = std::max((uint64_t)1, (uint64_t)ceil(percentile / 100.0 * histogram.total));
+	uint64_t seen = 0;
+	for (size_t i = 0; i < histogram.counts.size(); i++) {
+		seen += histogram.counts[i];
+		if (seen >= target)
+			return std::min(histogramUpperBound(i), histogram.maxValue) / 1000.0;
+	}
+	return histogram.maxValue / 1000.0;
+}
+
+// Whole run and the window since the last periodic report
+struct FrameMetric {
+	const char* name;
+	HdrHistogram run;
+	HdrHistogram window;
+};
+
+struct Hitch {
+	unsigned int frame;
+	double cpuMs;
+	double presentMs;
+	// Filled in PROFILER_GPU_RING frames later, if the frame's timestamps are read back at all
+	double gpuMs = 0.0;
+	bool gpuValid = false;
+	// Longest main thread scopes of the frame at any depth
+	std::string hotScopes;
+	// Longest outermost GPU scopes of the frame
+	std::string gpuScopes;
+};
+
+struct FrameStats {
+	double hitchThresholdMs;
+	double reportIntervalMs;
+	double lastReportMs = 0.0;
+
+	FrameMetric cpu, gpu, present;
+	double lastPresentMs = -1.0;
+	double presentIntervalMs = 0.0;
+	// Per profiler frame, so a hitch found once GPU times arrive can still report it
+	std::vector<double> presentIntervals;
+
+	// GPU times arrive PROFILER_GPU_RING frames late, this is the next profiler frame to take one from
+	size_t gpuCursor = 0;
+
+	unsigned int windowHitches = 0;
+	// In frame order, GPU hitches are inserted behind CPU ones of later frames
+	std::vector<Hitch> hitches;
+};
+
+FrameStats setup_frame_stats(double hitchThresholdMs, double reportIntervalSeconds) {
+	FrameStats stats;
+	stats.hitchThresholdMs = hitchThresholdMs;
+	stats.reportIntervalMs = reportIntervalSeconds * 1000.0;
+	stats.lastReportMs = profilerNow();
+	stats.cpu.name = "cpu";
+	stats.gpu.name = "gpu";
+	stats.present.name = "present";
+	return stats;
+}
+
+void recordMetric(FrameMetric& metric, double ms) {
+	recordHistogram(metric.run, ms);
+	recordHistogram(metric.window, ms);
+}
+
+// Call right after the buffer swap
+void recordPresent(FrameStats& stats) {
+	double now = profilerNow();
+	if (stats.lastPresentMs >= 0.0) {
+		stats.presentIntervalMs = now - stats.lastPresentMs;
+		recordMetric(stats.present, stats.presentIntervalMs);
+	}
+	stats.lastPresentMs = now;
+}
+
+// The count longest scopes, longest first
+std::string formatScopes(std::vector<std::pair<double, std::string>>& scopes, size_t count) {
+	std::sort(scopes.rbegin(), scopes.rend());
+
+	std::string result;
+	char entry[128];
+	for (size_t i = 0; i < scopes.size() && i < count; i++) {
+		snprintf(entry, sizeof(entry), "%s%s %.2f ms", i > 0 ? ", " : "", scopes[i].second.c_str(), scopes[i].first);
+		result += entry;
+	}
+	return result;
+}
+
+std::string hotScopes(const ProfileFrame& record, size_t count) {
+	std::vector<std::pair<double, std::string>> scopes;
+	{
+		std::lock_guard<std::mutex> guard(profiler.lock);
+		for (size_t i = record.firstEvent; i < profiler.events.size(); i++) {
+			const ProfileEvent& event = profiler.events[i];
+			if (event.track == PROFILER_MAIN_TRACK && event.frame == record.frame && event.depth > 0)
+				scopes.push_back(std::make_pair(event.durationMs, event.name));
+		}
+	}
+	return formatScopes(scopes, count);
+}
+
+std::string gpuHotScopes(const ProfileFrame& record, size_t count) {
+	std::vector<std::pair<double, std::string>> scopes;
+	for (const auto& scope : record.gpuScopes)
+		scopes.push_back(std::make_pair(scope.second, scope.first));
+	return formatScopes(scopes, count);
+}
+
+Hitch* findHitch(FrameStats& stats, unsigned int frame) {
+	for (auto it = stats.hitches.rbegin(); it != stats.hitches.rend() && it->frame >= frame; ++it) {
+		if (it->frame == frame)
+			return &*it;
+	}
+	return NULL;
+}
+
+// Returns the frame's hitch, adding it in frame order the first time any of its timings is over
+Hitch& addHitch(FrameStats& stats, const ProfileFrame& record) {
+	Hitch* found = findHitch(stats, record.frame);
+	if (found != NULL)
+		return *found;
+
+	Hitch hitch;
+	hitch.frame = record.frame;
+	hitch.cpuMs = record.cpuMs;
+	hitch.presentMs = record.frame < stats.presentIntervals.size() ? stats.presentIntervals[record.frame] : 0.0;
+	hitch.hotScopes = hotScopes(record, 3);
+	stats.windowHitches++;
+
+	auto position = std::upper_bound(stats.hitches.begin(), stats.hitches.end(), record.frame,
+		[](unsigned int frame, const Hitch& other) { return frame < other.frame; });
+	return *stats.hitches.insert(position, hitch);
+}
+
+void printMetric(const char* label, const HdrHistogram& histogram, FILE* out) {
+	fprintf(out, "  %-8s p50 %7.2f  p95 %7.2f  p99 %7.2f  max %7.2f ms  (%llu samples)\n", label,
+		histogramPercentile(histogram, 50.0), histogramPercentile(histogram, 95.0), histogramPercentile(histogram, 99.0),
+		histogram.maxValue / 1000.0, (unsigned long long)histogram.total);
+}
+
+// Takes GPU times whose queries have been read back, all of them once finishProfiler has run
+// A slow GPU frame is a hitch of the frame it belongs to, not the one its timestamps arrived in
+void collectGpuFrameTimes(FrameStats& stats, bool all) {
+	size_t ready = all ? profiler.frames.size() : (profiler.frames.size() > PROFILER_GPU_RING ? profiler.frames.size() - PROFILER_GPU_RING : 0);
+	for (; stats.gpuCursor < ready; stats.gpuCursor++) {
+		const ProfileFrame& record = profiler.frames[stats.gpuCursor];
+		if (!record.gpuValid)
+			continue;
+		recordMetric(stats.gpu, record.gpuMs);
+
+		Hitch* hitch = findHitch(stats, record.frame);
+		if (hitch == NULL && record.gpuMs > stats.hitchThresholdMs)
+			hitch = &addHitch(stats, record);
+		if (hitch != NULL) {
+			hitch->gpuMs = record.gpuMs;
+			hitch->gpuValid = true;
+			hitch->gpuScopes = gpuHotScopes(record, 3);
+		}
+	}
+}
+
+// Call after endProfilerFrame, prints the window's stats every report interval
+void recordFrameStats(FrameStats& stats, FILE* out) {
+	if (profiler.frames.empty())
+		return;
+
+	const ProfileFrame& record = profiler.frames.back();
+	recordMetric(stats.cpu, record.cpuMs);
+	stats.presentIntervals.resize(record.frame + 1, 0.0);
+	stats.presentIntervals[record.frame] = stats.presentIntervalMs;
+
+	if (record.cpuMs > stats.hitchThresholdMs || stats.presentIntervalMs > stats.hitchThresholdMs)
+		addHitch(stats, record);
+	collectGpuFrameTimes(stats, false);
+
+	double now = profilerNow();
+	if (out == NULL || now - stats.lastReportMs < stats.reportIntervalMs)
+		return;
+
+	fprintf(out, "Frame stats, last %.1f s, %u hitches over %.1f ms\n", (now - stats.lastReportMs) / 1000.0,
+		stats.windowHitches, stats.hitchThresholdMs);
+	printMetric(stats.cpu.name, stats.cpu.window, out);
+	printMetric(stats.gpu.name, stats.gpu.window, out);
+	printMetric(stats.present.name, stats.present.window, out);
+	if (stats.windowHitches > 0) {
+		const Hitch& last = stats.hitches.back();
+		fprintf(out, "  last hitch, frame %u: %s", last.frame, last.hotScopes.c_str());
+		if (last.gpuValid)
+			fprintf(out, ", gpu %s", last.gpuScopes.c_str());
+		fprintf(out, "\n");
+	}
+
+	resetHistogram(stats.cpu.window);
+	resetHistogram(stats.gpu.window);
+	resetHistogram(stats.present.window);
+	stats.windowHitches = 0;
+	stats.lastReportMs = now;
+}
+
+// Whole run percentiles and every hitch, call after finishProfiler
+void dumpFrameStats(FrameStats& stats, const char* filename) {
+	collectGpuFrameTimes(stats, true);
+
+	FILE* f;
+	fopen_s(&f, filename, "w");
+	if (f == NULL) {
+		fprintf(stderr, "Could not write %s\n", filename);
+		return;
+	}
+
+	fprintf(f, "Frame stats over %llu frames\n", (unsigned long long)stats.cpu.run.total);
+	printMetric(stats.cpu.name, stats.cpu.run, f);
+	printMetric(stats.gpu.name, stats.gpu.run, f);
+	printMetric(stats.present.name, stats.present.run, f);
+
+	fprintf(f, "\n%zu hitches over %.1f ms\n", stats.hitches.size(), stats.hitchThresholdMs);
+	for (const auto& hitch : stats.hitches) {
+		if (hitch.gpuValid)
+			fprintf(f, "frame %u: cpu %.2f ms, gpu %.2f ms, present %.2f ms\n", hitch.frame, hitch.cpuMs, hitch.gpuMs, hitch.presentMs);
+		else
+			fprintf(f, "frame %u: cpu %.2f ms, present %.2f ms\n", hitch.frame, hitch.cpuMs, hitch.presentMs);
+		fprintf(f, "  cpu scopes: %s\n", hitch.hotScopes.c_str());
+		if (hitch.gpuValid)
+			fprintf(f, "  gpu scopes: %s\n", hitch.gpuScopes.c_str());
+	}
+	fclose(f);
+
+	printf("Wrote frame stats to %s\n", filename);
+	printMetric(stats.cpu.name, stats.cpu.run, stdout);
+	printMetric(stats.gpu.name, stats.gpu.run, stdout);
+	printMetric(stats.present.name, stats.present.run, stdout);
+	printf("  %zu hitches\n", stats.hitches.size());
+}
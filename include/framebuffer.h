@@ -0,0 +1,80 @@
+#pragma once
+
+#include <GL/gl3w.h>
+
+#include <stdio.h>
+
+#include "gpu_resource.h"
+#include "memory_stats.h"
+
+// Offscreen multisampled target the scene is rendered into, so later passes can share its depth
+struct SceneStruct
+{
+	GpuFramebuffer FBO;
+	GpuRenderbuffer Colour;
+	GpuTexture Depth;
+	int width, height, samples;
+};
+
+// Single sampled colour target that stands in for the window in headless runs
+struct OffscreenTarget
+{
+	GpuFramebuffer FBO;
+	GpuRenderbuffer Colour;
+};
+
+SceneStruct setup_scene(int w, int h, int samples)
+{
+	SceneStruct scene;
+	scene.width = w;
+	scene.height = h;
+	scene.samples = samples;
+
+	scene.Colour = createRenderbuffer();
+	glBindRenderbuffer(GL_RENDERBUFFER, scene.Colour);
+	trackedRenderbufferStorage(scene.Colour, samples, GL_RGBA8, w, h, MEMORY_RENDER_TARGETS, "scene colour");
+	glBindRenderbuffer(GL_RENDERBUFFER, 0);
+
+	// A texture rather than a renderbuffer so the deferred lighting pass can read it
+	scene.Depth = createTexture();
+	glBindTexture(GL_TEXTURE_2D_MULTISAMPLE, scene.Depth);
+	trackedTexImage2DMultisample(scene.Depth, samples, GL_DEPTH_COMPONENT32F, w, h, MEMORY_RENDER_TARGETS, "scene depth");
+	glBindTexture(GL_TEXTURE_2D_MULTISAMPLE, 0);
+
+	scene.FBO = createFramebuffer();
+	glBindFramebuffer(GL_FRAMEBUFFER, scene.FBO);
+	glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, scene.Colour);
+	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D_MULTISAMPLE, scene.Depth, 0);
+	if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+		fprintf(stderr, "Scene framebuffer incomplete\n");
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+	return scene;
+}
+
+OffscreenTarget setup_offscreen_target(int w, int h)
+{
+	OffscreenTarget target;
+	target.Colour = createRenderbuffer();
+	glBindRenderbuffer(GL_RENDERBUFFER, target.Colour);
+	trackedRenderbufferStorage(target.Colour, 0, GL_RGBA8, w, h, MEMORY_RENDER_TARGETS, "offscreen colour");
+	glBindRenderbuffer(GL_RENDERBUFFER, 0);
+
+	target.FBO = createFramebuffer();
+	glBindFramebuffer(GL_FRAMEBUFFER, target.FBO);
+	glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, target.Colour);
+	if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+		fprintf(stderr, "Offscreen framebuffer incomplete\n");
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+	return target;
+}
+
+// Resolves the multisampled scene into the given framebuffer
+void presentScene(const SceneStruct& scene, unsigned int targetFBO)
+{
+	glBindFramebuffer(GL_READ_FRAMEBUFFER, scene.FBO);
+	glBindFramebuffer(GL_DRAW_FRAMEBUFFER, targetFBO);
+	glBlitFramebuffer(0, 0, scene.width, scene.height, 0, 0, scene.width, scene.height, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+}
@@ -0,0 +1,115 @@
+#pragma once
+
+#include <GL/gl3w.h>
+
+#include <stdio.h>
+
+#include "framebuffer.h"
+#include "gpu_resource.h"
+#include "memory_stats.h"
+
+// Texture units the deferred lighting pass reads the G-buffer from, unit 1 stays the shadow map
+#define GBUFFER_ALBEDO_UNIT 4
+#define GBUFFER_NORMAL_UNIT 5
+#define GBUFFER_MATERIAL_UNIT 6
+#define GBUFFER_DEPTH_UNIT 7
+
+// Compact G-buffer for deferred shading, 7 bytes per sample plus the scene's depth
+// Albedo and alpha in RGBA8, an octahedral normal in RG16 snorm and the specular exponent in R8
+struct GBufferStruct
+{
+	GpuFramebuffer FBO;
+	GpuTexture AlbedoAlpha;
+	GpuTexture Normal;
+	GpuTexture Material;
+	// Scene colour without the depth attachment, so the lighting pass can sample depth without a feedback loop
+	GpuFramebuffer LightFBO;
+	GpuVertexArray VAO;
+};
+
+GpuTexture gbufferTarget(const SceneStruct& scene, GLenum format, const char* name)
+{
+	GpuTexture texture = createTexture();
+	glBindTexture(GL_TEXTURE_2D_MULTISAMPLE, texture);
+	trackedTexImage2DMultisample(texture, scene.samples, format, scene.width, scene.height, MEMORY_RENDER_TARGETS, name);
+	glBindTexture(GL_TEXTURE_2D_MULTISAMPLE, 0);
+	return texture;
+}
+
+GBufferStruct setup_gbuffer(const SceneStruct& scene)
+{
+	GBufferStruct gbuffer;
+	gbuffer.AlbedoAlpha = gbufferTarget(scene, GL_RGBA8, "G-buffer albedo");
+	gbuffer.Normal = gbufferTarget(scene, GL_RG16_SNORM, "G-buffer normal");
+	gbuffer.Material = gbufferTarget(scene, GL_R8, "G-buffer material");
+
+	gbuffer.FBO = createFramebuffer();
+	glBindFramebuffer(GL_FRAMEBUFFER, gbuffer.FBO);
+	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D_MULTISAMPLE, gbuffer.AlbedoAlpha, 0);
+	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1, GL_TEXTURE_2D_MULTISAMPLE, gbuffer.Normal, 0);
+	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT2, GL_TEXTURE_2D_MULTISAMPLE, gbuffer.Material, 0);
+	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D_MULTISAMPLE, scene.Depth, 0);
+	GLenum buffers[] = { GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1, GL_COLOR_ATTACHMENT2 };
+	glDrawBuffers(3, buffers);
+	if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+		fprintf(stderr, "G-buffer framebuffer incomplete\n");
+
+	gbuffer.LightFBO = createFramebuffer();
+	glBindFramebuffer(GL_FRAMEBUFFER, gbuffer.LightFBO);
+	glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, scene.Colour);
+	if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+		fprintf(stderr, "Deferred lighting framebuffer incomplete\n");
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+	printf("G-buffer: %.1f MB at %dx%d, %d samples\n",
+		7.0 * scene.width * scene.height * scene.samples / (1024.0 * 1024.0), scene.width, scene.height, scene.samples);
+
+	gbuffer.VAO = createVertexArray();
+
+	return gbuffer;
+}
+
+// Opaque geometry is drawn into the G-buffer after this, depth was already cleared with the scene
+void beginGBuffer(const GBufferStruct& gbuffer)
+{
+	static const GLfloat zero[] = { 0.f, 0.f, 0.f, 0.f };
+
+	glBindFramebuffer(GL_FRAMEBUFFER, gbuffer.FBO);
+	glClearBufferfv(GL_COLOR, 0, zero);
+	glClearBufferfv(GL_COLOR, 1, zero);
+	glClearBufferfv(GL_COLOR, 2, zero);
+}
+
+// Shades every covered pixel once into the scene, and edge pixels once per sample, background pixels keep the clear colour
+// Edge pixels come out with their covered fraction as alpha, blended over the clear colour
+// Leaves the scene framebuffer bound for the forward transparent pass
+void deferredLighting(const GBufferStruct& gbuffer, const SceneStruct& scene, unsigned int lightingProgram)
+{
+	glBindFramebuffer(GL_FRAMEBUFFER, gbuffer.LightFBO);
+	glDisable(GL_DEPTH_TEST);
+	glEnable(GL_BLEND);
+	glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+
+	glUseProgram(lightingProgram);
+	glActiveTexture(GL_TEXTURE0 + GBUFFER_ALBEDO_UNIT);
+	glBindTexture(GL_TEXTURE_2D_MULTISAMPLE, gbuffer.AlbedoAlpha);
+	glUniform1i(glGetUniformLocation(lightingProgram, "albedoAlphaTexture"), GBUFFER_ALBEDO_UNIT);
+	glActiveTexture(GL_TEXTURE0 + GBUFFER_NORMAL_UNIT);
+	glBindTexture(GL_TEXTURE_2D_MULTISAMPLE, gbuffer.Normal);
+	glUniform1i(glGetUniformLocation(lightingProgram, "normalTexture"), GBUFFER_NORMAL_UNIT);
+	glActiveTexture(GL_TEXTURE0 + GBUFFER_MATERIAL_UNIT);
+	glBindTexture(GL_TEXTURE_2D_MULTISAMPLE, gbuffer.Material);
+	glUniform1i(glGetUniformLocation(lightingProgram, "materialTexture"), GBUFFER_MATERIAL_UNIT);
+	glActiveTexture(GL_TEXTURE0 + GBUFFER_DEPTH_UNIT);
+	glBindTexture(GL_TEXTURE_2D_MULTISAMPLE, scene.Depth);
+	glUniform1i(glGetUniformLocation(lightingProgram, "depthTexture"), GBUFFER_DEPTH_UNIT);
+
+	glBindVertexArray(gbuffer.VAO);
+	glDrawArrays(GL_TRIANGLES, 0, 3);
+	glBindVertexArray(0);
+
+	glActiveTexture(GL_TEXTURE0);
+	glDisable(GL_BLEND);
+	glEnable(GL_DEPTH_TEST);
+	glBindFramebuffer(GL_FRAMEBUFFER, scene.FBO);
+}
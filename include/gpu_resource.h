@@ -0,0 +1,198 @@
+#pragma once
+
+#include <GL/gl3w.h>
+
+#include <deque>
+#include <stdio.h>
+#include <utility>
+#include <vector>
+
+#include "memory_stats.h"
+
+enum GpuResourceKind { GPU_BUFFER, GPU_VERTEX_ARRAY, GPU_TEXTURE, GPU_PROGRAM, GPU_RENDERBUFFER, GPU_FRAMEBUFFER, GPU_QUERY };
+
+typedef std::vector<std::pair<GpuResourceKind, GLuint>> GpuNameList;
+
+// Names released during one frame, deleted once the fence inserted after that frame has signalled
+struct GpuDeletionBatch {
+	GLsync fence;
+	GpuNameList names;
+};
+
+// Handles never delete straight away, draws already submitted may still read what they name
+struct GpuDeletionQueue {
+	// Released since the last fence
+	GpuNameList pending;
+	std::deque<GpuDeletionBatch> fenced;
+	size_t deleted = 0;
+};
+
+GpuDeletionQueue gpuDeletions;
+
+void queueGpuDeletion(GpuResourceKind kind, GLuint name)
+{
+	gpuDeletions.pending.push_back(std::make_pair(kind, name));
+}
+
+void deleteGpuNames(const GpuNameList& names)
+{
+	for (const auto& entry : names) {
+		GLuint name = entry.second;
+		switch (entry.first) {
+		case GPU_BUFFER: glDeleteBuffers(1, &name); untrackGpuObject(GL_BUFFER, name); break;
+		case GPU_VERTEX_ARRAY: glDeleteVertexArrays(1, &name); break;
+		case GPU_TEXTURE: glDeleteTextures(1, &name); untrackGpuObject(GL_TEXTURE, name); break;
+		case GPU_PROGRAM: glDeleteProgram(name); break;
+		case GPU_RENDERBUFFER: glDeleteRenderbuffers(1, &name); untrackGpuObject(GL_RENDERBUFFER, name); break;
+		case GPU_FRAMEBUFFER: glDeleteFramebuffers(1, &name); break;
+		case GPU_QUERY: glDeleteQueries(1, &name); break;
+		}
+	}
+	gpuDeletions.deleted += names.size();
+}
+
+// Once per frame after its commands are submitted, deletes what earlier frames released and fences this one's
+void endGpuResourceFrame()
+{
+	// Fences signal in submission order, so the first unfinished batch ends the scan
+	while (!gpuDeletions.fenced.empty()) {
+		GpuDeletionBatch& batch = gpuDeletions.fenced.front();
+		GLenum status = glClientWaitSync(batch.fence, 0, 0);
+		if (status != GL_ALREADY_SIGNALED && status != GL_CONDITION_SATISFIED)
+			break;
+
+		glDeleteSync(batch.fence);
+		deleteGpuNames(batch.names);
+		gpuDeletions.fenced.pop_front();
+	}
+
+	if (gpuDeletions.pending.empty())
+		return;
+
+	GpuDeletionBatch batch;
+	batch.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	batch.names.swap(gpuDeletions.pending);
+	gpuDeletions.fenced.push_back(batch);
+}
+
+// Waits for the GPU and deletes everything queued, while the context is still current at shutdown
+void flushGpuDeletions()
+{
+	glFinish();
+	for (auto& batch : gpuDeletions.fenced) {
+		glDeleteSync(batch.fence);
+		deleteGpuNames(batch.names);
+	}
+	gpuDeletions.fenced.clear();
+	deleteGpuNames(gpuDeletions.pending);
+	gpuDeletions.pending.clear();
+}
+
+// Owns one GL name, moving hands it over and destruction queues it for deletion
+// Converts to GLuint so it passes straight to GL calls
+template <GpuResourceKind Kind>
+class GpuHandle {
+private:
+	GLuint name = 0;
+
+public:
+	GpuHandle() {}
+	explicit GpuHandle(GLuint name) : name(name) {}
+
+	GpuHandle(const GpuHandle&) = delete;
+	GpuHandle& operator=(const GpuHandle&) = delete;
+
+	GpuHandle(GpuHandle&& other) noexcept : name(other.release()) {}
+	GpuHandle& operator=(GpuHandle&& other) noexcept {
+		if (this != &other)
+			reset(other.release());
+		return *this;
+	}
+
+	~GpuHandle() {
+		reset();
+	}
+
+	GLuint get() const { return name; }
+	operator GLuint() const { return name; }
+
+	// Gives up ownership without deleting
+	GLuint release() {
+		GLuint released = name;
+		name = 0;
+		return released;
+	}
+
+	void reset(GLuint replacement = 0) {
+		if (name != 0)
+			queueGpuDeletion(Kind, name);
+		name = replacement;
+	}
+};
+
+typedef GpuHandle<GPU_BUFFER> GpuBuffer;
+typedef GpuHandle<GPU_VERTEX_ARRAY> GpuVertexArray;
+typedef GpuHandle<GPU_TEXTURE> GpuTexture;
+typedef GpuHandle<GPU_PROGRAM> GpuProgram;
+typedef GpuHandle<GPU_RENDERBUFFER> GpuRenderbuffer;
+typedef GpuHandle<GPU_FRAMEBUFFER> GpuFramebuffer;
+typedef GpuHandle<GPU_QUERY> GpuQuery;
+
+GpuBuffer createBuffer()
+{
+	GLuint name;
+	glCreateBuffers(1, &name);
+	return GpuBuffer(name);
+}
+
+// Generated rather than created, setup binds it to fill in the attributes
+GpuVertexArray createVertexArray()
+{
+	GLuint name;
+	glGenVertexArrays(1, &name);
+	return GpuVertexArray(name);
+}
+
+// Created, for setups that fill in the attributes with direct state access instead
+GpuVertexArray createNamedVertexArray()
+{
+	GLuint name;
+	glCreateVertexArrays(1, &name);
+	return GpuVertexArray(name);
+}
+
+GpuTexture createTexture()
+{
+	GLuint name;
+	glGenTextures(1, &name);
+	return GpuTexture(name);
+}
+
+GpuRenderbuffer createRenderbuffer()
+{
+	GLuint name;
+	glGenRenderbuffers(1, &name);
+	return GpuRenderbuffer(name);
+}
+
+GpuFramebuffer createFramebuffer()
+{
+	GLuint name;
+	glGenFramebuffers(1, &name);
+	return GpuFramebuffer(name);
+}
+
+GpuQuery createQuery()
+{
+	GLuint name;
+	glGenQueries(1, &name);
+	return GpuQuery(name);
+}
+
+void printGpuResourceStats(FILE* out)
+{
+	size_t waiting = gpuDeletions.pending.size();
+	for (const auto& batch : gpuDeletions.fenced)
+		waiting += batch.names.size();
+	fprintf(out, "GPU resources: %zu names deleted after their fences, %zu still waiting\n", gpuDeletions.deleted, waiting);
+}
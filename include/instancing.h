@@ -0,0 +1,124 @@
+#pragma once
+
+#include <GL/gl3w.h>
+#include <glm/glm.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+#include <glm/gtc/type_ptr.hpp>
+
+#include <algorithm>
+#include <math.h>
+#include <stdio.h>
+#include <vector>
+
+#include "gpu_resource.h"
+#include "memory_stats.h"
+#include "model.h"
+
+// Shader storage binding point, must match the INSTANCED path of phong.vert, prepass.vert and shadow.vert
+#define INSTANCE_BINDING 9
+
+// std430 layout, one per placement, 144 bytes
+struct InstanceData {
+	glm::mat4 model;
+	// mat3 columns are padded to vec4 in std430, so a mat4 is stored
+	glm::mat4 normalMatrix;
+	// Multiplies the vertex colour
+	glm::vec4 tint;
+};
+
+// Many placements of one mesh, the mesh's vertices and buffers are shared and never copied
+// Only the instance buffer grows with the number of placements
+struct InstancedModel {
+	model* mesh;
+	std::vector<InstanceData> instances;
+	GpuBuffer instanceBuffer;
+	bool dirty;
+};
+
+// Re-uploads only after a transform changed
+void uploadInstances(InstancedModel& instanced)
+{
+	if (!instanced.dirty)
+		return;
+	glNamedBufferSubData(instanced.instanceBuffer, 0, instanced.instances.size() * sizeof(InstanceData), instanced.instances.data());
+	instanced.dirty = false;
+}
+
+InstancedModel setup_instanced_model(model* mesh, const std::vector<glm::mat4>& transforms, const std::vector<glm::vec4>& tints)
+{
+	InstancedModel instanced;
+	instanced.mesh = mesh;
+	for (size_t i = 0; i < transforms.size(); i++) {
+		InstanceData instance;
+		instance.model = transforms[i];
+		instance.normalMatrix = glm::mat4(glm::transpose(glm::inverse(glm::mat3(transforms[i]))));
+		instance.tint = i < tints.size() ? tints[i] : glm::vec4(1.f);
+		instanced.instances.push_back(instance);
+	}
+
+	// Storage can't be empty, an unused slot keeps zero instances valid
+	instanced.instanceBuffer = createBuffer();
+	trackedBufferStorage(instanced.instanceBuffer, std::max(instanced.instances.size(), (size_t)1) * sizeof(InstanceData),
+		NULL, GL_DYNAMIC_STORAGE_BIT, MEMORY_SCENE_BUFFERS, "instances");
+	instanced.dirty = true;
+	uploadInstances(instanced);
+
+	printf("Instanced model: %zu instances, %zu bytes of instance data\n",
+		instanced.instances.size(), instanced.instances.size() * sizeof(InstanceData));
+	return instanced;
+}
+
+void setInstanceTransform(InstancedModel& instanced, size_t index, glm::mat4 transform)
+{
+	instanced.instances[index].model = transform;
+	instanced.instances[index].normalMatrix = glm::mat4(glm::transpose(glm::inverse(glm::mat3(transform))));
+	instanced.dirty = true;
+}
+
+// Matrices the instanced shaders multiply with each instance's model matrix
+void setInstanceUniforms(unsigned int program, GLsizei objectCount)
+{
+	glUseProgram(program);
+	glUniform1i(glGetUniformLocation(program, "objectCount"), objectCount);
+	glUniformMatrix4fv(glGetUniformLocation(program, "viewProjection"), 1, GL_FALSE, glm::value_ptr(passMatrices.viewProjection));
+	glUniformMatrix4fv(glGetUniformLocation(program, "lightSpace"), 1, GL_FALSE, glm::value_ptr(passMatrices.lightSpace));
+}
+
+// Every instance in one draw per material batch
+void drawInstancedLayer(InstancedModel& instanced, MaterialPrograms programs, bool transparent_layer)
+{
+	if (instanced.instances.empty() || (transparent_layer && !instanced.mesh->hasTransparency()))
+		return;
+
+	uploadInstances(instanced);
+	setInstanceUniforms(programs.textured, (GLsizei)instanced.instances.size());
+	setInstanceUniforms(programs.untextured, (GLsizei)instanced.instances.size());
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, INSTANCE_BINDING, instanced.instanceBuffer);
+	instanced.mesh->drawLayer(programs, transparent_layer, (GLsizei)instanced.instances.size());
+}
+
+// Every instance from the indexed position stream in one draw
+void drawInstancedDepth(InstancedModel& instanced, unsigned int program, bool opaqueOnly = false)
+{
+	if (instanced.instances.empty())
+		return;
+
+	uploadInstances(instanced);
+	setInstanceUniforms(program, (GLsizei)instanced.instances.size());
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, INSTANCE_BINDING, instanced.instanceBuffer);
+	instanced.mesh->drawDepth(program, opaqueOnly, (GLsizei)instanced.instances.size());
+}
+
+// Rows of placements facing +z, count of them in a near square grid centred on front
+std::vector<glm::mat4> makeInstanceGrid(int count, glm::vec3 front, float spacingX, float spacingZ, float yaw)
+{
+	std::vector<glm::mat4> transforms;
+	int columns = (int)ceilf(sqrtf((float)count));
+	for (int i = 0; i < count; i++) {
+		int row = i / columns;
+		int column = i % columns;
+		glm::vec3 position = front + glm::vec3((column - (columns - 1) * .5f) * spacingX, 0.f, -row * spacingZ);
+		transforms.push_back(glm::rotate(glm::translate(glm::mat4(1.f), position), yaw, glm::vec3(0.f, 1.f, 0.f)));
+	}
+	return transforms;
+}
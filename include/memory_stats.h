@@ -0,0 +1,274 @@
+#pragma once
+
+#include <GL/gl3w.h>
+
+#include <algorithm>
+#include <map>
+#include <stdio.h>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Categories totals are grouped by, each asset is named by the caller
+#define MEMORY_GEOMETRY "geometry"
+#define MEMORY_TEXTURES "textures"
+#define MEMORY_RENDER_TARGETS "render targets"
+#define MEMORY_SHADOW_MAP "shadow map"
+#define MEMORY_SCENE_BUFFERS "scene buffers"
+#define MEMORY_LOADERS "loaders"
+#define MEMORY_READBACK "readback"
+
+// Bytes one (category, asset) pair holds on the CPU or GPU, and the most it ever held
+struct MemoryEntry {
+	std::string category;
+	std::string asset;
+	bool gpu;
+	size_t bytes = 0;
+	size_t peak = 0;
+};
+
+// One GL object's estimate, kept so deleting the name can give its bytes back
+struct TrackedGpuObject {
+	std::string key;
+	size_t bytes;
+	GLenum internalFormat;
+	GLsizei width, height;
+};
+
+struct MemoryTracker {
+	// Keyed "gpu|category|asset" so a dump comes out grouped
+	std::map<std::string, MemoryEntry> entries;
+	// Keyed by (GL_BUFFER / GL_TEXTURE / GL_RENDERBUFFER, name)
+	std::map<std::pair<GLenum, GLuint>, TrackedGpuObject> gpuObjects;
+	// 0 for no budget, crossing one is remembered for the rest of the run
+	size_t gpuBudget = 0;
+	size_t cpuBudget = 0;
+	bool gpuOverBudget = false;
+	bool cpuOverBudget = false;
+};
+
+MemoryTracker memoryTracker;
+
+std::string memoryKey(bool gpu, const std::string& category, const std::string& asset)
+{
+	return std::string(gpu ? "gpu|" : "cpu|") + category + "|" + asset;
+}
+
+void addTrackedBytes(const std::string& key, bool gpu, const std::string& category, const std::string& asset, long long delta)
+{
+	MemoryEntry& entry = memoryTracker.entries[key];
+	if (entry.category.empty()) {
+		entry.category = category;
+		entry.asset = asset;
+		entry.gpu = gpu;
+	}
+	entry.bytes = (size_t)std::max(0ll, (long long)entry.bytes + delta);
+	entry.peak = std::max(entry.peak, entry.bytes);
+}
+
+// Driver padding and alignment are not visible, so these are lower bounds
+size_t bytesPerPixel(GLenum internalFormat)
+{
+	switch (internalFormat) {
+	case GL_R8: return 1;
+	case GL_RG8: case GL_R16F: case GL_DEPTH_COMPONENT16: return 2;
+	// Drivers pad three channel formats to four
+	case GL_RGB: case GL_RGB8: case GL_RGBA: case GL_RGBA8: case GL_RG16_SNORM: case GL_R32F: case GL_R32UI:
+	case GL_DEPTH_COMPONENT: case GL_DEPTH_COMPONENT24: case GL_DEPTH_COMPONENT32F: case GL_DEPTH24_STENCIL8: return 4;
+	case GL_RGBA16F: case GL_RG32F: case GL_DEPTH32F_STENCIL8: return 8;
+	case GL_RGBA32F: return 16;
+	}
+	fprintf(stderr, "Memory stats: unknown internal format 0x%x, counted as 4 bytes a pixel\n", internalFormat);
+	return 4;
+}
+
+// Every level down to 1 x 1, about a third on top of the base level
+size_t mipChainBytes(GLsizei w, GLsizei h, size_t pixelBytes)
+{
+	size_t bytes = 0;
+	while (true) {
+		bytes += (size_t)w * h * pixelBytes;
+		if (w == 1 && h == 1)
+			break;
+		w = std::max(1, w / 2);
+		h = std::max(1, h / 2);
+	}
+	return bytes;
+}
+
+bool checkMemoryBudget(FILE* out);
+
+// Replaces whatever the object was counted as before, textures are re-specified in place
+void trackGpuObject(GLenum kind, GLuint name, const std::string& category, const std::string& asset,
+	size_t bytes, GLenum internalFormat = GL_NONE, GLsizei w = 0, GLsizei h = 0)
+{
+	std::pair<GLenum, GLuint> id(kind, name);
+	auto found = memoryTracker.gpuObjects.find(id);
+	if (found != memoryTracker.gpuObjects.end()) {
+		MemoryEntry& old = memoryTracker.entries[found->second.key];
+		addTrackedBytes(found->second.key, true, old.category, old.asset, -(long long)found->second.bytes);
+	}
+
+	TrackedGpuObject object;
+	object.key = memoryKey(true, category, asset);
+	object.bytes = bytes;
+	object.internalFormat = internalFormat;
+	object.width = w;
+	object.height = h;
+	memoryTracker.gpuObjects[id] = object;
+	addTrackedBytes(object.key, true, category, asset, (long long)bytes);
+	checkMemoryBudget(stderr);
+}
+
+// Called as names are deleted, untracked names are ignored
+void untrackGpuObject(GLenum kind, GLuint name)
+{
+	auto found = memoryTracker.gpuObjects.find(std::make_pair(kind, name));
+	if (found == memoryTracker.gpuObjects.end())
+		return;
+
+	MemoryEntry& entry = memoryTracker.entries[found->second.key];
+	addTrackedBytes(found->second.key, true, entry.category, entry.asset, -(long long)found->second.bytes);
+	memoryTracker.gpuObjects.erase(found);
+}
+
+void trackedBufferStorage(GLuint buffer, GLsizeiptr size, const void* data, GLbitfield flags,
+	const std::string& category, const std::string& asset)
+{
+	glNamedBufferStorage(buffer, size, data, flags);
+	trackGpuObject(GL_BUFFER, buffer, category, asset, (size_t)size);
+}
+
+// The texture must be bound to GL_TEXTURE_2D, levels above 0 add to what level 0 was counted as
+void trackedTexImage2D(GLuint texture, GLint level, GLint internalFormat, GLsizei w, GLsizei h,
+	GLenum format, GLenum type, const void* pixels, const std::string& category, const std::string& asset)
+{
+	glTexImage2D(GL_TEXTURE_2D, level, internalFormat, w, h, 0, format, type, pixels);
+	size_t bytes = (size_t)w * h * bytesPerPixel(internalFormat);
+	if (level > 0) {
+		auto found = memoryTracker.gpuObjects.find(std::make_pair((GLenum)GL_TEXTURE, texture));
+		if (found != memoryTracker.gpuObjects.end()) {
+			TrackedGpuObject base = found->second;
+			trackGpuObject(GL_TEXTURE, texture, category, asset, base.bytes + bytes, base.internalFormat, base.width, base.height);
+			return;
+		}
+	}
+	trackGpuObject(GL_TEXTURE, texture, category, asset, bytes, internalFormat, w, h);
+}
+
+// Grows the bound texture's estimate to the whole chain below its base level
+void trackedGenerateMipmap(GLuint texture)
+{
+	glGenerateMipmap(GL_TEXTURE_2D);
+	auto found = memoryTracker.gpuObjects.find(std::make_pair((GLenum)GL_TEXTURE, texture));
+	if (found == memoryTracker.gpuObjects.end())
+		return;
+
+	TrackedGpuObject object = found->second;
+	MemoryEntry entry = memoryTracker.entries[object.key];
+	trackGpuObject(GL_TEXTURE, texture, entry.category, entry.asset,
+		mipChainBytes(object.width, object.height, bytesPerPixel(object.internalFormat)), object.internalFormat, object.width, object.height);
+}
+
+// Each sample is stored, so a 4x target costs four times a single sampled one
+void trackedTexImage2DMultisample(GLuint texture, GLsizei samples, GLenum internalFormat, GLsizei w, GLsizei h,
+	const std::string& category, const std::string& asset)
+{
+	glTexImage2DMultisample(GL_TEXTURE_2D_MULTISAMPLE, samples, internalFormat, w, h, GL_TRUE);
+	trackGpuObject(GL_TEXTURE, texture, category, asset, (size_t)w * h * std::max(1, samples) * bytesPerPixel(internalFormat), internalFormat, w, h);
+}
+
+// The renderbuffer must be bound, samples 0 for a single sampled one
+void trackedRenderbufferStorage(GLuint renderbuffer, GLsizei samples, GLenum internalFormat, GLsizei w, GLsizei h,
+	const std::string& category, const std::string& asset)
+{
+	if (samples > 0)
+		glRenderbufferStorageMultisample(GL_RENDERBUFFER, samples, internalFormat, w, h);
+	else
+		glRenderbufferStorage(GL_RENDERBUFFER, internalFormat, w, h);
+	trackGpuObject(GL_RENDERBUFFER, renderbuffer, category, asset, (size_t)w * h * std::max(1, samples) * bytesPerPixel(internalFormat), internalFormat, w, h);
+}
+
+// Loader and readback buffers report what they hold now, the entry keeps the peak
+void setCpuMemory(const std::string& category, const std::string& asset, size_t bytes)
+{
+	std::string key = memoryKey(false, category, asset);
+	MemoryEntry& entry = memoryTracker.entries[key];
+	addTrackedBytes(key, false, category, asset, (long long)bytes - (long long)entry.bytes);
+	checkMemoryBudget(stderr);
+}
+
+size_t memoryByCategory(const std::string& category, bool gpu)
+{
+	size_t bytes = 0;
+	for (const auto& entry : memoryTracker.entries)
+		if (entry.second.gpu == gpu && entry.second.category == category)
+			bytes += entry.second.bytes;
+	return bytes;
+}
+
+size_t memoryByAsset(const std::string& asset, bool gpu)
+{
+	size_t bytes = 0;
+	for (const auto& entry : memoryTracker.entries)
+		if (entry.second.gpu == gpu && entry.second.asset == asset)
+			bytes += entry.second.bytes;
+	return bytes;
+}
+
+size_t totalMemory(bool gpu)
+{
+	size_t bytes = 0;
+	for (const auto& entry : memoryTracker.entries)
+		if (entry.second.gpu == gpu)
+			bytes += entry.second.bytes;
+	return bytes;
+}
+
+// Warns the first time a total crosses its budget, not again on every allocation after it
+bool checkMemoryBudget(FILE* out)
+{
+	size_t gpu = totalMemory(true), cpu = totalMemory(false);
+	bool within = true;
+	if (memoryTracker.gpuBudget != 0 && gpu > memoryTracker.gpuBudget) {
+		if (!memoryTracker.gpuOverBudget)
+			fprintf(out, "Memory budget: GPU estimate %.2f MB is over the %.2f MB budget\n", gpu / 1048576.0, memoryTracker.gpuBudget / 1048576.0);
+		memoryTracker.gpuOverBudget = true;
+		within = false;
+	}
+	if (memoryTracker.cpuBudget != 0 && cpu > memoryTracker.cpuBudget) {
+		if (!memoryTracker.cpuOverBudget)
+			fprintf(out, "Memory budget: CPU tracked %.2f MB is over the %.2f MB budget\n", cpu / 1048576.0, memoryTracker.cpuBudget / 1048576.0);
+		memoryTracker.cpuOverBudget = true;
+		within = false;
+	}
+	return within;
+}
+
+void printMemorySide(FILE* out, bool gpu)
+{
+	std::map<std::string, size_t> categories;
+	std::vector<const MemoryEntry*> assets;
+	for (const auto& entry : memoryTracker.entries) {
+		if (entry.second.gpu != gpu)
+			continue;
+		categories[entry.second.category] += entry.second.bytes;
+		assets.push_back(&entry.second);
+	}
+	// By peak, so a freed readback still shows what it cost
+	std::sort(assets.begin(), assets.end(), [](const MemoryEntry* a, const MemoryEntry* b) { return a->peak > b->peak; });
+
+	fprintf(out, "%s memory: %.2f MB\n", gpu ? "GPU (estimated)" : "CPU (tracked)", totalMemory(gpu) / 1048576.0);
+	for (const auto& category : categories)
+		fprintf(out, "  %-16s %10.2f MB\n", category.first.c_str(), category.second / 1048576.0);
+	for (size_t i = 0; i < assets.size() && i < 10; i++)
+		fprintf(out, "    %-40s %10.2f MB  peak %10.2f MB  (%s)\n", assets[i]->asset.c_str(),
+			assets[i]->bytes / 1048576.0, assets[i]->peak / 1048576.0, assets[i]->category.c_str());
+}
+
+// Category totals, then the ten assets of each side that peaked highest
+void printMemoryStats(FILE* out)
+{
+	printMemorySide(out, true);
+	printMemorySide(out, false);
+}
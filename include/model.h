@@ -6,82 +6,325 @@
 #include <glm/gtc/matrix_transform.hpp>
 #include <glm/gtc/type_ptr.hpp>
 
+#include <memory>
+#include <string>
+#include <unordered_map>
+
+#include "gpu_resource.h"
+#include "memory_stats.h"
 #include "obj_parser.h"
+#include "duplicate_shapes.h"
+#include "profiler.h"
 #define STB_IMAGE_IMPLEMENTATION
 #include "texture.h"
 
+// Bitwise hash of a position, for de-duplicating the depth-only stream
+struct PositionHash {
+	size_t operator()(const glm::vec3& p) const {
+		// Adding zero folds -0 into +0, which compare equal
+		glm::vec3 q = p + glm::vec3(0.f);
+		uint32_t bits[3];
+		memcpy(bits, &q, sizeof(bits));
+		size_t h = bits[0];
+		h = h * 31 + bits[1];
+		h = h * 31 + bits[2];
+		return h;
+	}
+};
+
+// Camera and light matrices shared by every draw, the version tells models when to rebuild their MVPs
+struct PassMatrices {
+	glm::mat4 viewProjection = glm::mat4(1.f);
+	glm::mat4 lightSpace = glm::mat4(1.f);
+	unsigned int version = 0;
+};
+
+PassMatrices passMatrices;
+
+void setPassMatrices(glm::mat4 viewProjection, glm::mat4 lightSpace) {
+	if (viewProjection == passMatrices.viewProjection && lightSpace == passMatrices.lightSpace)
+		return;
+
+	passMatrices.viewProjection = viewProjection;
+	passMatrices.lightSpace = lightSpace;
+	passMatrices.version++;
+}
+
+// Repeated obj groups closer than this fraction of the model's size are drawn as instances of the first
+#define DUPLICATE_SHAPE_TOLERANCE 1e-5f
+
+// Part transforms are a per-instance mat4 attribute in locations 4 to 7 of phong.vert, prepass.vert and shadow.vert
+#define PART_TRANSFORM_LOCATION 4
+
+// One range of the depth stream, drawn once per part transform
+struct DepthDraw {
+	GLsizei firstIndex;
+	GLsizei count;
+	GLuint firstPart;
+	GLsizei parts;
+};
+
+// One run of same-material triangles in the uploaded vertices, drawn once per part transform
+struct ColourDraw {
+	GLint first;
+	GLsizei count;
+	int material;
+	bool transparent;
+	GLuint firstPart;
+	GLsizei parts;
+};
+
+// Shader variants a model picks between per material, so untextured materials skip texture sampling
+struct MaterialPrograms {
+	unsigned int textured;
+	unsigned int untextured;
+};
+
 class model {
 private:
-	GLuint VBO, VAO;
+	GpuBuffer VBO;
+	GpuVertexArray VAO;
+	// Position-only stream for depth passes, de-duplicated and indexed
+	GpuBuffer depthVBO, depthEBO;
+	GpuVertexArray depthVAO;
+	GLsizei depthIndexCount = 0;
+	GLsizei opaqueIndexCount = 0;
+	// Opaque draws come first, so a depth pre-pass stops after opaqueDepthDraws
+	std::vector<DepthDraw> depthDraws;
+	size_t opaqueDepthDraws = 0;
+	// Obj groups, with repeated ones drawn as instances of their first occurrence through the part transforms
+	DuplicateShapes duplicates;
+	GpuBuffer partVBO;
+	GLsizei uploadedVertexCount = 0;
+	GLsizei partCount = 0;
+	GLsizei depthPositionCount = 0;
+	// Everything drawLayer needs, so the parsed shapes can be released after upload
+	std::vector<ColourDraw> colourDraws;
+	bool cpuGeometryReleased = false;
+	// Obj path or a numbered procedural name, what the memory stats list this model's allocations under
+	std::string assetName;
+	// Part transform divisor last set on each VAO, it is the object instance count of the draw
+	GLuint colourDivisor = 1, depthDivisor = 1;
+	// First vertex and material of each opaque depth stream triangle, for visibility buffer vertex pulling
+	std::vector<glm::uvec2> visibilityTriangles;
 	std::vector<vertex> vertices;
 	glm::mat4 modelMat = glm::mat4(1.f);
+
+	// Per-draw matrices, computed on the CPU instead of per vertex
+	glm::mat3 normalMat = glm::mat3(1.f);
+	glm::mat4 mvp = glm::mat4(1.f);
+	glm::mat4 lightMvp = glm::mat4(1.f);
+	bool transformDirty = true;
+	unsigned int matricesVersion = 0;
 	bool has_textures = false;
 	std::vector<tinyobj::shape_t> shapes;
-	std::map<int, GLuint> textures;
-	GLuint defaultTexture;
+	// Shared through textureRegistry, so materials and models using one file hold one texture
+	std::map<int, std::shared_ptr<GpuTexture>> textures;
+	std::shared_ptr<GpuTexture> defaultTexture;
 	std::vector<int> material_id;
 	std::vector<tinyobj::material_t> materials;
+	glm::vec3 boundsMin = glm::vec3(0.f);
+	glm::vec3 boundsMax = glm::vec3(0.f);
 
-public:
-	// Constructor for parsed obj models
-	model(const std::string obj_path, std::string obj_folder) {
-		glGenTextures(1, &defaultTexture);
-		glBindTexture(GL_TEXTURE_2D, defaultTexture);
-		unsigned char white[] = { 255, 255, 255, 255 };
-		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, 1, 1, 0, GL_RGBA, GL_UNSIGNED_BYTE, white);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-		glBindTexture(GL_TEXTURE_2D, 0);
-
-		obj_parse(obj_path.c_str(), &vertices, 1.f, obj_folder.c_str(), &shapes, &materials, &material_id);
+	// Local space bounding box, used for occlusion tests
+	void computeBounds() {
+		if (vertices.empty())
+			return;
 
-		for (size_t i = 0; i < materials.size(); i++) {
-			const auto& mtl = materials[i];
+		boundsMin = vertices[0].pos;
+		boundsMax = vertices[0].pos;
+		for (const auto& v : vertices) {
+			boundsMin = glm::min(boundsMin, v.pos);
+			boundsMax = glm::max(boundsMax, v.pos);
+		}
+	}
 
-			if (!mtl.diffuse_texname.empty()) {
-				std::string tex_path = obj_folder + materials[i].diffuse_texname;
-				std::cout << "Loading texture: " << tex_path << std::endl;
-				GLuint texture = setup_texture(tex_path.c_str());
-				if (texture != 0) {
-					textures[i] = texture;
-					has_textures = true;
+	// Tightly packed 12 byte positions, so depth passes skip colour, normal and UV fetches
+	void setupDepthStream() {
+		// Flag vertices of transparent faces, the same way draw() splits its layers
+		std::vector<char> transparent(vertices.size(), 0);
+		std::vector<int> vertexMaterial(vertices.size(), 0);
+		size_t f_index = 0;
+		size_t i_offset = 0;
+		for (const auto& shape : shapes) {
+			for (size_t f = 0; f < shape.mesh.num_face_vertices.size(); f++) {
+				int mtl_id = material_id[f_index];
+				int fv = shape.mesh.num_face_vertices[f];
+				bool transparent_mtl = mtl_id >= 0 && materials[mtl_id].dissolve < 1.0f;
+				for (int v = 0; v < fv; v++) {
+					transparent[i_offset + v] = transparent_mtl;
+					vertexMaterial[i_offset + v] = glm::max(mtl_id, 0);
 				}
+
+				i_offset += fv;
+				f_index++;
 			}
 		}
 
-		glCreateBuffers(1, &VBO);
-		glNamedBufferStorage(VBO, vertices.size() * sizeof(vertex), vertices.data(), 0);
-		glGenVertexArrays(1, &VAO);
-		glBindVertexArray(VAO);
-		glBindBuffer(GL_ARRAY_BUFFER, VBO);
+		// Shapes drawn once share a range per layer, each repeated shape gets its own to instance
+		std::vector<std::vector<size_t>> groups(1);
+		for (size_t s = 0; s < duplicates.ranges.size(); s++) {
+			const ShapeRange& range = duplicates.ranges[s];
+			if (range.copyOf >= 0)
+				continue;
+			if (range.parts == 1)
+				groups[0].push_back(s);
+			else
+				groups.push_back(std::vector<size_t>(1, s));
+		}
 
-		glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(vertex), (void*)offsetof(vertex, pos));
-		glEnableVertexAttribArray(0);
-		glVertexAttribPointer(1, 4, GL_FLOAT, GL_FALSE, sizeof(vertex), (void*)offsetof(vertex, col));
-		glEnableVertexAttribArray(1);
-		glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, sizeof(vertex), (void*)offsetof(vertex, nor));
-		glEnableVertexAttribArray(2);
-		glVertexAttribPointer(3, 2, GL_FLOAT, GL_FALSE, sizeof(vertex), (void*)offsetof(vertex, tex));
-		glEnableVertexAttribArray(3);
+		std::vector<glm::vec3> positions;
+		std::vector<GLuint> indices;
+		std::unordered_map<glm::vec3, GLuint, PositionHash> lookup;
+		indices.reserve(uploadedVertexCount);
+
+		// Opaque faces first, so a depth pre-pass can stop before the transparent ones
+		for (int layer = 0; layer < 2; layer++) {
+			for (const auto& group : groups) {
+				GLsizei firstIndex = (GLsizei)indices.size();
+				std::vector<glm::uvec2> groupTriangles;
+				for (size_t s : group) {
+					const ShapeRange& range = duplicates.ranges[s];
+					for (size_t i = range.firstVertex; i < range.firstVertex + range.vertexCount; i++) {
+						if (transparent[i] != layer)
+							continue;
+
+						// Faces are triangles, so every third vertex starts the next one
+						if (layer == 0 && i % 3 == 0)
+							groupTriangles.push_back(glm::uvec2((unsigned int)i, (unsigned int)vertexMaterial[i]));
+
+						const glm::vec3& pos = vertices[i].pos;
+						auto found = lookup.find(pos);
+						if (found != lookup.end()) {
+							indices.push_back(found->second);
+							continue;
+						}
 
+						GLuint index = (GLuint)positions.size();
+						lookup.emplace(pos, index);
+						positions.push_back(pos);
+						indices.push_back(index);
+					}
+				}
+				if ((GLsizei)indices.size() == firstIndex)
+					continue;
+
+				const ShapeRange& first = duplicates.ranges[group[0]];
+				DepthDraw draw = { firstIndex, (GLsizei)indices.size() - firstIndex, first.firstPart, (GLsizei)first.parts };
+				depthDraws.push_back(draw);
+
+				// Visibility IDs count triangles through every part in turn, each copy pulls its own parsed vertices
+				if (layer == 0) {
+					std::vector<size_t> partShapes(1, group[0]);
+					for (size_t s = 0; s < duplicates.ranges.size() && first.parts > 1; s++) {
+						if (duplicates.ranges[s].copyOf == (int)group[0])
+							partShapes.push_back(s);
+					}
+					for (size_t part : partShapes) {
+						size_t partFirst = duplicates.ranges[part].firstVertex;
+						for (const auto& triangle : groupTriangles) {
+							size_t vertex = group.size() == 1 ? partFirst + (triangle.x - first.firstVertex) : triangle.x;
+							visibilityTriangles.push_back(glm::uvec2((unsigned int)vertex, triangle.y));
+						}
+					}
+				}
+			}
+
+			if (layer == 0) {
+				opaqueIndexCount = (GLsizei)indices.size();
+				opaqueDepthDraws = depthDraws.size();
+			}
+		}
+		depthIndexCount = (GLsizei)indices.size();
+		depthPositionCount = (GLsizei)positions.size();
+
+		depthVBO = createBuffer();
+		trackedBufferStorage(depthVBO, positions.size() * sizeof(glm::vec3), positions.data(), 0, MEMORY_GEOMETRY, assetName);
+		depthEBO = createBuffer();
+		trackedBufferStorage(depthEBO, indices.size() * sizeof(GLuint), indices.data(), 0, MEMORY_GEOMETRY, assetName);
+
+		depthVAO = createVertexArray();
+		glBindVertexArray(depthVAO);
+		glBindBuffer(GL_ARRAY_BUFFER, depthVBO);
+		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, depthEBO);
+		glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(glm::vec3), (void*)0);
+		glEnableVertexAttribArray(0);
+		bindPartTransforms();
 		glBindVertexArray(0);
 	}
 
-	// Constructor for procedurally generated models
-	model(const std::vector<vertex>& custom_vertices) {
-		vertices = custom_vertices;
+	// Per-instance mat4 in four vec4 attributes, on the currently bound VAO
+	void bindPartTransforms() {
+		glBindBuffer(GL_ARRAY_BUFFER, partVBO);
+		for (int column = 0; column < 4; column++) {
+			glVertexAttribPointer(PART_TRANSFORM_LOCATION + column, 4, GL_FLOAT, GL_FALSE, sizeof(glm::mat4), (void*)(sizeof(glm::vec4) * column));
+			glEnableVertexAttribArray(PART_TRANSFORM_LOCATION + column);
+			glVertexAttribDivisor(PART_TRANSFORM_LOCATION + column, 1);
+		}
+	}
+
+	// Each part transform covers every object instance, instanced shaders index their own buffer with the rest
+	void setPartDivisor(GLuint& current, GLsizei instanceCount) {
+		if (current == (GLuint)instanceCount)
+			return;
+		for (int column = 0; column < 4; column++)
+			glVertexAttribDivisor(PART_TRANSFORM_LOCATION + column, (GLuint)instanceCount);
+		current = (GLuint)instanceCount;
+	}
+
+	// Material runs drawLayer issues for one shape, across both layers
+	size_t materialBatches(const ShapeRange& range) const {
+		size_t batches = 0;
+		int current_mtl = -2;
+		for (size_t f = range.firstFace; f < range.firstFace + range.vertexCount / 3; f++) {
+			if (material_id[f] != current_mtl)
+				batches++;
+			current_mtl = material_id[f];
+		}
+		return batches;
+	}
 
-		glGenTextures(1, &defaultTexture);
-		glBindTexture(GL_TEXTURE_2D, defaultTexture);
-		unsigned char white[] = { 255, 255, 255, 255 };
-		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, 1, 1, 0, GL_RGBA, GL_UNSIGNED_BYTE, white);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-		glBindTexture(GL_TEXTURE_2D, 0);
-
-		glCreateBuffers(1, &VBO);
-		glNamedBufferStorage(VBO, vertices.size() * sizeof(vertex), vertices.data(), 0);
-		glGenVertexArrays(1, &VAO);
+	// Material runs of every shape that isn't a copy, in uploaded vertices
+	void setupColourDraws() {
+		if (shapes.empty()) {
+			ColourDraw draw = { 0, uploadedVertexCount, -1, false, 0, 1 };
+			colourDraws.push_back(draw);
+			return;
+		}
+
+		for (size_t s = 0; s < shapes.size(); s++) {
+			const ShapeRange& range = duplicates.ranges[s];
+			if (range.copyOf >= 0)
+				continue;
+
+			const auto& num_face_vertices = shapes[s].mesh.num_face_vertices;
+			GLint first = (GLint)range.uploadedFirst;
+			for (size_t f = 0; f < num_face_vertices.size(); f++) {
+				int mtl_id = material_id[range.firstFace + f];
+				if (colourDraws.empty() || f == 0 || colourDraws.back().material != mtl_id) {
+					ColourDraw draw = { first, 0, mtl_id, isTransparentMaterial(mtl_id), range.firstPart, (GLsizei)range.parts };
+					colourDraws.push_back(draw);
+				}
+				colourDraws.back().count += (GLsizei)num_face_vertices[f];
+				first += (GLint)num_face_vertices[f];
+			}
+		}
+	}
+
+	// Vertex buffer of the shapes that aren't copies, part transforms and the depth stream built from them
+	void setupVertexStreams() {
+		PROFILE_SCOPE("geometry upload");
+		std::vector<vertex> uploaded = uniqueShapeVertices(vertices, duplicates);
+		uploadedVertexCount = (GLsizei)uploaded.size();
+		partCount = (GLsizei)duplicates.partTransforms.size();
+
+		VBO = createBuffer();
+		trackedBufferStorage(VBO, uploaded.size() * sizeof(vertex), uploaded.data(), 0, MEMORY_GEOMETRY, assetName);
+		partVBO = createBuffer();
+		trackedBufferStorage(partVBO, duplicates.partTransforms.size() * sizeof(glm::mat4), duplicates.partTransforms.data(), 0,
+			MEMORY_GEOMETRY, assetName);
+
+		VAO = createVertexArray();
 		glBindVertexArray(VAO);
 		glBindBuffer(GL_ARRAY_BUFFER, VBO);
 
@@ -93,101 +336,282 @@ public:
 		glEnableVertexAttribArray(2);
 		glVertexAttribPointer(3, 2, GL_FLOAT, GL_FALSE, sizeof(vertex), (void*)offsetof(vertex, tex));
 		glEnableVertexAttribArray(3);
+		bindPartTransforms();
 
 		glBindVertexArray(0);
+
+		setupDepthStream();
+		setupColourDraws();
+
+		if (duplicates.copies == 0)
+			return;
+
+		size_t batchesBefore = 0;
+		for (const auto& range : duplicates.ranges)
+			batchesBefore += materialBatches(range);
+		printf("Repeated parts: %zu copies of %zu groups drawn as instances, vertex buffer %.2f -> %.2f MB, "
+			"material draws %zu -> %zu\n", duplicates.copies, duplicates.repeatedShapes,
+			vertices.size() * sizeof(vertex) / 1048576.0, uploaded.size() * sizeof(vertex) / 1048576.0, batchesBefore, colourDraws.size());
 	}
 
-	// Destructor
-	~model() {
-		glDeleteTextures(1, &defaultTexture);
-		glDeleteBuffers(1, &VBO);
-		glDeleteVertexArrays(1, &VAO);
+	// Rebuilds cached matrices only when the transform or the pass matrices changed
+	void updateMatrices() {
+		if (transformDirty) {
+			normalMat = glm::mat3(glm::transpose(glm::inverse(modelMat)));
+			transformDirty = false;
+		}
+		else if (matricesVersion == passMatrices.version)
+			return;
+
+		mvp = passMatrices.viewProjection * modelMat;
+		lightMvp = passMatrices.lightSpace * modelMat;
+		matricesVersion = passMatrices.version;
 	}
 
-	// Draw function
-	void draw(unsigned int shaderProgram) {
-		glUseProgram(shaderProgram);
-		glBindVertexArray(VAO);
+	void uploadMatrices(unsigned int shaderProgram) {
+		updateMatrices();
 		glUniformMatrix4fv(glGetUniformLocation(shaderProgram, "model"), 1, GL_FALSE, glm::value_ptr(modelMat));
+		glUniformMatrix3fv(glGetUniformLocation(shaderProgram, "normalMatrix"), 1, GL_FALSE, glm::value_ptr(normalMat));
+		glUniformMatrix4fv(glGetUniformLocation(shaderProgram, "mvp"), 1, GL_FALSE, glm::value_ptr(mvp));
+		glUniformMatrix4fv(glGetUniformLocation(shaderProgram, "lightMvp"), 1, GL_FALSE, glm::value_ptr(lightMvp));
+	}
 
-		if (shapes.empty()) {
-			glActiveTexture(GL_TEXTURE0);
-			glBindTexture(GL_TEXTURE_2D, defaultTexture);
-			glUniform1i(glGetUniformLocation(shaderProgram, "Texture"), 0);
-			glDrawArrays(GL_TRIANGLES, 0, vertices.size());
-			return;
+public:
+	// Constructor for parsed obj models
+	model(const std::string obj_path, std::string obj_folder) : assetName(obj_path) {
+		defaultTexture = acquireWhiteTexture();
+
+		{
+			PROFILE_SCOPE("obj parse");
+			obj_parse(obj_path.c_str(), &vertices, 1.f, obj_folder.c_str(), &shapes, &materials, &material_id);
 		}
+		computeBounds();
 
-		// Cache location to reduce lag
-		GLint texLocCache = glGetUniformLocation(shaderProgram, "Texture");
+		for (size_t i = 0; i < materials.size(); i++) {
+			const auto& mtl = materials[i];
 
-		// Render opaque, then transparent
-		for (int layer = 0; layer < 2; layer++) {
-			bool transparent_layer = (layer == 1);
-
-			size_t f_index = 0;
-			size_t i_offset = 0;
-			for (const auto& shape : shapes) {
-				int current_mtl = -1;
-				size_t batch_count = 0;
-
-				for (size_t f = 0; f < shape.mesh.num_face_vertices.size(); f++) {
-					int mtl_id = material_id[f_index];
-					int fv = shape.mesh.num_face_vertices[f];
-
-					// If material is transparent but not rendering transparent layer yet, skip
-					bool transparent_mtl = materials[mtl_id].dissolve < 1.0f;
-					if (transparent_layer != transparent_mtl) {
-						f_index++;
-						i_offset += fv;
-						continue;
-					}
+			if (!mtl.diffuse_texname.empty()) {
+				std::string tex_path = obj_folder + materials[i].diffuse_texname;
+				std::cout << "Loading texture: " << tex_path << std::endl;
+				std::shared_ptr<GpuTexture> texture = acquireTexture(tex_path);
+				if (*texture != 0) {
+					textures[i] = texture;
+					has_textures = true;
+				}
+			}
+		}
+
+		// Repeated groups are found before upload, so only one copy of each reaches the GPU
+		{
+			PROFILE_SCOPE("duplicate shapes");
+			duplicates = findDuplicateShapes(vertices, shapes, material_id,
+				glm::length(boundsMax - boundsMin) * DUPLICATE_SHAPE_TOLERANCE);
+		}
+		setupVertexStreams();
+		setCpuMemory(MEMORY_GEOMETRY, assetName, cpuBytes());
+	}
 
-					// Call only if mtl_id changes to reduce lag
-					if (mtl_id != current_mtl) {
-						// Draw previous batch
-						if (batch_count > 0)
-							glDrawArrays(GL_TRIANGLES, i_offset - batch_count, batch_count);
+	// Constructor for procedurally generated models
+	model(const std::vector<vertex>& custom_vertices) {
+		static int procedural = 0;
+		assetName = "procedural mesh " + std::to_string(procedural++);
+		vertices = custom_vertices;
+		computeBounds();
 
-						current_mtl = mtl_id;
+		defaultTexture = acquireWhiteTexture();
 
-						if (textures.find(mtl_id) != textures.end()) {
-							glActiveTexture(GL_TEXTURE0);
-							glBindTexture(GL_TEXTURE_2D, textures[mtl_id]);
-						}
-						else {
-							glActiveTexture(GL_TEXTURE0);
-							glBindTexture(GL_TEXTURE_2D, defaultTexture);
-						}
-						glUniform1i(texLocCache, 0);
+		duplicates = singleShape(vertices.size());
+		setupVertexStreams();
+		setCpuMemory(MEMORY_GEOMETRY, assetName, cpuBytes());
+	}
 
-						batch_count = 0;
-					}
+	// GL objects are owned by their handles, so a model can be moved but never copied
+	model(const model&) = delete;
+	model& operator=(const model&) = delete;
+	model(model&&) = default;
+	model& operator=(model&&) = default;
 
-					batch_count += fv;
-					i_offset += fv;
-					f_index++;
+	// Draw function
+	void draw(unsigned int shaderProgram) {
+		// Render opaque, then transparent
+		drawLayer(shaderProgram, false);
+		drawLayer(shaderProgram, true);
+	}
+
+	// Draws only the opaque or only the transparent faces
+	void drawLayer(unsigned int shaderProgram, bool transparent_layer) {
+		MaterialPrograms programs = { shaderProgram, shaderProgram };
+		drawLayer(programs, transparent_layer);
+	}
+
+	// Instanced programs read their transforms from the instance buffer, see instancing.h
+	void drawLayer(MaterialPrograms programs, bool transparent_layer, GLsizei instanceCount = 1) {
+		if (transparent_layer && !hasTransparency())
+			return;
+
+		glBindVertexArray(VAO);
+		setPartDivisor(colourDivisor, instanceCount);
+
+		unsigned int current_program = 0;
+		// Cache location to reduce lag
+		GLint texLocCache = -1;
+		int current_mtl = -2;
+
+		// Copies are drawn as extra instances of their original
+		for (const auto& draw : colourDraws) {
+			if (draw.transparent != transparent_layer)
+				continue;
+
+			// Call only if mtl_id changes to reduce lag
+			if (draw.material != current_mtl) {
+				current_mtl = draw.material;
+
+				bool textured = isTexturedMaterial(draw.material);
+				unsigned int program = textured ? programs.textured : programs.untextured;
+				if (program != current_program) {
+					glUseProgram(program);
+					uploadMatrices(program);
+					texLocCache = glGetUniformLocation(program, "Texture");
+					current_program = program;
 				}
 
-				// Draw leftover batch
-				if (batch_count > 0)
-					glDrawArrays(GL_TRIANGLES, i_offset - batch_count, batch_count);
+				glActiveTexture(GL_TEXTURE0);
+				glBindTexture(GL_TEXTURE_2D, getMaterialTexture(draw.material));
+				glUniform1i(texLocCache, 0);
 			}
+
+			glDrawArraysInstancedBaseInstance(GL_TRIANGLES, draw.first, draw.count, draw.parts * instanceCount, draw.firstPart);
 		}
 	}
 
+	// Depth-only draw, positions only and materials don't matter, so one call per range of the stream
+	// Repeated parts take a range each, visibility buffer IDs count triangles across them in visibilityTriangles order
+	void drawDepth(unsigned int shaderProgram, bool opaqueOnly = false, GLsizei instanceCount = 1) {
+		glUseProgram(shaderProgram);
+		glBindVertexArray(depthVAO);
+		setPartDivisor(depthDivisor, instanceCount);
+		uploadMatrices(shaderProgram);
+
+		GLint firstPrimitiveLoc = glGetUniformLocation(shaderProgram, "firstPrimitive");
+		GLint partTrianglesLoc = glGetUniformLocation(shaderProgram, "partTriangles");
+		size_t drawCount = opaqueOnly ? opaqueDepthDraws : depthDraws.size();
+		GLuint primitive = 0;
+		for (size_t d = 0; d < drawCount; d++) {
+			DepthDraw draw = depthDraws[d];
+			// Neighbouring ranges without repeated parts go out as one
+			while (draw.parts == 1 && d + 1 < drawCount && depthDraws[d + 1].parts == 1)
+				draw.count += depthDraws[++d].count;
+
+			glUniform1ui(firstPrimitiveLoc, primitive);
+			glUniform1ui(partTrianglesLoc, (GLuint)(draw.count / 3));
+			glDrawElementsInstancedBaseInstance(GL_TRIANGLES, draw.count, GL_UNSIGNED_INT, (void*)(draw.firstIndex * sizeof(GLuint)),
+				draw.parts * instanceCount, draw.firstPart);
+			primitive += (GLuint)(draw.count / 3 * draw.parts);
+		}
+	}
+
+	// Accessors
+	const glm::mat4& getModelMatrix() const { return modelMat; }
+	const glm::vec3& getBoundsMin() const { return boundsMin; }
+	const glm::vec3& getBoundsMax() const { return boundsMax; }
+	bool hasTransparency() const { return opaqueIndexCount < depthIndexCount; }
+	const std::vector<vertex>& getVertices() const { return vertices; }
+	const std::vector<glm::uvec2>& getVisibilityTriangles() const { return visibilityTriangles; }
+
+	// Material of every parsed vertex, -1 for procedural models
+	std::vector<int> getVertexMaterials() const {
+		std::vector<int> vertexMaterials(vertices.size(), -1);
+		size_t f_index = 0;
+		size_t i_offset = 0;
+		for (const auto& shape : shapes) {
+			for (size_t f = 0; f < shape.mesh.num_face_vertices.size(); f++) {
+				int fv = shape.mesh.num_face_vertices[f];
+				for (int v = 0; v < fv; v++)
+					vertexMaterials[i_offset + v] = material_id[f_index];
+				i_offset += fv;
+				f_index++;
+			}
+		}
+		return vertexMaterials;
+	}
+
+	bool isTransparentMaterial(int mtl_id) const { return mtl_id >= 0 && materials[mtl_id].dissolve < 1.0f; }
+	bool isTexturedMaterial(int mtl_id) const { return textures.find(mtl_id) != textures.end(); }
+
+	// Draws drawLayer issues across both layers
+	size_t colourDrawCount() const { return colourDraws.size(); }
+
+	// Parsed vertices, shapes and per-face materials, only kept until releaseCpuGeometry
+	bool hasCpuGeometry() const { return !cpuGeometryReleased; }
+
+	// Frees the parsed geometry once every setup step that reads it has run
+	// Drawing only needs the draw ranges, bounds and material table, all kept
+	void releaseCpuGeometry() {
+		std::vector<vertex>().swap(vertices);
+		std::vector<tinyobj::shape_t>().swap(shapes);
+		std::vector<int>().swap(material_id);
+		std::vector<glm::uvec2>().swap(visibilityTriangles);
+		duplicates = DuplicateShapes();
+		cpuGeometryReleased = true;
+		setCpuMemory(MEMORY_GEOMETRY, assetName, cpuBytes());
+	}
+
+	// Estimated heap bytes held on the CPU, the parsed geometry and what drawing keeps
+	size_t cpuBytes() const {
+		size_t bytes = vertices.capacity() * sizeof(vertex) + material_id.capacity() * sizeof(int) +
+			visibilityTriangles.capacity() * sizeof(glm::uvec2) + duplicates.ranges.capacity() * sizeof(ShapeRange) +
+			duplicates.partTransforms.capacity() * sizeof(glm::mat4) + depthDraws.capacity() * sizeof(DepthDraw) +
+			colourDraws.capacity() * sizeof(ColourDraw) + materials.capacity() * sizeof(tinyobj::material_t);
+		for (const auto& shape : shapes) {
+			bytes += shape.name.capacity() + shape.mesh.indices.capacity() * sizeof(tinyobj::index_t) +
+				shape.mesh.num_face_vertices.capacity() * sizeof(unsigned int) + shape.mesh.material_ids.capacity() * sizeof(int) +
+				shape.mesh.smoothing_group_ids.capacity() * sizeof(unsigned int);
+		}
+		return bytes;
+	}
+
+	// Vertex, part transform and depth stream buffers, textures are shared and counted by the registry
+	size_t gpuBytes() const {
+		return (size_t)uploadedVertexCount * sizeof(vertex) + (size_t)partCount * sizeof(glm::mat4) +
+			(size_t)depthPositionCount * sizeof(glm::vec3) + (size_t)depthIndexCount * sizeof(GLuint);
+	}
+
+	// Unique positions the depth stream kept out of the uploaded vertices, for the setup summary
+	GLsizei getDepthPositionCount() const { return depthPositionCount; }
+	GLsizei getVertexCount() const { return uploadedVertexCount; }
+
+	// Diffuse texture of a material, white when it has none
+	GLuint getMaterialTexture(int mtl_id) const {
+		auto found = textures.find(mtl_id);
+		return found != textures.end() ? *found->second : *defaultTexture;
+	}
+
+	glm::vec3 getWorldCenter() const {
+		return glm::vec3(modelMat * glm::vec4((boundsMin + boundsMax) * 0.5f, 1.f));
+	}
+
 	// Transformations
+	void setModelMatrix(const glm::mat4& matrix) {
+		if (matrix == modelMat)
+			return;
+		modelMat = matrix;
+		transformDirty = true;
+	}
+
 	void translate(glm::vec3 translation) {
 		modelMat = glm::translate(modelMat, translation);
+		transformDirty = true;
 	}
 
 	void rotate(float angle_rad, glm::vec3 axis) {
 		modelMat = glm::rotate(modelMat, angle_rad, axis);
+		transformDirty = true;
 	}
 
 	// Non-uniform scaling
 	void scale(glm::vec3 factors) {
 		modelMat = glm::scale(modelMat, factors);
+		transformDirty = true;
 	}
 
 	// Uniform scaling
@@ -5,8 +5,8 @@
 #include <vector>
 #include <algorithm>
 #include <stdio.h>
-#include <windows.h>
-#include <wingdi.h>
+
+#include "platform.h"
 
 
 #define TINYOBJLOADER_IMPLEMENTATION
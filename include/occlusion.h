@@ -0,0 +1,223 @@
+#pragma once
+
+#include <GL/gl3w.h>
+#include <glm/glm.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+#include <glm/gtc/type_ptr.hpp>
+
+#include <stdio.h>
+#include <unordered_map>
+#include <utility>
+
+#include "entities.h"
+#include "gpu_resource.h"
+#include "memory_stats.h"
+#include "model.h"
+
+// Queries are kept in a ring of 3 so results are at least 2 frames old when read back
+#define OCCLUSION_RING 3
+
+struct OcclusionStats {
+	unsigned int queriesIssued = 0;
+	unsigned int objectsSkipped = 0;
+	unsigned int falsePositives = 0;
+};
+
+// Per-entity query state
+// Slot s holds the bounding box test issued in frame F and the draw of frame F + 1 it decided
+struct OcclusionState {
+	GpuQuery testQuery[OCCLUSION_RING];
+	GpuQuery drawQuery[OCCLUSION_RING];
+	bool testIssued[OCCLUSION_RING] = { false, false, false };
+	bool drawIssued[OCCLUSION_RING] = { false, false, false };
+};
+
+struct OcclusionCuller {
+	GLuint program = 0;
+	GpuVertexArray VAO;
+	GpuBuffer VBO, EBO;
+	unsigned int frame = 0;
+	// Set by issueOcclusionTests, frames without tests leave their slot empty
+	bool testsIssuedThisFrame = false;
+
+	// Counters for the frame being built, the last completed frame and the whole run
+	OcclusionStats current, lastFrame, total;
+
+	std::unordered_map<Entity, OcclusionState> states;
+};
+
+OcclusionCuller setup_occlusion(GLuint program) {
+	OcclusionCuller culler;
+	culler.program = program;
+
+	// Unit cube, scaled to each model's bounds when tested
+	const float cube[] = {
+		0.f, 0.f, 0.f,  1.f, 0.f, 0.f,  1.f, 1.f, 0.f,  0.f, 1.f, 0.f,
+		0.f, 0.f, 1.f,  1.f, 0.f, 1.f,  1.f, 1.f, 1.f,  0.f, 1.f, 1.f
+	};
+	const GLuint indices[] = {
+		0, 2, 1,  0, 3, 2,
+		4, 5, 6,  4, 6, 7,
+		0, 1, 5,  0, 5, 4,
+		3, 6, 2,  3, 7, 6,
+		0, 4, 7,  0, 7, 3,
+		1, 2, 6,  1, 6, 5
+	};
+
+	culler.VBO = createBuffer();
+	trackedBufferStorage(culler.VBO, sizeof(cube), cube, 0, MEMORY_GEOMETRY, "occlusion box");
+	culler.EBO = createBuffer();
+	trackedBufferStorage(culler.EBO, sizeof(indices), indices, 0, MEMORY_GEOMETRY, "occlusion box");
+
+	culler.VAO = createVertexArray();
+	glBindVertexArray(culler.VAO);
+	glBindBuffer(GL_ARRAY_BUFFER, culler.VBO);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, culler.EBO);
+	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 3 * sizeof(float), (void*)0);
+	glEnableVertexAttribArray(0);
+	glBindVertexArray(0);
+
+	return culler;
+}
+
+void registerOccludee(OcclusionCuller& culler, Entity entity) {
+	OcclusionState state;
+	for (int slot = 0; slot < OCCLUSION_RING; slot++) {
+		state.testQuery[slot] = createQuery();
+		state.drawQuery[slot] = createQuery();
+	}
+	culler.states[entity] = std::move(state);
+}
+
+// Reads back results of a slot that is about to be reused, without stalling
+void harvestOcclusionSlot(OcclusionCuller& culler, OcclusionState& state, int slot) {
+	if (!state.testIssued[slot] || !state.drawIssued[slot])
+		return;
+
+	GLuint available = 0;
+	glGetQueryObjectuiv(state.testQuery[slot], GL_QUERY_RESULT_AVAILABLE, &available);
+	if (!available)
+		return;
+
+	GLuint visible = 0;
+	glGetQueryObjectuiv(state.testQuery[slot], GL_QUERY_RESULT, &visible);
+	if (!visible) {
+		culler.current.objectsSkipped++;
+		return;
+	}
+
+	// Box was visible, but did the model itself produce any samples?
+	glGetQueryObjectuiv(state.drawQuery[slot], GL_QUERY_RESULT_AVAILABLE, &available);
+	if (!available)
+		return;
+
+	GLuint drawn = 0;
+	glGetQueryObjectuiv(state.drawQuery[slot], GL_QUERY_RESULT, &drawn);
+	if (!drawn)
+		culler.current.falsePositives++;
+}
+
+bool cameraInsideBounds(const model& m, glm::vec3 camPos) {
+	glm::vec3 local = glm::vec3(glm::inverse(m.getModelMatrix()) * glm::vec4(camPos, 1.f));
+	glm::vec3 margin = (m.getBoundsMax() - m.getBoundsMin()) * 0.05f;
+
+	return glm::all(glm::greaterThanEqual(local, m.getBoundsMin() - margin)) &&
+		glm::all(glm::lessThanEqual(local, m.getBoundsMax() + margin));
+}
+
+// Issues this frame's bounding box tests, must run after the occluders and before the occludees
+void issueOcclusionTests(OcclusionCuller& culler, EntityStore* store, glm::mat4 viewProjection) {
+	int slot = culler.frame % OCCLUSION_RING;
+
+	glUseProgram(culler.program);
+	glBindVertexArray(culler.VAO);
+	glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+	glDepthMask(GL_FALSE);
+	// Back faces count too, in case the near plane cuts into the box
+	glDisable(GL_CULL_FACE);
+
+	GLint mvpLoc = glGetUniformLocation(culler.program, "mvp");
+
+	for (auto& entry : culler.states) {
+		OcclusionState& state = entry.second;
+		Entity entity = entry.first;
+
+		harvestOcclusionSlot(culler, state, slot);
+
+		glm::mat4 boxMat = glm::translate(store->world[entity], store->localMin[entity]);
+		boxMat = glm::scale(boxMat, store->localMax[entity] - store->localMin[entity]);
+		glm::mat4 mvp = viewProjection * boxMat;
+		glUniformMatrix4fv(mvpLoc, 1, GL_FALSE, glm::value_ptr(mvp));
+
+		glBeginQuery(GL_ANY_SAMPLES_PASSED_CONSERVATIVE, state.testQuery[slot]);
+		glDrawElements(GL_TRIANGLES, 36, GL_UNSIGNED_INT, 0);
+		glEndQuery(GL_ANY_SAMPLES_PASSED_CONSERVATIVE);
+
+		state.testIssued[slot] = true;
+		state.drawIssued[slot] = false;
+		culler.current.queriesIssued++;
+	}
+
+	glEnable(GL_CULL_FACE);
+	glDepthMask(GL_TRUE);
+	glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+	glBindVertexArray(0);
+	culler.testsIssuedThisFrame = true;
+}
+
+// Draws one layer of a model only if its box was visible last frame, the GPU decides so there is no readback stall
+// Sample counts for false positives are only taken on the opaque layer
+void drawOccludee(OcclusionCuller& culler, Entity entity, model& m,
+	MaterialPrograms programs, glm::vec3 camPos, bool transparent_layer = false) {
+	OcclusionState& state = culler.states.at(entity);
+	int slot = (culler.frame + OCCLUSION_RING - 1) % OCCLUSION_RING;
+
+	if (culler.frame == 0 || !state.testIssued[slot] || cameraInsideBounds(m, camPos)) {
+		m.drawLayer(programs, transparent_layer);
+		return;
+	}
+
+	if (transparent_layer) {
+		glBeginConditionalRender(state.testQuery[slot], GL_QUERY_NO_WAIT);
+		m.drawLayer(programs, true);
+		glEndConditionalRender();
+		return;
+	}
+
+	glBeginQuery(GL_ANY_SAMPLES_PASSED, state.drawQuery[slot]);
+	glBeginConditionalRender(state.testQuery[slot], GL_QUERY_NO_WAIT);
+	m.drawLayer(programs, false);
+	glEndConditionalRender();
+	glEndQuery(GL_ANY_SAMPLES_PASSED);
+
+	state.drawIssued[slot] = true;
+}
+
+bool isOccludee(const OcclusionCuller& culler, Entity entity) {
+	return culler.states.find(entity) != culler.states.end();
+}
+
+void endOcclusionFrame(OcclusionCuller& culler) {
+	// With culling off or on a path without tests, this frame's slot still holds queries from frames ago
+	// Cleared, so the next frame draws unconditionally and nothing harvests the old results
+	if (!culler.testsIssuedThisFrame) {
+		int slot = culler.frame % OCCLUSION_RING;
+		for (auto& entry : culler.states) {
+			entry.second.testIssued[slot] = false;
+			entry.second.drawIssued[slot] = false;
+		}
+	}
+	culler.testsIssuedThisFrame = false;
+
+	culler.lastFrame = culler.current;
+	culler.total.queriesIssued += culler.current.queriesIssued;
+	culler.total.objectsSkipped += culler.current.objectsSkipped;
+	culler.total.falsePositives += culler.current.falsePositives;
+	culler.current = OcclusionStats();
+	culler.frame++;
+}
+
+void printOcclusionStats(const OcclusionCuller& culler, FILE* out) {
+	fprintf(out, "Occlusion: %u queries issued, %u objects skipped, %u false positives\n",
+		culler.total.queriesIssued, culler.total.objectsSkipped, culler.total.falsePositives);
+}
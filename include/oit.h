@@ -0,0 +1,88 @@
+#pragma once
+
+#include <GL/gl3w.h>
+
+#include "framebuffer.h"
+#include "gpu_resource.h"
+#include "memory_stats.h"
+
+// Weighted blended order-independent transparency targets
+// Accumulation and revealage share the scene's depth, so transparent fragments are still hidden by opaque ones
+struct OITStruct
+{
+	GpuFramebuffer FBO;
+	GpuTexture Accum;
+	GpuTexture Reveal;
+	unsigned int compositeProgram;
+	GpuVertexArray VAO;
+};
+
+OITStruct setup_oit(const SceneStruct& scene, unsigned int compositeProgram)
+{
+	OITStruct oit;
+	oit.compositeProgram = compositeProgram;
+
+	oit.Accum = createTexture();
+	glBindTexture(GL_TEXTURE_2D_MULTISAMPLE, oit.Accum);
+	trackedTexImage2DMultisample(oit.Accum, scene.samples, GL_RGBA16F, scene.width, scene.height, MEMORY_RENDER_TARGETS, "OIT accumulation");
+
+	oit.Reveal = createTexture();
+	glBindTexture(GL_TEXTURE_2D_MULTISAMPLE, oit.Reveal);
+	trackedTexImage2DMultisample(oit.Reveal, scene.samples, GL_R8, scene.width, scene.height, MEMORY_RENDER_TARGETS, "OIT revealage");
+	glBindTexture(GL_TEXTURE_2D_MULTISAMPLE, 0);
+
+	oit.FBO = createFramebuffer();
+	glBindFramebuffer(GL_FRAMEBUFFER, oit.FBO);
+	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D_MULTISAMPLE, oit.Accum, 0);
+	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1, GL_TEXTURE_2D_MULTISAMPLE, oit.Reveal, 0);
+	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D_MULTISAMPLE, scene.Depth, 0);
+	GLenum buffers[] = { GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1 };
+	glDrawBuffers(2, buffers);
+	if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+		fprintf(stderr, "OIT framebuffer incomplete\n");
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+	// Full screen triangle is generated from gl_VertexID, but core profile still needs a VAO bound
+	oit.VAO = createVertexArray();
+
+	return oit;
+}
+
+// Clears the targets and sets up additive accumulation, depth is tested but not written
+void beginOIT(const OITStruct& oit)
+{
+	static const GLfloat zero[] = { 0.f, 0.f, 0.f, 0.f };
+	static const GLfloat one[] = { 1.f, 1.f, 1.f, 1.f };
+
+	glBindFramebuffer(GL_FRAMEBUFFER, oit.FBO);
+	glClearBufferfv(GL_COLOR, 0, zero);
+	glClearBufferfv(GL_COLOR, 1, one);
+
+	glDepthMask(GL_FALSE);
+	glEnable(GL_BLEND);
+	glBlendFunci(0, GL_ONE, GL_ONE);
+	glBlendFunci(1, GL_ZERO, GL_ONE_MINUS_SRC_COLOR);
+}
+
+// Resolves the accumulated transparency over the opaque scene in a single full screen pass
+void compositeOIT(const OITStruct& oit, const SceneStruct& scene)
+{
+	glBindFramebuffer(GL_FRAMEBUFFER, scene.FBO);
+	glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+	glDisable(GL_DEPTH_TEST);
+
+	glUseProgram(oit.compositeProgram);
+	glActiveTexture(GL_TEXTURE2);
+	glBindTexture(GL_TEXTURE_2D_MULTISAMPLE, oit.Accum);
+	glUniform1i(glGetUniformLocation(oit.compositeProgram, "accumTexture"), 2);
+	glActiveTexture(GL_TEXTURE3);
+	glBindTexture(GL_TEXTURE_2D_MULTISAMPLE, oit.Reveal);
+	glUniform1i(glGetUniformLocation(oit.compositeProgram, "revealTexture"), 3);
+
+	glBindVertexArray(oit.VAO);
+	glDrawArrays(GL_TRIANGLES, 0, 3);
+	glBindVertexArray(0);
+
+	glEnable(GL_DEPTH_TEST);
+	glDepthMask(GL_TRUE);
+}
@@ -0,0 +1,129 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Command line settings, the defaults are the interactive window
+struct RunOptions {
+	bool headless = false;
+	int width = 1920;
+	int height = 1080;
+	int samples = 8;
+	// Headless only, 0 runs until the window is closed
+	unsigned int frames = 0;
+	// Seconds of animation per frame in headless runs, measured frame time otherwise
+	double timestep = 1.0 / 60.0;
+	double hitchThresholdMs = 33.3;
+	// Forward, deferred or visibility, -1 keeps the default
+	int shadingPath = -1;
+	// Bezier flythrough that replaces input, and where to save the interactive camera as one
+	const char* cameraPath = NULL;
+	const char* recordPath = NULL;
+	float cameraSpeed = 1.f;
+	// Placements of the instanced chair mesh
+	int instances = 100;
+	// Times the Bezier engine against casteljau.h and exits without opening a window
+	bool benchBezier = false;
+	// Keeps every mesh's parsed geometry on the CPU after upload, instead of only the entities flagged to keep it
+	bool keepGeometry = false;
+	// Times entity updates and culling at this many entities and exits, 0 runs the renderer
+	int benchEntities = 0;
+	// Megabytes the tracked GPU estimate and CPU allocations may reach, 0 for no budget
+	double gpuBudgetMB = 0.0;
+	double cpuBudgetMB = 0.0;
+};
+
+void printUsage(const char* program)
+{
+	printf("Usage: %s [--bench-bezier] [--headless] [--frames N] [--width W] [--height H] [--samples S]\n"
+		"       [--timestep SECONDS] [--hitch-ms MS] [--path forward|deferred|visibility]\n"
+		"       [--camera-path FILE] [--camera-speed UNITS_PER_SECOND] [--record-path FILE] [--instances N]\n"
+		"       [--bench-entities N] [--keep-geometry] [--gpu-budget-mb MB] [--cpu-budget-mb MB]\n", program);
+}
+
+RunOptions parse_run_options(int argc, char** argv)
+{
+	RunOptions options;
+	for (int i = 1; i < argc; i++) {
+		const char* arg = argv[i];
+		const char* value = i + 1 < argc ? argv[i + 1] : NULL;
+
+		if (strcmp(arg, "--headless") == 0) {
+			options.headless = true;
+			continue;
+		}
+		if (strcmp(arg, "--bench-bezier") == 0) {
+			options.benchBezier = true;
+			continue;
+		}
+		if (strcmp(arg, "--keep-geometry") == 0) {
+			options.keepGeometry = true;
+			continue;
+		}
+		if (strcmp(arg, "--help") == 0) {
+			printUsage(argv[0]);
+			exit(0);
+		}
+		if (value == NULL) {
+			fprintf(stderr, "Missing value for %s\n", arg);
+			printUsage(argv[0]);
+			exit(1);
+		}
+
+		if (strcmp(arg, "--frames") == 0)
+			options.frames = (unsigned int)atoi(value);
+		else if (strcmp(arg, "--width") == 0)
+			options.width = atoi(value);
+		else if (strcmp(arg, "--height") == 0)
+			options.height = atoi(value);
+		else if (strcmp(arg, "--samples") == 0)
+			options.samples = atoi(value);
+		else if (strcmp(arg, "--timestep") == 0)
+			options.timestep = atof(value);
+		else if (strcmp(arg, "--hitch-ms") == 0)
+			options.hitchThresholdMs = atof(value);
+		else if (strcmp(arg, "--camera-path") == 0)
+			options.cameraPath = value;
+		else if (strcmp(arg, "--record-path") == 0)
+			options.recordPath = value;
+		else if (strcmp(arg, "--camera-speed") == 0)
+			options.cameraSpeed = (float)atof(value);
+		else if (strcmp(arg, "--instances") == 0)
+			options.instances = atoi(value);
+		else if (strcmp(arg, "--bench-entities") == 0)
+			options.benchEntities = atoi(value);
+		else if (strcmp(arg, "--gpu-budget-mb") == 0)
+			options.gpuBudgetMB = atof(value);
+		else if (strcmp(arg, "--cpu-budget-mb") == 0)
+			options.cpuBudgetMB = atof(value);
+		else if (strcmp(arg, "--path") == 0) {
+			if (strcmp(value, "forward") == 0)
+				options.shadingPath = 0;
+			else if (strcmp(value, "deferred") == 0)
+				options.shadingPath = 1;
+			else if (strcmp(value, "visibility") == 0)
+				options.shadingPath = 2;
+			else
+				fprintf(stderr, "Unknown shading path %s\n", value);
+		}
+		else {
+			fprintf(stderr, "Unknown option %s\n", arg);
+			printUsage(argv[0]);
+			exit(1);
+		}
+		i++;
+	}
+
+	if (options.width <= 0 || options.height <= 0 || options.samples <= 0 || options.timestep <= 0.0 || options.cameraSpeed <= 0.f ||
+		options.instances < 0 || options.benchEntities < 0 || options.gpuBudgetMB < 0.0 || options.cpuBudgetMB < 0.0) {
+		fprintf(stderr, "Invalid resolution, sample count, timestep, camera speed, instance or entity count, or memory budget\n");
+		exit(1);
+	}
+
+	// A headless run always ends on its own, with a camera path after one pass along it
+	if (options.headless && options.frames == 0 && options.cameraPath == NULL)
+		options.frames = 600;
+
+	return options;
+}
@@ -0,0 +1,99 @@
+#pragma once
+
+#include <GL/gl3w.h>
+
+#include <stdio.h>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "gpu_resource.h"
+
+// Queries are kept in a ring of 3 so results are read back without stalling
+#define PASS_TIMER_RING 3
+
+// A GPU query per render pass, either GL_TIME_ELAPSED (ms) or GL_SAMPLES_PASSED (samples)
+struct TimedPass {
+	GLenum target = GL_TIME_ELAPSED;
+	GpuQuery query[PASS_TIMER_RING];
+	bool issued[PASS_TIMER_RING] = { false, false, false };
+
+	double last = 0.0;
+	double total = 0.0;
+	unsigned int count = 0;
+};
+
+struct PassTimer {
+	unsigned int frame = 0;
+	std::vector<std::string> order;
+	std::unordered_map<std::string, TimedPass> passes;
+};
+
+void harvestTimedPass(TimedPass& pass, int slot) {
+	if (!pass.issued[slot])
+		return;
+
+	GLuint available = 0;
+	glGetQueryObjectuiv(pass.query[slot], GL_QUERY_RESULT_AVAILABLE, &available);
+	if (!available)
+		return;
+
+	GLuint64 result = 0;
+	glGetQueryObjectui64v(pass.query[slot], GL_QUERY_RESULT, &result);
+	pass.last = (pass.target == GL_TIME_ELAPSED) ? result / 1000000.0 : (double)result;
+	pass.total += pass.last;
+	pass.count++;
+	pass.issued[slot] = false;
+}
+
+// Only one query per target can be active, so passes of the same target must not overlap
+void beginTimedPass(PassTimer& timer, const std::string& name, GLenum target = GL_TIME_ELAPSED) {
+	auto found = timer.passes.find(name);
+	if (found == timer.passes.end()) {
+		TimedPass pass;
+		pass.target = target;
+		for (int slot = 0; slot < PASS_TIMER_RING; slot++)
+			pass.query[slot] = createQuery();
+		found = timer.passes.emplace(name, std::move(pass)).first;
+		timer.order.push_back(name);
+	}
+
+	TimedPass& pass = found->second;
+	int slot = timer.frame % PASS_TIMER_RING;
+	harvestTimedPass(pass, slot);
+
+	glBeginQuery(pass.target, pass.query[slot]);
+	pass.issued[slot] = true;
+}
+
+void endTimedPass(PassTimer& timer, const std::string& name) {
+	glEndQuery(timer.passes.at(name).target);
+}
+
+void endPassTimerFrame(PassTimer& timer) {
+	timer.frame++;
+}
+
+// Most recent result, 0 if the pass has not run yet
+double lastPass(const PassTimer& timer, const std::string& name) {
+	auto found = timer.passes.find(name);
+	return found == timer.passes.end() ? 0.0 : found->second.last;
+}
+
+double averagePass(const PassTimer& timer, const std::string& name) {
+	auto found = timer.passes.find(name);
+	if (found == timer.passes.end() || found->second.count == 0)
+		return 0.0;
+	return found->second.total / found->second.count;
+}
+
+void printPassTimes(const PassTimer& timer, FILE* out) {
+	for (const auto& name : timer.order) {
+		const TimedPass& pass = timer.passes.at(name);
+		if (pass.target == GL_TIME_ELAPSED)
+			fprintf(out, "  %-20s %8.3f ms avg over %u frames\n", name.c_str(), averagePass(timer, name), pass.count);
+		else
+			fprintf(out, "  %-20s %8.0f samples avg over %u frames\n", name.c_str(), averagePass(timer, name), pass.count);
+	}
+}
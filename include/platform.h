@@ -0,0 +1,45 @@
+#pragma once
+
+#include <stdio.h>
+
+// The tree is written against the Windows headers and MSVC's secure CRT, Linux builds get stand-ins for what it uses
+#ifdef _WIN32
+#include <windows.h>
+#include <wingdi.h>
+#else
+#include <errno.h>
+#include <stdint.h>
+
+typedef int errno_t;
+
+inline errno_t fopen_s(FILE** file, const char* filename, const char* mode)
+{
+	*file = fopen(filename, mode);
+	return *file == NULL ? errno : 0;
+}
+
+// Laid out as in wingdi.h, the file header is packed to 2 bytes there
+#pragma pack(push, 2)
+struct BITMAPFILEHEADER {
+	uint16_t bfType;
+	uint32_t bfSize;
+	uint16_t bfReserved1;
+	uint16_t bfReserved2;
+	uint32_t bfOffBits;
+};
+#pragma pack(pop)
+
+struct BITMAPINFOHEADER {
+	uint32_t biSize;
+	int32_t biWidth;
+	int32_t biHeight;
+	uint16_t biPlanes;
+	uint16_t biBitCount;
+	uint32_t biCompression;
+	uint32_t biSizeImage;
+	int32_t biXPelsPerMeter;
+	int32_t biYPelsPerMeter;
+	uint32_t biClrUsed;
+	uint32_t biClrImportant;
+};
+#endif
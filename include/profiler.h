@@ -0,0 +1,398 @@
+#pragma once
+
+#include <GL/gl3w.h>
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <stdio.h>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "gpu_resource.h"
+#include "platform.h"
+
+// GPU timestamps are read back 3 frames later so the CPU never waits on them
+#define PROFILER_GPU_RING 3
+// Trace events kept for export, later ones are counted but dropped
+#define PROFILER_MAX_EVENTS 1000000
+
+// Tracks in the exported trace, threads other than the main one get their own after these
+#define PROFILER_MAIN_TRACK 0
+#define PROFILER_GPU_TRACK 1
+
+struct ProfileEvent {
+	std::string name;
+	double startMs;
+	double durationMs;
+	int track;
+	int depth;
+	unsigned int frame;
+};
+
+// Top level scope totals of one frame, GPU ones arrive when the ring slot is read back
+struct ProfileFrame {
+	unsigned int frame = 0;
+	double cpuStartMs = 0.0;
+	double cpuMs = 0.0;
+	double gpuMs = 0.0;
+	bool gpuValid = false;
+	// Index of the first trace event recorded during the frame
+	size_t firstEvent = 0;
+	std::vector<std::pair<std::string, double>> cpuScopes;
+	std::vector<std::pair<std::string, double>> gpuScopes;
+};
+
+// Timestamp pairs issued during one frame
+struct GpuProfileSlot {
+	std::vector<GpuQuery> queries;
+	std::vector<std::pair<std::string, int>> scopes;
+	size_t used = 0;
+	unsigned int frame = 0;
+	bool pending = false;
+};
+
+struct Profiler {
+	bool enabled = true;
+	std::chrono::steady_clock::time_point epoch = std::chrono::steady_clock::now();
+	std::thread::id mainThread = std::this_thread::get_id();
+
+	std::mutex lock;
+	std::unordered_map<std::thread::id, int> tracks;
+	std::vector<ProfileEvent> events;
+	unsigned int droppedEvents = 0;
+
+	// Read by scopes on worker threads while the main thread advances it
+	std::atomic<unsigned int> frame{ 0 };
+	bool inFrame = false;
+	std::vector<ProfileFrame> frames;
+
+	// GPU clock in ms plus this offset gives the CPU clock, measured once in initProfilerGpu
+	bool gpuEnabled = false;
+	double gpuOffsetMs = 0.0;
+	GpuProfileSlot gpuSlots[PROFILER_GPU_RING];
+	std::vector<size_t> gpuStack;
+	unsigned int gpuFramesDropped = 0;
+};
+
+Profiler profiler;
+
+double profilerNow() {
+	return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - profiler.epoch).count();
+}
+
+// Call with the main context current, CPU scopes work before this
+void initProfilerGpu() {
+	GLint bits = 0;
+	glGetQueryiv(GL_TIMESTAMP, GL_QUERY_COUNTER_BITS, &bits);
+	if (bits == 0) {
+		printf("Profiler: GL_TIMESTAMP unsupported, GPU scopes disabled\n");
+		return;
+	}
+
+	GLint64 gpuNow = 0;
+	glGetInteger64v(GL_TIMESTAMP, &gpuNow);
+	profiler.gpuOffsetMs = profilerNow() - gpuNow / 1000000.0;
+	profiler.gpuEnabled = true;
+}
+
+void addProfileEvent(const ProfileEvent& event) {
+	std::lock_guard<std::mutex> guard(profiler.lock);
+	if (profiler.events.size() < PROFILER_MAX_EVENTS)
+		profiler.events.push_back(event);
+	else
+		profiler.droppedEvents++;
+}
+
+int profilerTrack() {
+	std::thread::id id = std::this_thread::get_id();
+	if (id == profiler.mainThread)
+		return PROFILER_MAIN_TRACK;
+
+	std::lock_guard<std::mutex> guard(profiler.lock);
+	auto found = profiler.tracks.find(id);
+	if (found == profiler.tracks.end())
+		found = profiler.tracks.emplace(id, PROFILER_GPU_TRACK + 1 + (int)profiler.tracks.size()).first;
+	return found->second;
+}
+
+// Nesting depth per thread, so scopes on the prewarm thread don't nest under the main thread's
+thread_local int profilerDepth = 0;
+
+// Times the enclosing block on the CPU
+struct ProfileScope {
+	const char* name;
+	double startMs;
+	int depth;
+
+	ProfileScope(const char* scopeName) : name(scopeName), startMs(0.0), depth(0) {
+		if (!profiler.enabled)
+			return;
+		depth = profilerDepth++;
+		startMs = profilerNow();
+	}
+
+	~ProfileScope() {
+		if (!profiler.enabled)
+			return;
+		profilerDepth--;
+
+		ProfileEvent event;
+		event.name = name;
+		event.startMs = startMs;
+		event.durationMs = profilerNow() - startMs;
+		event.track = profilerTrack();
+		event.depth = depth;
+		event.frame = profiler.frame;
+		addProfileEvent(event);
+
+		// Per frame totals of the main thread's outermost scopes
+		if (event.track == PROFILER_MAIN_TRACK && profiler.inFrame && depth == 1)
+			profiler.frames.back().cpuScopes.push_back(std::make_pair(event.name, event.durationMs));
+	}
+};
+
+#define PROFILE_CONCAT_INNER(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT_INNER(a, b)
+#define PROFILE_SCOPE(name) ProfileScope PROFILE_CONCAT(profileScope, __LINE__)(name)
+
+// Timestamps around GPU work, main thread only
+void beginGpuScope(const char* name) {
+	if (!profiler.enabled || !profiler.gpuEnabled || !profiler.inFrame)
+		return;
+
+	GpuProfileSlot& slot = profiler.gpuSlots[profiler.frame % PROFILER_GPU_RING];
+	if (slot.used + 2 > slot.queries.size()) {
+		for (int i = 0; i < 16; i++)
+			slot.queries.push_back(createQuery());
+	}
+
+	glQueryCounter(slot.queries[slot.used], GL_TIMESTAMP);
+	profiler.gpuStack.push_back(slot.scopes.size());
+	slot.scopes.push_back(std::make_pair(std::string(name), (int)profiler.gpuStack.size() - 1));
+	slot.used += 2;
+}
+
+void endGpuScope() {
+	if (!profiler.enabled || !profiler.gpuEnabled || !profiler.inFrame || profiler.gpuStack.empty())
+		return;
+
+	GpuProfileSlot& slot = profiler.gpuSlots[profiler.frame % PROFILER_GPU_RING];
+	size_t scope = profiler.gpuStack.back();
+	profiler.gpuStack.pop_back();
+	glQueryCounter(slot.queries[scope * 2 + 1], GL_TIMESTAMP);
+}
+
+struct GpuProfileScope {
+	GpuProfileScope(const char* name) { beginGpuScope(name); }
+	~GpuProfileScope() { endGpuScope(); }
+};
+
+#define PROFILE_GPU_SCOPE(name) GpuProfileScope PROFILE_CONCAT(gpuProfileScope, __LINE__)(name)
+
+// Reads back a slot about to be reused, dropping it rather than waiting if the GPU is still behind
+void harvestGpuSlot(GpuProfileSlot& slot) {
+	if (!slot.pending)
+		return;
+	slot.pending = false;
+
+	// Timestamps complete in order, so the frame's last one tells whether all are ready
+	GLuint available = 0;
+	glGetQueryObjectuiv(slot.queries[1], GL_QUERY_RESULT_AVAILABLE, &available);
+	if (!available) {
+		profiler.gpuFramesDropped++;
+		return;
+	}
+
+	ProfileFrame& record = profiler.frames[slot.frame];
+	for (size_t i = 0; i < slot.scopes.size(); i++) {
+		GLuint64 begin = 0, end = 0;
+		glGetQueryObjectui64v(slot.queries[i * 2], GL_QUERY_RESULT, &begin);
+		glGetQueryObjectui64v(slot.queries[i * 2 + 1], GL_QUERY_RESULT, &end);
+
+		ProfileEvent event;
+		event.name = slot.scopes[i].first;
+		event.startMs = begin / 1000000.0 + profiler.gpuOffsetMs;
+		event.durationMs = (end - begin) / 1000000.0;
+		event.track = PROFILER_GPU_TRACK;
+		event.depth = slot.scopes[i].second;
+		event.frame = slot.frame;
+		addProfileEvent(event);
+
+		if (event.depth == 0) {
+			record.gpuMs = event.durationMs;
+			record.gpuValid = true;
+		}
+		else if (event.depth == 1)
+			record.gpuScopes.push_back(std::make_pair(event.name, event.durationMs));
+	}
+}
+
+// Opens the frame's outermost CPU and GPU scopes, paired with endProfilerFrame
+void beginProfilerFrame() {
+	if (!profiler.enabled)
+		return;
+
+	GpuProfileSlot& slot = profiler.gpuSlots[profiler.frame % PROFILER_GPU_RING];
+	harvestGpuSlot(slot);
+	slot.scopes.clear();
+	slot.used = 0;
+	slot.frame = profiler.frame;
+
+	ProfileFrame record;
+	record.frame = profiler.frame;
+	record.cpuStartMs = profilerNow();
+	{
+		std::lock_guard<std::mutex> guard(profiler.lock);
+		record.firstEvent = profiler.events.size();
+	}
+	profiler.frames.push_back(record);
+	profiler.inFrame = true;
+
+	// Frame scopes are depth 0, anything the frame calls is depth 1
+	profilerDepth++;
+	beginGpuScope("frame");
+}
+
+void endProfilerFrame() {
+	if (!profiler.enabled)
+		return;
+
+	endGpuScope();
+	profilerDepth--;
+
+	GpuProfileSlot& slot = profiler.gpuSlots[profiler.frame % PROFILER_GPU_RING];
+	slot.pending = profiler.gpuEnabled && !slot.scopes.empty();
+
+	ProfileFrame& record = profiler.frames.back();
+	record.cpuMs = profilerNow() - record.cpuStartMs;
+
+	ProfileEvent event;
+	event.name = "frame";
+	event.startMs = record.cpuStartMs;
+	event.durationMs = record.cpuMs;
+	event.track = PROFILER_MAIN_TRACK;
+	event.depth = 0;
+	event.frame = profiler.frame;
+	addProfileEvent(event);
+
+	profiler.inFrame = false;
+	profiler.frame++;
+}
+
+// The profiler outlives main's context, so its queries are handed back while the context is still current
+void releaseProfilerQueries() {
+	for (auto& slot : profiler.gpuSlots) {
+		slot.queries.clear();
+		slot.scopes.clear();
+		slot.used = 0;
+		slot.pending = false;
+	}
+}
+
+// Waits for the GPU and reads back every slot still in flight, call before exporting
+void finishProfiler() {
+	if (!profiler.enabled || !profiler.gpuEnabled)
+		return;
+
+	glFinish();
+	for (unsigned int i = 0; i < PROFILER_GPU_RING; i++)
+		harvestGpuSlot(profiler.gpuSlots[(profiler.frame + i) % PROFILER_GPU_RING]);
+	releaseProfilerQueries();
+}
+
+void writeJsonString(FILE* f, const std::string& s) {
+	fputc('"', f);
+	for (char c : s) {
+		if (c == '"' || c == '\\')
+			fputc('\\', f);
+		fputc(c, f);
+	}
+	fputc('"', f);
+}
+
+// Chrome trace event format, open with chrome://tracing or ui.perfetto.dev
+void exportChromeTrace(const char* filename) {
+	FILE* f;
+	fopen_s(&f, filename, "w");
+	if (f == NULL) {
+		fprintf(stderr, "Could not write %s\n", filename);
+		return;
+	}
+
+	std::lock_guard<std::mutex> guard(profiler.lock);
+	fprintf(f, "{\"traceEvents\":[\n");
+	fprintf(f, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"Main thread\"}},\n", PROFILER_MAIN_TRACK);
+	fprintf(f, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"GPU\"}}", PROFILER_GPU_TRACK);
+	for (const auto& event : profiler.events) {
+		fprintf(f, ",\n{\"name\":");
+		writeJsonString(f, event.name);
+		fprintf(f, ",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"frame\":%u}}",
+			event.track, event.startMs * 1000.0, event.durationMs * 1000.0, event.frame);
+	}
+	fprintf(f, "\n]}\n");
+	fclose(f);
+
+	printf("Wrote %zu trace events to %s\n", profiler.events.size(), filename);
+}
+
+// One row per frame, a column per outermost CPU and GPU scope
+void exportFrameCsv(const char* filename) {
+	FILE* f;
+	fopen_s(&f, filename, "w");
+	if (f == NULL) {
+		fprintf(stderr, "Could not write %s\n", filename);
+		return;
+	}
+
+	std::vector<std::string> columns;
+	std::unordered_map<std::string, size_t> columnIndex;
+	for (const auto& record : profiler.frames) {
+		for (const auto& scope : record.cpuScopes) {
+			std::string column = "cpu " + scope.first;
+			if (columnIndex.emplace(column, columns.size()).second)
+				columns.push_back(column);
+		}
+		for (const auto& scope : record.gpuScopes) {
+			std::string column = "gpu " + scope.first;
+			if (columnIndex.emplace(column, columns.size()).second)
+				columns.push_back(column);
+		}
+	}
+
+	fprintf(f, "frame,cpu_ms,gpu_ms");
+	for (const auto& column : columns)
+		fprintf(f, ",%s", column.c_str());
+	fprintf(f, "\n");
+
+	std::vector<double> row;
+	for (const auto& record : profiler.frames) {
+		row.assign(columns.size(), 0.0);
+		for (const auto& scope : record.cpuScopes)
+			row[columnIndex.at("cpu " + scope.first)] += scope.second;
+		for (const auto& scope : record.gpuScopes)
+			row[columnIndex.at("gpu " + scope.first)] += scope.second;
+
+		if (record.gpuValid)
+			fprintf(f, "%u,%.4f,%.4f", record.frame, record.cpuMs, record.gpuMs);
+		else
+			fprintf(f, "%u,%.4f,", record.frame, record.cpuMs);
+		for (double value : row)
+			fprintf(f, ",%.4f", value);
+		fprintf(f, "\n");
+	}
+	fclose(f);
+
+	printf("Wrote %zu frames to %s\n", profiler.frames.size(), filename);
+}
+
+void printProfilerSummary(FILE* out) {
+	fprintf(out, "Profiler: %u frames, %zu events", profiler.frame.load(), profiler.events.size());
+	if (profiler.droppedEvents > 0)
+		fprintf(out, " (%u over the cap dropped)", profiler.droppedEvents);
+	if (profiler.gpuFramesDropped > 0)
+		fprintf(out, ", %u GPU frames not ready in time", profiler.gpuFramesDropped);
+	fprintf(out, "\n");
+}
@@ -0,0 +1,145 @@
+#pragma once
+
+#include <GL/gl3w.h>
+
+#include <atomic>
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+#ifdef _WIN32
+#include <direct.h>
+#else
+#include <sys/stat.h>
+#endif
+
+#include "platform.h"
+
+// On-disk cache of linked program binaries, so launches after the first skip GLSL compilation
+#define PROGRAM_CACHE_DIR "shader_cache"
+
+struct ProgramCacheStats {
+	std::atomic<unsigned int> hits{ 0 };
+	std::atomic<unsigned int> misses{ 0 };
+	std::atomic<unsigned int> rejected{ 0 };
+};
+
+ProgramCacheStats programCacheStats;
+
+// Vendor, renderer and version, part of every key since binaries only load on the driver that made them
+// Empty while the cache is disabled
+std::string programCacheDriver;
+
+// Call once on the main context before compiling anything
+void InitProgramCache() {
+	GLint formats = 0;
+	glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+	if (formats == 0) {
+		printf("Program binary cache disabled, driver has no binary formats\n");
+		return;
+	}
+
+	programCacheDriver = std::string((const char*)glGetString(GL_VENDOR)) + "|" +
+		(const char*)glGetString(GL_RENDERER) + "|" + (const char*)glGetString(GL_VERSION);
+
+#ifdef _WIN32
+	_mkdir(PROGRAM_CACHE_DIR);
+#else
+	mkdir(PROGRAM_CACHE_DIR, 0755);
+#endif
+}
+
+// FNV-1a over the driver string and the sources after defines were injected
+uint64_t HashProgramSources(const char* vsSource, const char* fsSource) {
+	uint64_t hash = 14695981039346656037ull;
+	const char* parts[] = { programCacheDriver.c_str(), vsSource, fsSource };
+
+	for (const char* part : parts) {
+		for (const char* c = part; c != NULL && *c != '\0'; c++) {
+			hash ^= (unsigned char)*c;
+			hash *= 1099511628211ull;
+		}
+		// Separator so moving text between the parts changes the hash
+		hash ^= 0xff;
+		hash *= 1099511628211ull;
+	}
+
+	return hash;
+}
+
+std::string ProgramCachePath(uint64_t key) {
+	char path[64];
+	snprintf(path, sizeof(path), PROGRAM_CACHE_DIR "/%016llx.bin", (unsigned long long)key);
+	return path;
+}
+
+// Returns 0 on a miss, or when the driver rejects the stored blob
+GLuint LoadProgramBinary(uint64_t key) {
+	if (programCacheDriver.empty())
+		return 0;
+
+	FILE* f;
+	fopen_s(&f, ProgramCachePath(key).c_str(), "rb");
+	if (f == NULL) {
+		programCacheStats.misses++;
+		return 0;
+	}
+
+	GLenum format = 0;
+	fseek(f, 0, SEEK_END);
+	long size = ftell(f) - (long)sizeof(format);
+	rewind(f);
+
+	std::vector<char> blob(size > 0 ? size : 0);
+	bool read = size > 0 && fread(&format, sizeof(format), 1, f) == 1 && fread(blob.data(), 1, size, f) == (size_t)size;
+	fclose(f);
+
+	if (!read) {
+		programCacheStats.rejected++;
+		return 0;
+	}
+
+	GLuint program = glCreateProgram();
+	glProgramBinary(program, format, blob.data(), (GLsizei)size);
+
+	GLint success = 0;
+	glGetProgramiv(program, GL_LINK_STATUS, &success);
+	if (!success) {
+		// Usually a driver update, fall back to compiling and overwrite the blob
+		glDeleteProgram(program);
+		programCacheStats.rejected++;
+		return 0;
+	}
+
+	programCacheStats.hits++;
+	return program;
+}
+
+void SaveProgramBinary(GLuint program, uint64_t key) {
+	if (programCacheDriver.empty())
+		return;
+
+	GLint length = 0;
+	glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &length);
+	if (length <= 0)
+		return;
+
+	std::vector<char> blob(length);
+	GLenum format = 0;
+	glGetProgramBinary(program, length, NULL, &format, blob.data());
+
+	FILE* f;
+	fopen_s(&f, ProgramCachePath(key).c_str(), "wb");
+	if (f == NULL)
+		return;
+
+	fwrite(&format, sizeof(format), 1, f);
+	fwrite(blob.data(), 1, blob.size(), f);
+	fclose(f);
+}
+
+void printProgramCacheStats(FILE* out) {
+	fprintf(out, "Program cache: %u hits, %u misses, %u rejected\n",
+		programCacheStats.hits.load(), programCacheStats.misses.load(), programCacheStats.rejected.load());
+}
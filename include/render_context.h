@@ -0,0 +1,230 @@
+#pragma once
+
+#include <GL/gl3w.h>
+#include <GLFW/glfw3.h>
+
+#include <stdio.h>
+#include <string.h>
+
+// Linux headless runs make their context with EGL, so they need neither a display server nor a GPU
+// Mesa's llvmpipe covers the no GPU case, it is picked up with LIBGL_ALWAYS_SOFTWARE=1 or when there is no GPU driver
+#ifdef __linux__
+#define RENDER_CONTEXT_EGL
+#define EGL_NO_X11
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#endif
+
+// The GL context of a run, a GLFW window or on Linux in headless runs an EGL context with no window
+struct RenderContext {
+	GLFWwindow* window = NULL;
+#ifdef RENDER_CONTEXT_EGL
+	EGLDisplay display = EGL_NO_DISPLAY;
+	EGLContext context = EGL_NO_CONTEXT;
+	// A 1 x 1 pbuffer when the driver can't make a context current without a surface
+	EGLSurface surface = EGL_NO_SURFACE;
+	EGLConfig config = NULL;
+#endif
+};
+
+#ifdef RENDER_CONTEXT_EGL
+bool hasExtension(const char* extensions, const char* name)
+{
+	if (extensions == NULL)
+		return false;
+	size_t length = strlen(name);
+	for (const char* found = strstr(extensions, name); found != NULL; found = strstr(found + length, name)) {
+		if ((found == extensions || found[-1] == ' ') && (found[length] == ' ' || found[length] == '\0'))
+			return true;
+	}
+	return false;
+}
+
+// The surfaceless platform needs no display at all, the default display is the fallback for drivers without it
+EGLDisplay openEglDisplay()
+{
+	const char* clientExtensions = eglQueryString(EGL_NO_DISPLAY, EGL_EXTENSIONS);
+	if (hasExtension(clientExtensions, "EGL_MESA_platform_surfaceless") && hasExtension(clientExtensions, "EGL_EXT_platform_base")) {
+		PFNEGLGETPLATFORMDISPLAYEXTPROC getPlatformDisplay = (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+		EGLDisplay display = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+		if (display != EGL_NO_DISPLAY && eglInitialize(display, NULL, NULL))
+			return display;
+	}
+
+	EGLDisplay display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+	if (display != EGL_NO_DISPLAY && eglInitialize(display, NULL, NULL))
+		return display;
+	return EGL_NO_DISPLAY;
+}
+
+// Shares objects with main when it is given, and uses its display and config
+bool createEglContext(RenderContext& context, const RenderContext* main)
+{
+	if (main == NULL) {
+		context.display = openEglDisplay();
+		if (context.display == EGL_NO_DISPLAY) {
+			fprintf(stderr, "Could not open an EGL display\n");
+			return false;
+		}
+
+		const EGLint configAttribs[] = {
+			EGL_SURFACE_TYPE, EGL_PBUFFER_BIT,
+			EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+			EGL_RED_SIZE, 8, EGL_GREEN_SIZE, 8, EGL_BLUE_SIZE, 8, EGL_ALPHA_SIZE, 8,
+			EGL_NONE
+		};
+		EGLint configs = 0;
+		if (!eglChooseConfig(context.display, configAttribs, &context.config, 1, &configs) || configs == 0) {
+			fprintf(stderr, "No EGL config renders OpenGL\n");
+			return false;
+		}
+	}
+	else {
+		context.display = main->display;
+		context.config = main->config;
+	}
+
+	eglBindAPI(EGL_OPENGL_API);
+	// The compatibility profile, like the default GLFW window on Windows
+	const EGLint contextAttribs[] = {
+		EGL_CONTEXT_MAJOR_VERSION, 4,
+		EGL_CONTEXT_MINOR_VERSION, 5,
+		EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_COMPATIBILITY_PROFILE_BIT,
+		EGL_NONE
+	};
+	context.context = eglCreateContext(context.display, context.config, main != NULL ? main->context : EGL_NO_CONTEXT, contextAttribs);
+	if (context.context == EGL_NO_CONTEXT) {
+		fprintf(stderr, "Could not create an OpenGL 4.5 context with EGL, error 0x%x\n", eglGetError());
+		return false;
+	}
+
+	// Everything is drawn into framebuffer objects, the pbuffer only exists to make the context current
+	if (!hasExtension(eglQueryString(context.display, EGL_EXTENSIONS), "EGL_KHR_surfaceless_context")) {
+		const EGLint pbufferAttribs[] = { EGL_WIDTH, 1, EGL_HEIGHT, 1, EGL_NONE };
+		context.surface = eglCreatePbufferSurface(context.display, context.config, pbufferAttribs);
+		if (context.surface == EGL_NO_SURFACE) {
+			fprintf(stderr, "Could not create an EGL pbuffer, error 0x%x\n", eglGetError());
+			return false;
+		}
+	}
+	return true;
+}
+
+GL3WglProc getEglProcAddress(const char* name)
+{
+	return (GL3WglProc)eglGetProcAddress(name);
+}
+#endif
+
+// Headless runs on Linux use EGL, everything else a GLFW window that headless runs keep hidden
+bool createRenderContext(RenderContext& context, int width, int height, const char* title, bool headless)
+{
+#ifdef RENDER_CONTEXT_EGL
+	if (headless)
+		return createEglContext(context, NULL);
+#endif
+
+	if (!glfwInit()) {
+		fprintf(stderr, "Could not initialise GLFW\n");
+		return false;
+	}
+
+	// Headless runs render into framebuffers only, the window just owns the context
+	if (headless)
+		glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+	context.window = glfwCreateWindow(width, height, title, NULL, NULL);
+	glfwDefaultWindowHints();
+	if (context.window == NULL) {
+		fprintf(stderr, "Could not create an OpenGL context\n");
+		glfwTerminate();
+		return false;
+	}
+	return true;
+}
+
+// A second context sharing objects with main, for another thread
+// Must be called from the main thread, which GLFW requires for creating the hidden window
+bool createSharedRenderContext(const RenderContext& main, RenderContext& shared)
+{
+#ifdef RENDER_CONTEXT_EGL
+	if (main.window == NULL)
+		return createEglContext(shared, &main);
+#endif
+
+	glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+	shared.window = glfwCreateWindow(1, 1, "Shared context", NULL, main.window);
+	glfwDefaultWindowHints();
+	return shared.window != NULL;
+}
+
+void makeRenderContextCurrent(const RenderContext& context)
+{
+#ifdef RENDER_CONTEXT_EGL
+	if (context.window == NULL) {
+		// The bound API is per thread, worker threads start on OpenGL ES
+		eglBindAPI(EGL_OPENGL_API);
+		eglMakeCurrent(context.display, context.surface, context.surface, context.context);
+		return;
+	}
+#endif
+	glfwMakeContextCurrent(context.window);
+}
+
+// Leaves the calling thread with no context current
+void clearRenderContext(const RenderContext& context)
+{
+#ifdef RENDER_CONTEXT_EGL
+	if (context.window == NULL) {
+		eglMakeCurrent(context.display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+		return;
+	}
+#endif
+	glfwMakeContextCurrent(NULL);
+}
+
+// Call with the context current
+bool loadGlFunctions(const RenderContext& context)
+{
+#ifdef RENDER_CONTEXT_EGL
+	if (context.window == NULL)
+		return gl3wInit2(getEglProcAddress) == GL3W_OK;
+#endif
+	return gl3wInit() == GL3W_OK;
+}
+
+// Headless contexts have no window to close
+bool renderContextShouldClose(const RenderContext& context)
+{
+	return context.window != NULL && glfwWindowShouldClose(context.window);
+}
+
+void destroySharedRenderContext(RenderContext& shared)
+{
+#ifdef RENDER_CONTEXT_EGL
+	if (shared.window == NULL) {
+		if (shared.surface != EGL_NO_SURFACE)
+			eglDestroySurface(shared.display, shared.surface);
+		eglDestroyContext(shared.display, shared.context);
+		shared = RenderContext();
+		return;
+	}
+#endif
+	glfwDestroyWindow(shared.window);
+	shared.window = NULL;
+}
+
+// Also shuts down GLFW or the EGL display, after every shared context is gone
+void destroyRenderContext(RenderContext& context)
+{
+#ifdef RENDER_CONTEXT_EGL
+	if (context.window == NULL) {
+		EGLDisplay display = context.display;
+		clearRenderContext(context);
+		destroySharedRenderContext(context);
+		eglTerminate(display);
+		return;
+	}
+#endif
+	glfwDestroyWindow(context.window);
+	glfwTerminate();
+}
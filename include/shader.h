@@ -1,13 +1,62 @@
 #pragma once
 
+#include <GL/gl3w.h>
+#include <GLFW/glfw3.h>
 
-GLuint CompileShader(const char* vsFilename, const char* fsFilename)
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "gpu_resource.h"
+#include "profiler.h"
+#include "program_cache.h"
+#include "render_context.h"
+
+// Inserts the preamble after the #version line, which has to stay first
+char* InjectDefines(char* source, const char* defines)
 {
+	if (source == NULL || defines == NULL || defines[0] == '\0')
+		return source;
+
+	const char* lineEnd = strchr(source, '\n');
+	size_t versionLength = lineEnd ? (size_t)(lineEnd - source) + 1 : strlen(source);
+	size_t definesLength = strlen(defines);
+	size_t restLength = strlen(source) - versionLength;
+
+	char* result = (char*)malloc(versionLength + definesLength + restLength + 1);
+	memcpy(result, source, versionLength);
+	memcpy(result + versionLength, defines, definesLength);
+	memcpy(result + versionLength + definesLength, source + versionLength, restLength + 1);
+
+	free(source);
+	return result;
+}
+
+// cacheHit, when given, is set to whether the program came from the binary cache instead of a compile
+GLuint CompileShader(const char* vsFilename, const char* fsFilename, const char* defines = NULL, bool* cacheHit = NULL)
+{
+	PROFILE_SCOPE("shader compile");
 	int success;
 	char infoLog[512];
 
+	char* vertexShaderSource = InjectDefines(read_file(vsFilename), defines);
+	char* fragmentShaderSource = InjectDefines(read_file(fsFilename), defines);
+
+	uint64_t cacheKey = HashProgramSources(vertexShaderSource, fragmentShaderSource);
+	GLuint cached = LoadProgramBinary(cacheKey);
+	if (cacheHit)
+		*cacheHit = cached != 0;
+	if (cached != 0) {
+		free(fragmentShaderSource);
+		free(vertexShaderSource);
+		return cached;
+	}
+
 	unsigned int vertexShader = glCreateShader(GL_VERTEX_SHADER);
-	char* vertexShaderSource = read_file(vsFilename);
 	glShaderSource(vertexShader, 1, &vertexShaderSource, NULL);
 	glCompileShader(vertexShader);
 	glGetShaderiv(vertexShader, GL_COMPILE_STATUS, &success);
@@ -17,7 +66,6 @@ GLuint CompileShader(const char* vsFilename, const char* fsFilename)
 	}
 
 	unsigned int fragmentShader = glCreateShader(GL_FRAGMENT_SHADER);
-	char* fragmentShaderSource = read_file(fsFilename);
 	glShaderSource(fragmentShader, 1, &fragmentShaderSource, NULL);
 	glCompileShader(fragmentShader);
 	glGetShaderiv(fragmentShader, GL_COMPILE_STATUS, &success);
@@ -29,12 +77,15 @@ GLuint CompileShader(const char* vsFilename, const char* fsFilename)
 	unsigned int program = glCreateProgram();
 	glAttachShader(program, vertexShader);
 	glAttachShader(program, fragmentShader);
+	glProgramParameteri(program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
 	glLinkProgram(program);
 	glGetProgramiv(program, GL_LINK_STATUS, &success);
 	if (!success) {
-		glGetShaderInfoLog(program, 512, NULL, infoLog);
+		glGetProgramInfoLog(program, 512, NULL, infoLog);
 		fprintf(stderr, "Shader Program Link Fail - %s\n", infoLog);
 	}
+	else
+		SaveProgramBinary(program, cacheKey);
 
 	free(fragmentShaderSource);
 	free(vertexShaderSource);
@@ -43,4 +94,287 @@ GLuint CompileShader(const char* vsFilename, const char* fsFilename)
 	glDeleteShader(fragmentShader);
 
 	return program;
-}
\ No newline at end of file
+}
+
+GLuint CompileComputeShader(const char* csFilename, const char* defines = NULL)
+{
+	PROFILE_SCOPE("shader compile");
+	int success;
+	char infoLog[512];
+
+	char* computeShaderSource = InjectDefines(read_file(csFilename), defines);
+
+	uint64_t cacheKey = HashProgramSources(computeShaderSource, "");
+	GLuint cached = LoadProgramBinary(cacheKey);
+	if (cached != 0) {
+		free(computeShaderSource);
+		return cached;
+	}
+
+	unsigned int computeShader = glCreateShader(GL_COMPUTE_SHADER);
+	glShaderSource(computeShader, 1, &computeShaderSource, NULL);
+	glCompileShader(computeShader);
+	glGetShaderiv(computeShader, GL_COMPILE_STATUS, &success);
+	if (!success) {
+		glGetShaderInfoLog(computeShader, 512, NULL, infoLog);
+		fprintf(stderr, "Compute Shader Compilation Fail - %s\n", infoLog);
+	}
+
+	unsigned int program = glCreateProgram();
+	glAttachShader(program, computeShader);
+	glProgramParameteri(program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+	glLinkProgram(program);
+	glGetProgramiv(program, GL_LINK_STATUS, &success);
+	if (!success) {
+		glGetProgramInfoLog(program, 512, NULL, infoLog);
+		fprintf(stderr, "Compute Program Link Fail - %s\n", infoLog);
+	}
+	else
+		SaveProgramBinary(program, cacheKey);
+
+	free(computeShaderSource);
+	glDeleteShader(computeShader);
+
+	return program;
+}
+
+// Vertex, tessellation control, tessellation evaluation and fragment stages
+GLuint CompileTessellationShader(const char* vsFilename, const char* tcsFilename, const char* tesFilename,
+	const char* fsFilename, const char* defines = NULL)
+{
+	PROFILE_SCOPE("shader compile");
+	int success;
+	char infoLog[512];
+
+	const char* filenames[] = { vsFilename, tcsFilename, tesFilename, fsFilename };
+	const GLenum stages[] = { GL_VERTEX_SHADER, GL_TESS_CONTROL_SHADER, GL_TESS_EVALUATION_SHADER, GL_FRAGMENT_SHADER };
+	const char* stageNames[] = { "Vertex", "Tessellation Control", "Tessellation Evaluation", "Fragment" };
+
+	char* sources[4];
+	for (int i = 0; i < 4; i++)
+		sources[i] = InjectDefines(read_file(filenames[i]), defines);
+
+	// The middle stages are folded into the second source of the hash
+	std::string rest;
+	for (int i = 1; i < 4; i++)
+		rest += sources[i] ? sources[i] : "";
+	uint64_t cacheKey = HashProgramSources(sources[0], rest.c_str());
+	GLuint program = LoadProgramBinary(cacheKey);
+	if (program != 0) {
+		for (int i = 0; i < 4; i++)
+			free(sources[i]);
+		return program;
+	}
+
+	unsigned int shaders[4];
+	program = glCreateProgram();
+	for (int i = 0; i < 4; i++) {
+		shaders[i] = glCreateShader(stages[i]);
+		glShaderSource(shaders[i], 1, &sources[i], NULL);
+		glCompileShader(shaders[i]);
+		glGetShaderiv(shaders[i], GL_COMPILE_STATUS, &success);
+		if (!success) {
+			glGetShaderInfoLog(shaders[i], 512, NULL, infoLog);
+			fprintf(stderr, "%s Shader Compilation Fail - %s\n", stageNames[i], infoLog);
+		}
+		glAttachShader(program, shaders[i]);
+	}
+
+	glProgramParameteri(program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+	glLinkProgram(program);
+	glGetProgramiv(program, GL_LINK_STATUS, &success);
+	if (!success) {
+		glGetProgramInfoLog(program, 512, NULL, infoLog);
+		fprintf(stderr, "Tessellation Program Link Fail - %s\n", infoLog);
+	}
+	else
+		SaveProgramBinary(program, cacheKey);
+
+	for (int i = 0; i < 4; i++) {
+		free(sources[i]);
+		glDeleteShader(shaders[i]);
+	}
+
+	return program;
+}
+
+enum LightType {
+	DIRECTIONAL_LIGHT,
+	POSITIONAL_LIGHT,
+	SPOT_LIGHT
+};
+
+enum ShadowFilter {
+	PCF_SHADOWS,
+	HARD_SHADOWS,
+	NO_SHADOWS
+};
+
+// Compile-time feature set of a shader, each feature becomes a #define in the preamble
+struct ShaderPermutation {
+	LightType light = DIRECTIONAL_LIGHT;
+	ShadowFilter shadow = PCF_SHADOWS;
+	bool textured = true;
+	bool weightedOIT = false;
+	bool clusteredLights = false;
+	// Deferred shading, writing the G-buffer or lighting from it
+	bool gbuffer = false;
+	bool deferredLighting = false;
+	// Transforms come from the instance buffer, see instancing.h
+	bool instanced = false;
+
+	unsigned int key() const {
+		return (unsigned int)light | ((unsigned int)shadow << 2) | ((unsigned int)textured << 4) |
+			((unsigned int)weightedOIT << 5) | ((unsigned int)clusteredLights << 6) |
+			((unsigned int)gbuffer << 7) | ((unsigned int)deferredLighting << 8) |
+			((unsigned int)instanced << 9);
+	}
+
+	std::string defines() const {
+		static const char* lightDefines[] = { "LIGHT_DIRECTIONAL", "LIGHT_POSITIONAL", "LIGHT_SPOT" };
+		static const char* shadowDefines[] = { "SHADOW_PCF", "SHADOW_HARD", "SHADOW_NONE" };
+
+		std::string preamble;
+		preamble += std::string("#define ") + lightDefines[light] + "\n";
+		preamble += std::string("#define ") + shadowDefines[shadow] + "\n";
+		if (textured)
+			preamble += "#define TEXTURED\n";
+		if (weightedOIT)
+			preamble += "#define WEIGHTED_OIT\n";
+		if (clusteredLights)
+			preamble += "#define CLUSTERED_LIGHTS\n";
+		if (gbuffer)
+			preamble += "#define GBUFFER\n";
+		if (deferredLighting)
+			preamble += "#define DEFERRED_LIGHTING\n";
+		if (instanced)
+			preamble += "#define INSTANCED\n";
+		return preamble;
+	}
+};
+
+// Permutations compiled on a hidden shared context, handed over to the main thread when done
+struct ShaderPrewarm {
+	RenderContext context;
+	std::thread worker;
+	std::mutex lock;
+	std::vector<std::pair<unsigned int, GLuint>> finished;
+	std::atomic<bool> done{ false };
+};
+
+// Programs built from one vertex/fragment pair, compiled on first use per permutation
+struct ShaderCache {
+	std::string vsFilename;
+	std::string fsFilename;
+	std::unordered_map<unsigned int, GpuProgram> programs;
+	std::shared_ptr<ShaderPrewarm> prewarm;
+
+	// First-use compiles on the main thread, these are the hitches prewarming is meant to remove
+	unsigned int mainThreadCompiles = 0;
+	double mainThreadCompileMs = 0.0;
+	// First uses the binary cache answered, cheap but still on the main thread
+	unsigned int mainThreadBinaryLoads = 0;
+	double mainThreadBinaryLoadMs = 0.0;
+};
+
+ShaderCache setup_shader_cache(const char* vsFilename, const char* fsFilename)
+{
+	ShaderCache cache;
+	cache.vsFilename = vsFilename;
+	cache.fsFilename = fsFilename;
+	return cache;
+}
+
+// Moves programs the prewarm thread has finished into the cache
+void CollectPrewarmedShaders(ShaderCache& cache)
+{
+	if (!cache.prewarm)
+		return;
+
+	std::lock_guard<std::mutex> guard(cache.prewarm->lock);
+	// Already compiled on demand before the worker got to it, the spare handle is dropped and its program deleted
+	for (const auto& entry : cache.prewarm->finished)
+		cache.programs.emplace(entry.first, GpuProgram(entry.second));
+	cache.prewarm->finished.clear();
+}
+
+GLuint GetShaderPermutation(ShaderCache& cache, const ShaderPermutation& permutation)
+{
+	auto found = cache.programs.find(permutation.key());
+	if (found != cache.programs.end())
+		return found->second;
+
+	CollectPrewarmedShaders(cache);
+	found = cache.programs.find(permutation.key());
+	if (found != cache.programs.end())
+		return found->second;
+
+	double start = profilerNow();
+	std::string defines = permutation.defines();
+	bool cacheHit = false;
+	GLuint program = CompileShader(cache.vsFilename.c_str(), cache.fsFilename.c_str(), defines.c_str(), &cacheHit);
+	cache.programs.emplace(permutation.key(), GpuProgram(program));
+
+	double ms = profilerNow() - start;
+	if (cacheHit) {
+		cache.mainThreadBinaryLoads++;
+		cache.mainThreadBinaryLoadMs += ms;
+	}
+	else {
+		cache.mainThreadCompiles++;
+		cache.mainThreadCompileMs += ms;
+		printf("Shader permutation %u compiled in %.1f ms\n", permutation.key(), ms);
+	}
+
+	return program;
+}
+
+// Compiles the given permutations in the background on a context sharing objects with mainContext
+// Must be called from the main thread, which GLFW requires for creating the hidden window
+void PrewarmShaderCache(ShaderCache& cache, const RenderContext& mainContext, const std::vector<ShaderPermutation>& permutations)
+{
+	std::vector<ShaderPermutation> pending;
+	for (const auto& permutation : permutations) {
+		if (cache.programs.find(permutation.key()) == cache.programs.end())
+			pending.push_back(permutation);
+	}
+	if (pending.empty())
+		return;
+
+	std::shared_ptr<ShaderPrewarm> prewarm = std::make_shared<ShaderPrewarm>();
+	if (!createSharedRenderContext(mainContext, prewarm->context))
+		return;
+	cache.prewarm = prewarm;
+
+	std::string vsFilename = cache.vsFilename;
+	std::string fsFilename = cache.fsFilename;
+	prewarm->worker = std::thread([prewarm, pending, vsFilename, fsFilename]() {
+		makeRenderContextCurrent(prewarm->context);
+
+		for (const auto& permutation : pending) {
+			std::string defines = permutation.defines();
+			GLuint program = CompileShader(vsFilename.c_str(), fsFilename.c_str(), defines.c_str());
+
+			// Make sure the program is complete before the main context may use it
+			glFinish();
+
+			std::lock_guard<std::mutex> guard(prewarm->lock);
+			prewarm->finished.push_back(std::make_pair(permutation.key(), program));
+		}
+
+		clearRenderContext(prewarm->context);
+		prewarm->done = true;
+	});
+}
+
+// Joins the prewarm thread and releases its context, call before destroyRenderContext
+void FinishShaderPrewarm(ShaderCache& cache)
+{
+	if (!cache.prewarm)
+		return;
+
+	cache.prewarm->worker.join();
+	CollectPrewarmedShaders(cache);
+	destroySharedRenderContext(cache.prewarm->context);
+	cache.prewarm.reset();
+}
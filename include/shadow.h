@@ -1,22 +1,38 @@
 #pragma once
 
+#include <algorithm>
+
 #include "bitmap.h"
+#include "gpu_resource.h"
+#include "memory_stats.h"
 
 struct ShadowStruct
 {
-	unsigned int FBO;
-	unsigned int Texture;
+	GpuFramebuffer FBO;
+	GpuTexture Texture;
+	// What was asked for, cut down to what the driver allows
+	int width, height;
 };
 
 ShadowStruct setup_shadowmap(int w, int h)
 {
 	ShadowStruct shadow;
+	// Software drivers such as llvmpipe stop well short of the sizes desktop GPUs take
+	GLint maxSize = 0;
+	glGetIntegerv(GL_MAX_TEXTURE_SIZE, &maxSize);
+	if (maxSize > 0 && (w > maxSize || h > maxSize)) {
+		printf("Shadow map: %dx%d is over the driver's %d limit, clamped\n", w, h, maxSize);
+		w = std::min(w, (int)maxSize);
+		h = std::min(h, (int)maxSize);
+	}
+	shadow.width = w;
+	shadow.height = h;
 
-	glGenFramebuffers(1, &shadow.FBO);
+	shadow.FBO = createFramebuffer();
 	glBindFramebuffer(GL_FRAMEBUFFER, shadow.FBO);
-	glGenTextures(1, &shadow.Texture);
+	shadow.Texture = createTexture();
 	glBindTexture(GL_TEXTURE_2D, shadow.Texture);
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT, w, h, 0, GL_DEPTH_COMPONENT, GL_FLOAT, NULL);
+	trackedTexImage2D(shadow.Texture, 0, GL_DEPTH_COMPONENT, w, h, GL_DEPTH_COMPONENT, GL_FLOAT, NULL, MEMORY_SHADOW_MAP, "shadow map");
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_BORDER);
@@ -34,6 +50,8 @@ ShadowStruct setup_shadowmap(int w, int h)
 
 void saveShadowMapToBitmap(unsigned int Texture, int w, int h)
 {
+	// Float depth plus 24 bit colour, seven bytes a texel, which adds up fast at shadow map sizes
+	setCpuMemory(MEMORY_READBACK, "shadow map readback", (sizeof(float) + 3) * (size_t)w * h);
 	float* pixelBuffer = (float*)malloc(sizeof(float) * w * h);// [] ;
 	glBindTexture(GL_TEXTURE_2D, Texture);
 	glGetTexImage(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT, GL_FLOAT, pixelBuffer);
@@ -74,4 +92,5 @@ void saveShadowMapToBitmap(unsigned int Texture, int w, int h)
 
 	free(charBuffer);
 	free(pixelBuffer);
+	setCpuMemory(MEMORY_READBACK, "shadow map readback", 0);
 }
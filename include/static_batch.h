@@ -0,0 +1,216 @@
+#pragma once
+
+#include <GL/gl3w.h>
+#include <glm/glm.hpp>
+#include <glm/gtc/type_ptr.hpp>
+
+#include <algorithm>
+#include <map>
+#include <stdio.h>
+#include <unordered_map>
+#include <vector>
+
+#include "entities.h"
+#include "gpu_resource.h"
+#include "memory_stats.h"
+#include "model.h"
+
+// Every batched triangle of one material, drawn with a single call
+struct StaticBatchRange {
+	GLint first;
+	GLsizei count;
+	GLuint texture;
+	bool textured;
+	bool transparent;
+};
+
+// Models that never move, with their transforms baked into merged world space buffers
+// The models keep their own buffers, so they can still be drawn one by one when batching is off
+struct StaticBatch {
+	GpuVertexArray VAO, depthVAO;
+	GpuBuffer VBO, partVBO;
+	GpuBuffer depthVBO, depthEBO;
+	GLsizei opaqueIndexCount;
+	GLsizei depthIndexCount;
+
+	// Opaque ranges first
+	std::vector<StaticBatchRange> ranges;
+	std::vector<Entity> entities;
+};
+
+bool isStaticBatched(const StaticBatch& batch, Entity entity)
+{
+	return std::find(batch.entities.begin(), batch.entities.end(), entity) != batch.entities.end();
+}
+
+// Bakes each entity's world matrix into its mesh's vertices and merges them by texture and layer
+// Untextured materials share a range, their colours are already per vertex
+StaticBatch setup_static_batch(EntityStore* store, const std::vector<Entity>& entities)
+{
+	PROFILE_SCOPE("static batch");
+	StaticBatch batch;
+
+	// Keyed by (transparent, texture), texture 0 for untextured
+	std::map<std::pair<bool, GLuint>, std::vector<vertex>> buckets;
+	size_t modelBytes = 0, modelDraws = 0;
+	for (Entity entity : entities) {
+		const model& m = store->meshes[store->mesh[entity]];
+		if (!m.hasCpuGeometry()) {
+			fprintf(stderr, "Static batch: %s has released its CPU geometry, left unbatched\n", store->names[entity].c_str());
+			continue;
+		}
+		batch.entities.push_back(entity);
+		glm::mat4 modelMat = store->world[entity];
+		glm::mat3 normalMat = glm::transpose(glm::inverse(glm::mat3(modelMat)));
+		const std::vector<vertex>& vertices = m.getVertices();
+		std::vector<int> vertexMaterials = m.getVertexMaterials();
+
+		for (size_t i = 0; i < vertices.size(); i++) {
+			int mtl_id = vertexMaterials[i];
+			bool textured = m.isTexturedMaterial(mtl_id);
+			std::pair<bool, GLuint> key(m.isTransparentMaterial(mtl_id), textured ? m.getMaterialTexture(mtl_id) : 0);
+
+			vertex v = vertices[i];
+			v.pos = glm::vec3(modelMat * glm::vec4(v.pos, 1.f));
+			v.nor = normalMat * v.nor;
+			buckets[key].push_back(v);
+		}
+		modelBytes += vertices.size() * sizeof(vertex);
+		modelDraws += m.colourDrawCount();
+	}
+
+	// Map order puts every opaque bucket before the transparent ones
+	std::vector<vertex> merged;
+	for (const auto& bucket : buckets) {
+		StaticBatchRange range;
+		range.first = (GLint)merged.size();
+		range.count = (GLsizei)bucket.second.size();
+		range.texture = bucket.first.second;
+		range.textured = bucket.first.second != 0;
+		range.transparent = bucket.first.first;
+		batch.ranges.push_back(range);
+		merged.insert(merged.end(), bucket.second.begin(), bucket.second.end());
+	}
+
+	// Same de-duplicated position stream as a model's, opaque triangles first
+	std::vector<glm::vec3> positions;
+	std::vector<GLuint> indices;
+	std::unordered_map<glm::vec3, GLuint, PositionHash> lookup;
+	batch.opaqueIndexCount = 0;
+	for (const auto& range : batch.ranges) {
+		for (GLint i = range.first; i < range.first + range.count; i++) {
+			auto found = lookup.find(merged[i].pos);
+			if (found == lookup.end()) {
+				found = lookup.emplace(merged[i].pos, (GLuint)positions.size()).first;
+				positions.push_back(merged[i].pos);
+			}
+			indices.push_back(found->second);
+		}
+		if (!range.transparent)
+			batch.opaqueIndexCount = (GLsizei)indices.size();
+	}
+	batch.depthIndexCount = (GLsizei)indices.size();
+
+	setCpuMemory(MEMORY_LOADERS, "static batch build", merged.capacity() * sizeof(vertex) + positions.capacity() * sizeof(glm::vec3) +
+		indices.capacity() * sizeof(GLuint) + lookup.size() * (sizeof(glm::vec3) + sizeof(GLuint)));
+
+	// Baked vertices need no part transform, one identity covers every draw
+	glm::mat4 identity(1.f);
+	batch.partVBO = createBuffer();
+	trackedBufferStorage(batch.partVBO, sizeof(glm::mat4), glm::value_ptr(identity), 0, MEMORY_GEOMETRY, "static batch");
+
+	batch.VBO = createBuffer();
+	trackedBufferStorage(batch.VBO, merged.size() * sizeof(vertex), merged.data(), 0, MEMORY_GEOMETRY, "static batch");
+	batch.VAO = createVertexArray();
+	glBindVertexArray(batch.VAO);
+	glBindBuffer(GL_ARRAY_BUFFER, batch.VBO);
+	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(vertex), (void*)offsetof(vertex, pos));
+	glEnableVertexAttribArray(0);
+	glVertexAttribPointer(1, 4, GL_FLOAT, GL_FALSE, sizeof(vertex), (void*)offsetof(vertex, col));
+	glEnableVertexAttribArray(1);
+	glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, sizeof(vertex), (void*)offsetof(vertex, nor));
+	glEnableVertexAttribArray(2);
+	glVertexAttribPointer(3, 2, GL_FLOAT, GL_FALSE, sizeof(vertex), (void*)offsetof(vertex, tex));
+	glEnableVertexAttribArray(3);
+	glBindBuffer(GL_ARRAY_BUFFER, batch.partVBO);
+	for (int column = 0; column < 4; column++) {
+		glVertexAttribPointer(PART_TRANSFORM_LOCATION + column, 4, GL_FLOAT, GL_FALSE, sizeof(glm::mat4), (void*)(sizeof(glm::vec4) * column));
+		glEnableVertexAttribArray(PART_TRANSFORM_LOCATION + column);
+		glVertexAttribDivisor(PART_TRANSFORM_LOCATION + column, 1);
+	}
+
+	batch.depthVBO = createBuffer();
+	trackedBufferStorage(batch.depthVBO, positions.size() * sizeof(glm::vec3), positions.data(), 0, MEMORY_GEOMETRY, "static batch");
+	batch.depthEBO = createBuffer();
+	trackedBufferStorage(batch.depthEBO, indices.size() * sizeof(GLuint), indices.data(), 0, MEMORY_GEOMETRY, "static batch");
+	batch.depthVAO = createVertexArray();
+	glBindVertexArray(batch.depthVAO);
+	glBindBuffer(GL_ARRAY_BUFFER, batch.depthVBO);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, batch.depthEBO);
+	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(glm::vec3), (void*)0);
+	glEnableVertexAttribArray(0);
+	glBindBuffer(GL_ARRAY_BUFFER, batch.partVBO);
+	for (int column = 0; column < 4; column++) {
+		glVertexAttribPointer(PART_TRANSFORM_LOCATION + column, 4, GL_FLOAT, GL_FALSE, sizeof(glm::mat4), (void*)(sizeof(glm::vec4) * column));
+		glEnableVertexAttribArray(PART_TRANSFORM_LOCATION + column);
+		glVertexAttribDivisor(PART_TRANSFORM_LOCATION + column, 1);
+	}
+	glBindVertexArray(0);
+	setCpuMemory(MEMORY_LOADERS, "static batch build", 0);
+
+	// Baking repeats geometry the models already hold, in exchange for fewer draws
+	size_t batchBytes = merged.size() * sizeof(vertex) + positions.size() * sizeof(glm::vec3) + indices.size() * sizeof(GLuint);
+	printf("Static batch: %zu models, colour draws %zu -> %zu, depth draws %zu -> 1, %.2f MB extra on top of the models' %.2f MB\n",
+		batch.entities.size(), modelDraws, batch.ranges.size(), batch.entities.size(), batchBytes / 1048576.0, modelBytes / 1048576.0);
+
+	return batch;
+}
+
+// Baked vertices are already in world space
+void setStaticBatchUniforms(unsigned int program)
+{
+	glm::mat4 identity(1.f);
+	glm::mat3 normalIdentity(1.f);
+	glUniformMatrix4fv(glGetUniformLocation(program, "model"), 1, GL_FALSE, glm::value_ptr(identity));
+	glUniformMatrix3fv(glGetUniformLocation(program, "normalMatrix"), 1, GL_FALSE, glm::value_ptr(normalIdentity));
+	glUniformMatrix4fv(glGetUniformLocation(program, "mvp"), 1, GL_FALSE, glm::value_ptr(passMatrices.viewProjection));
+	glUniformMatrix4fv(glGetUniformLocation(program, "lightMvp"), 1, GL_FALSE, glm::value_ptr(passMatrices.lightSpace));
+}
+
+// One draw per material range of the layer
+void drawStaticBatchLayer(const StaticBatch& batch, MaterialPrograms programs, bool transparent_layer)
+{
+	glBindVertexArray(batch.VAO);
+	unsigned int current_program = 0;
+	for (const auto& range : batch.ranges) {
+		if (range.transparent != transparent_layer)
+			continue;
+
+		unsigned int program = range.textured ? programs.textured : programs.untextured;
+		if (program != current_program) {
+			glUseProgram(program);
+			setStaticBatchUniforms(program);
+			glUniform1i(glGetUniformLocation(program, "Texture"), 0);
+			current_program = program;
+		}
+		if (range.textured) {
+			glActiveTexture(GL_TEXTURE0);
+			glBindTexture(GL_TEXTURE_2D, range.texture);
+		}
+		glDrawArrays(GL_TRIANGLES, range.first, range.count);
+	}
+}
+
+// Every batched model in a single draw
+void drawStaticBatchDepth(const StaticBatch& batch, unsigned int shaderProgram, bool opaqueOnly = false)
+{
+	glUseProgram(shaderProgram);
+	glBindVertexArray(batch.depthVAO);
+	setStaticBatchUniforms(shaderProgram);
+	glDrawElements(GL_TRIANGLES, opaqueOnly ? batch.opaqueIndexCount : batch.depthIndexCount, GL_UNSIGNED_INT, 0);
+}
+
+bool staticBatchHasTransparency(const StaticBatch& batch)
+{
+	return batch.opaqueIndexCount < batch.depthIndexCount;
+}
@@ -1,9 +1,16 @@
 #pragma once
 
 #include <iostream>
+#include <memory>
+#include <string>
+#include <unordered_map>
 #include "stb_image.h"
+#include "gpu_resource.h"
+#include "memory_stats.h"
+#include "profiler.h"
 
 GLuint setup_texture(const char* filename) {
+	PROFILE_SCOPE("setup_texture");
 	glEnable(GL_TEXTURE_2D);
 	glEnable(GL_BLEND);
 
@@ -18,14 +25,21 @@ GLuint setup_texture(const char* filename) {
 
 	int w, h, chan;
 	stbi_set_flip_vertically_on_load(true);
-	unsigned char* pxls = stbi_load(filename, &w, &h, &chan, 0);
+	unsigned char* pxls;
+	{
+		PROFILE_SCOPE("texture decode");
+		pxls = stbi_load(filename, &w, &h, &chan, 0);
+	}
 	if (pxls) {
+		setCpuMemory(MEMORY_LOADERS, filename, (size_t)w * h * chan);
+		PROFILE_SCOPE("texture upload");
 		GLenum format = (chan == 4) ? GL_RGBA : GL_RGB;
-		glTexImage2D(GL_TEXTURE_2D, 0, format, w, h, 0, format, GL_UNSIGNED_BYTE, pxls);
-		glGenerateMipmap(GL_TEXTURE_2D);
+		trackedTexImage2D(texObject, 0, format, w, h, format, GL_UNSIGNED_BYTE, pxls, MEMORY_TEXTURES, filename);
+		trackedGenerateMipmap(texObject);
 	}
 
 	delete[] pxls;
+	setCpuMemory(MEMORY_LOADERS, filename, 0);
 
 	glDisable(GL_TEXTURE_2D);
 	glDisable(GL_BLEND);
@@ -53,9 +67,11 @@ GLuint setup_mipmaps(const char* filename[], int n) {
 		pxls[c] = stbi_load(filename[c], &w[c], &h[c], &chan[c], 0);
 
 		if (pxls[c]) {
-			glTexImage2D(GL_TEXTURE_2D, c, GL_RGB, w[c], h[c], 0, GL_RGB, GL_UNSIGNED_BYTE, pxls[c]);
+			setCpuMemory(MEMORY_LOADERS, filename[c], (size_t)w[c] * h[c] * chan[c]);
+			trackedTexImage2D(texObject, c, GL_RGB, w[c], h[c], GL_RGB, GL_UNSIGNED_BYTE, pxls[c], MEMORY_TEXTURES, filename[0]);
 		}
 		delete pxls[c];
+		setCpuMemory(MEMORY_LOADERS, filename[c], 0);
 	}
 
 
@@ -64,3 +80,57 @@ GLuint setup_mipmaps(const char* filename[], int n) {
 
 	return texObject;
 }
+
+// Textures shared between models and materials, loaded once and alive while anything holds them
+struct TextureRegistry {
+	std::unordered_map<std::string, std::weak_ptr<GpuTexture>> textures;
+	unsigned int loads = 0;
+	unsigned int shared = 0;
+};
+
+TextureRegistry textureRegistry;
+
+std::shared_ptr<GpuTexture> findRegisteredTexture(const std::string& key) {
+	auto found = textureRegistry.textures.find(key);
+	if (found == textureRegistry.textures.end())
+		return std::shared_ptr<GpuTexture>();
+
+	std::shared_ptr<GpuTexture> texture = found->second.lock();
+	if (texture)
+		textureRegistry.shared++;
+	return texture;
+}
+
+std::shared_ptr<GpuTexture> acquireTexture(const std::string& path) {
+	std::shared_ptr<GpuTexture> texture = findRegisteredTexture(path);
+	if (texture)
+		return texture;
+
+	texture = std::make_shared<GpuTexture>(setup_texture(path.c_str()));
+	textureRegistry.textures[path] = texture;
+	textureRegistry.loads++;
+	return texture;
+}
+
+// 1 x 1 white, bound for materials without a texture
+std::shared_ptr<GpuTexture> acquireWhiteTexture() {
+	std::shared_ptr<GpuTexture> texture = findRegisteredTexture("<white>");
+	if (texture)
+		return texture;
+
+	texture = std::make_shared<GpuTexture>(createTexture());
+	glBindTexture(GL_TEXTURE_2D, *texture);
+	unsigned char white[] = { 255, 255, 255, 255 };
+	trackedTexImage2D(*texture, 0, GL_RGBA, 1, 1, GL_RGBA, GL_UNSIGNED_BYTE, white, MEMORY_TEXTURES, "<white>");
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glBindTexture(GL_TEXTURE_2D, 0);
+
+	textureRegistry.textures["<white>"] = texture;
+	textureRegistry.loads++;
+	return texture;
+}
+
+void printTextureRegistryStats(FILE* out) {
+	fprintf(out, "Textures: %u loaded, %u shared instead of loaded again\n", textureRegistry.loads, textureRegistry.shared);
+}
@@ -0,0 +1,217 @@
+#pragma once
+
+#include <GL/gl3w.h>
+#include <glm/glm.hpp>
+#include <glm/gtc/type_ptr.hpp>
+
+#include <map>
+#include <stdio.h>
+#include <vector>
+
+#include "entities.h"
+#include "framebuffer.h"
+#include "gbuffer.h"
+#include "gpu_resource.h"
+#include "memory_stats.h"
+#include "model.h"
+
+// Shader storage binding points, must match vbuffer_classify.frag and vbuffer_resolve.frag
+#define VISIBILITY_VERTEX_BINDING 6
+#define VISIBILITY_TRIANGLE_BINDING 7
+#define VISIBILITY_DRAW_BINDING 8
+
+// IDs pack the draw into the top 9 bits and the triangle into the low 23, all ones is empty
+#define VISIBILITY_TRIANGLE_BITS 23
+#define VISIBILITY_EMPTY 0xFFFFFFFFu
+
+// Materials are classified by writing (index + 1) / 1024 as depth, which floats hold exactly
+#define VISIBILITY_MAX_MATERIALS 1023
+
+// std430 layout, transforms for vertex pulling, 144 bytes
+struct VisibilityDraw {
+	glm::mat4 model;
+	// mat3 columns are padded to vec4 in std430, so a mat4 is stored
+	glm::mat4 normalMatrix;
+	GLuint firstTriangle;
+	GLuint pad[3];
+};
+
+struct VisibilityMaterial {
+	Entity entity;
+	int material;
+};
+
+// Geometry pass writes only (draw, triangle) per sample, materials are shaded once per pixel afterwards
+struct VisibilityBuffer {
+	GpuFramebuffer FBO;
+	GpuTexture IDs;
+	// G-buffer colours plus a depth target holding each pixel's material
+	GpuFramebuffer MaterialFBO;
+	GpuTexture MaterialDepth;
+	GpuVertexArray VAO;
+
+	unsigned int geometryProgram, classifyProgram, resolveProgram;
+	GpuBuffer vertexBuffer, triangleBuffer, drawBuffer;
+
+	std::vector<Entity> draws;
+	std::vector<VisibilityMaterial> materials;
+	std::vector<VisibilityDraw> drawData;
+};
+
+// Concatenates the opaque geometry of the entities' meshes into scene wide buffers for vertex pulling
+VisibilityBuffer setup_visibility_buffer(const SceneStruct& scene, const GBufferStruct& gbuffer, unsigned int geometryProgram,
+	unsigned int classifyProgram, unsigned int resolveProgram, EntityStore* store, const std::vector<Entity>& entities)
+{
+	VisibilityBuffer visibility;
+	visibility.geometryProgram = geometryProgram;
+	visibility.classifyProgram = classifyProgram;
+	visibility.resolveProgram = resolveProgram;
+
+	std::vector<vertex> vertices;
+	std::vector<glm::uvec2> triangles;
+	for (Entity entity : entities) {
+		const model& m = store->meshes[store->mesh[entity]];
+		if (!m.hasCpuGeometry()) {
+			fprintf(stderr, "Visibility buffer: %s has released its CPU geometry, not drawn\n", store->names[entity].c_str());
+			continue;
+		}
+		visibility.draws.push_back(entity);
+		GLuint firstVertex = (GLuint)vertices.size();
+
+		VisibilityDraw draw = {};
+		draw.firstTriangle = (GLuint)triangles.size();
+		visibility.drawData.push_back(draw);
+
+		// Only materials with opaque triangles get a resolve pass
+		std::map<unsigned int, GLuint> globalMaterial;
+		for (const auto& triangle : m.getVisibilityTriangles()) {
+			auto found = globalMaterial.find(triangle.y);
+			if (found == globalMaterial.end()) {
+				VisibilityMaterial material = { entity, (int)triangle.y };
+				found = globalMaterial.emplace(triangle.y, (GLuint)visibility.materials.size()).first;
+				visibility.materials.push_back(material);
+			}
+			triangles.push_back(glm::uvec2(firstVertex + triangle.x, found->second));
+		}
+
+		vertices.insert(vertices.end(), m.getVertices().begin(), m.getVertices().end());
+	}
+
+	if (visibility.draws.size() > (1u << (32 - VISIBILITY_TRIANGLE_BITS)) || visibility.materials.size() > VISIBILITY_MAX_MATERIALS)
+		fprintf(stderr, "Visibility buffer: too many draws or materials\n");
+
+	visibility.vertexBuffer = createBuffer();
+	trackedBufferStorage(visibility.vertexBuffer, vertices.size() * sizeof(vertex), vertices.data(), 0, MEMORY_GEOMETRY, "visibility vertices");
+	visibility.triangleBuffer = createBuffer();
+	trackedBufferStorage(visibility.triangleBuffer, triangles.size() * sizeof(glm::uvec2), triangles.data(), 0, MEMORY_GEOMETRY, "visibility triangles");
+	visibility.drawBuffer = createBuffer();
+	trackedBufferStorage(visibility.drawBuffer, visibility.drawData.size() * sizeof(VisibilityDraw), NULL, GL_DYNAMIC_STORAGE_BIT, MEMORY_SCENE_BUFFERS, "visibility draws");
+
+	visibility.IDs = createTexture();
+	glBindTexture(GL_TEXTURE_2D_MULTISAMPLE, visibility.IDs);
+	trackedTexImage2DMultisample(visibility.IDs, scene.samples, GL_R32UI, scene.width, scene.height, MEMORY_RENDER_TARGETS, "visibility IDs");
+	visibility.MaterialDepth = createTexture();
+	glBindTexture(GL_TEXTURE_2D_MULTISAMPLE, visibility.MaterialDepth);
+	trackedTexImage2DMultisample(visibility.MaterialDepth, scene.samples, GL_DEPTH_COMPONENT32F, scene.width, scene.height, MEMORY_RENDER_TARGETS, "visibility material depth");
+	glBindTexture(GL_TEXTURE_2D_MULTISAMPLE, 0);
+
+	visibility.FBO = createFramebuffer();
+	glBindFramebuffer(GL_FRAMEBUFFER, visibility.FBO);
+	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D_MULTISAMPLE, visibility.IDs, 0);
+	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D_MULTISAMPLE, scene.Depth, 0);
+	if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+		fprintf(stderr, "Visibility framebuffer incomplete\n");
+
+	visibility.MaterialFBO = createFramebuffer();
+	glBindFramebuffer(GL_FRAMEBUFFER, visibility.MaterialFBO);
+	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D_MULTISAMPLE, gbuffer.AlbedoAlpha, 0);
+	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1, GL_TEXTURE_2D_MULTISAMPLE, gbuffer.Normal, 0);
+	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT2, GL_TEXTURE_2D_MULTISAMPLE, gbuffer.Material, 0);
+	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D_MULTISAMPLE, visibility.MaterialDepth, 0);
+	GLenum buffers[] = { GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1, GL_COLOR_ATTACHMENT2 };
+	glDrawBuffers(3, buffers);
+	if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+		fprintf(stderr, "Visibility material framebuffer incomplete\n");
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+	visibility.VAO = createVertexArray();
+
+	printf("Visibility buffer: %zu draws, %zu triangles, %zu materials\n",
+		visibility.draws.size(), triangles.size(), visibility.materials.size());
+
+	return visibility;
+}
+
+// Depth and (draw, triangle) IDs of the opaque geometry, one position-only draw per entity in the frustum
+void drawVisibility(VisibilityBuffer& visibility, EntityStore* store)
+{
+	static const GLuint empty[] = { VISIBILITY_EMPTY, 0, 0, 0 };
+
+	glBindFramebuffer(GL_FRAMEBUFFER, visibility.FBO);
+	glClearBufferuiv(GL_COLOR, 0, empty);
+	glDisable(GL_BLEND);
+
+	glUseProgram(visibility.geometryProgram);
+	GLint drawLoc = glGetUniformLocation(visibility.geometryProgram, "drawID");
+	for (size_t i = 0; i < visibility.draws.size(); i++) {
+		Entity entity = visibility.draws[i];
+		if (!hasFlags(*store, entity, ENTITY_VISIBLE))
+			continue;
+		glUniform1ui(drawLoc, (GLuint)i);
+		entityMesh(*store, entity).drawDepth(visibility.geometryProgram, true);
+	}
+}
+
+// Shades each covered pixel once per material into the G-buffer, ready for deferredLighting
+void resolveVisibility(VisibilityBuffer& visibility, EntityStore* store, glm::mat4 viewProjection)
+{
+	for (size_t i = 0; i < visibility.draws.size(); i++) {
+		const glm::mat4& modelMat = store->world[visibility.draws[i]];
+		visibility.drawData[i].model = modelMat;
+		visibility.drawData[i].normalMatrix = glm::mat4(glm::transpose(glm::inverse(glm::mat3(modelMat))));
+	}
+	glNamedBufferSubData(visibility.drawBuffer, 0, visibility.drawData.size() * sizeof(VisibilityDraw), visibility.drawData.data());
+
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, VISIBILITY_VERTEX_BINDING, visibility.vertexBuffer);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, VISIBILITY_TRIANGLE_BINDING, visibility.triangleBuffer);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, VISIBILITY_DRAW_BINDING, visibility.drawBuffer);
+
+	glActiveTexture(GL_TEXTURE2);
+	glBindTexture(GL_TEXTURE_2D_MULTISAMPLE, visibility.IDs);
+
+	glBindFramebuffer(GL_FRAMEBUFFER, visibility.MaterialFBO);
+	glBindVertexArray(visibility.VAO);
+
+	// Classify, each pixel's material becomes its depth
+	glClear(GL_DEPTH_BUFFER_BIT);
+	glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+	glDepthFunc(GL_ALWAYS);
+
+	glUseProgram(visibility.classifyProgram);
+	glUniform1i(glGetUniformLocation(visibility.classifyProgram, "visibilityTexture"), 2);
+	glDrawArrays(GL_TRIANGLES, 0, 3);
+
+	glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+
+	// Resolve, a full screen triangle per material at its depth, early depth testing rejects every other pixel
+	glDepthFunc(GL_EQUAL);
+	glDepthMask(GL_FALSE);
+
+	glUseProgram(visibility.resolveProgram);
+	glUniform1i(glGetUniformLocation(visibility.resolveProgram, "visibilityTexture"), 2);
+	glUniform1i(glGetUniformLocation(visibility.resolveProgram, "Texture"), 0);
+	glUniformMatrix4fv(glGetUniformLocation(visibility.resolveProgram, "viewProjection"), 1, GL_FALSE, glm::value_ptr(viewProjection));
+	GLint materialLoc = glGetUniformLocation(visibility.resolveProgram, "materialIndex");
+
+	glActiveTexture(GL_TEXTURE0);
+	for (size_t i = 0; i < visibility.materials.size(); i++) {
+		const VisibilityMaterial& material = visibility.materials[i];
+		glBindTexture(GL_TEXTURE_2D, store->meshes[store->mesh[material.entity]].getMaterialTexture(material.material));
+		glUniform1ui(materialLoc, (GLuint)i);
+		glDrawArrays(GL_TRIANGLES, 0, 3);
+	}
+
+	glBindVertexArray(0);
+	glDepthFunc(GL_LESS);
+	glDepthMask(GL_TRUE);
+}